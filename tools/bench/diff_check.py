@@ -0,0 +1,561 @@
+#!/usr/bin/env python
+"""Differential check of cppmatch and make_heatmap against a reference build
+
+The reference is built from a git revision, by default the first commit of
+the repository, whose cppmatch scans the DB linearly and whose tools parse
+with istringstream on one thread.  Every case is run by the reference once
+and by the tools under test once per variant (thread counts, --sorted, an
+index, gzip input, --max-mem, batch mode, --prefix-sums and any engine
+options given), and the outputs are compared after sorting their lines,
+numbers within a relative tolerance.  --dedup is checked against the most hits per symbol of
+the reference output and --window on the annotation tools/tss2db.pl -a writes
+against the reference run on its -r/-f DB file.
+"""
+
+from __future__ import print_function
+
+import gzip
+import itertools
+import os
+import re
+import shutil
+import subprocess
+import sys
+from optparse import OptionParser
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TOOLS = os.path.dirname(HERE)
+#both tools print numbers with ostream's default 6 significant digits, sums
+#added in a different order may differ by one in the last of them
+PRINTED_DIGITS = 6
+
+
+def git_root_commit():
+    out = subprocess.check_output(["git", "rev-list", "--max-parents=0",
+        "HEAD"], cwd=TOOLS)
+    return out.decode().split()[-1]
+
+
+def build_reference(rev, out):
+    """compile the reference tools of a revision, -O0 as the early cppmatch
+    falls off the end of non-void functions, which -O3 turns into a crash"""
+    if not os.path.isdir(out):
+        os.makedirs(out)
+    sources = [("cppmatch", "tools/cppmatch_osx.cpp"),
+        ("make_heatmap", "tools/heatmap/make_heatmap.cpp")]
+    for name, path in sources:
+        source = os.path.join(out, name + ".cpp")
+        with open(source, "wb") as f:
+            f.write(subprocess.check_output(["git", "show", rev + ":" + path],
+                cwd=TOOLS))
+        subprocess.check_call(["g++", "-O0", "-w", "-o",
+            os.path.join(out, name), source, "-lpthread", "-lz"])
+
+
+def run(args, cwd, stdin=None):
+    """exit status and stdout of a run"""
+    proc = subprocess.Popen(args, cwd=cwd, stdin=stdin, stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT)
+    out = proc.communicate()[0].decode(errors="replace")
+    return proc.returncode, out
+
+
+def as_number(field):
+    try:
+        return float(field)
+    except ValueError:
+        return None
+
+
+def canonical(path):
+    """the lines of a file split into fields, sorted by their text fields
+    and then their whole text so float formatting cannot reorder them, input
+    file names echoed into headers lose a .gz so gzip runs compare equal"""
+    opener = gzip.open if path.endswith(".gz") else open
+    with opener(path, "rb") as f:
+        lines = f.read().decode().splitlines()
+    lines = [re.sub(r"\.gz\b", "", line) for line in lines]
+    rows = [line.split("\t") for line in lines]
+    rows.sort(key=lambda r: ([x for x in r if as_number(x) is None], r))
+    return rows
+
+
+def same_file(ref, new, tolerance):
+    """None if the files hold the same lines, otherwise the first difference"""
+    a = canonical(ref)
+    b = canonical(new)
+    if len(a) != len(b):
+        return "%d lines against %d" % (len(a), len(b))
+    for ra, rb in zip(a, b):
+        if len(ra) != len(rb):
+            return "line differs:\n  %s\n  %s" % ("\t".join(ra), "\t".join(rb))
+        for x, y in zip(ra, rb):
+            if x == y:
+                continue
+            fx = as_number(x)
+            fy = as_number(y)
+            #purely relative, so two zeros must be equal and small values
+            #such as densities are held to their printed digits too
+            if fx is None or fy is None or \
+                    abs(fx - fy) > tolerance * max(abs(fx), abs(fy)):
+                return "line differs:\n  %s\n  %s" % ("\t".join(ra),
+                    "\t".join(rb))
+    return None
+
+
+class Checker:
+    def __init__(self, work, tolerance, keep):
+        self.work = work
+        self.tolerance = tolerance
+        self.keep = keep
+        self.cases = 0
+        self.failures = 0
+        self.rejected = 0
+
+    def fresh(self, name):
+        path = os.path.join(self.work, "runs", name)
+        if os.path.isdir(path):
+            shutil.rmtree(path)
+        os.makedirs(path)
+        return path
+
+    def compare(self, name, ref_dir, new_dir, names):
+        """compare each reference file with the one the variant wrote for it,
+        names maps reference file names to the variant's"""
+        self.cases += 1
+        problems = []
+        for ref_name in sorted(os.listdir(ref_dir)):
+            if ref_name == "log":
+                continue
+            new_name = names.get(ref_name, ref_name)
+            if new_name is None:
+                continue
+            new_path = os.path.join(new_dir, new_name)
+            if not os.path.exists(new_path):
+                problems.append("%s not written" % new_name)
+                continue
+            diff = same_file(os.path.join(ref_dir, ref_name), new_path,
+                self.tolerance)
+            if diff is not None:
+                problems.append("%s: %s" % (new_name, diff))
+        if problems:
+            self.failures += 1
+            print("FAIL %s" % name)
+            for p in problems:
+                print("  " + p)
+        return not problems
+
+
+def gzip_copy(src, dst):
+    with open(src, "rb") as f, gzip.open(dst, "wb") as g:
+        g.write(f.read())
+
+
+def tss2db(args, tss, out):
+    """run tools/tss2db.pl on the transcripts, returns the file it wrote"""
+    proc = subprocess.Popen(["perl", os.path.join(TOOLS, "tss2db.pl"),
+        "-i", tss, "-o", out] + args, stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT)
+    proc.communicate()
+    if proc.returncode != 0:
+        sys.exit("tss2db.pl %s failed" % " ".join(args))
+    name = "genes.annotation" if "-a" in args else \
+        "genes_+%s_-%s.db_file" % (args[args.index("-f") + 1],
+        args[args.index("-r") + 1])
+    return os.path.join(out, name)
+
+
+def first_fields(path):
+    """the set of first fields of a file's lines"""
+    with open(path) as f:
+        return set(line.split("\t", 1)[0] for line in f)
+
+
+def drop_rows(path, ids):
+    """the lines of a file whose first field is not one of ids"""
+    with open(path) as f:
+        return [line for line in f if line.split("\t", 1)[0] not in ids]
+
+
+def dedup_symbols(path):
+    """the most hits of each gene symbol (desc2 up to its last ':') in a
+    cppmatch output file, lines without hits left out as deduplicate.pl
+    does, the line kept for a tie is not compared"""
+    total_header = "db_file.desc1\tdb_file.desc2\thits"
+    with open(path) as f:
+        text = f.read()
+    if text.startswith(total_header):
+        #the reference's -s bs antisense totals lack the header's newline
+        rows = text[len(total_header):].lstrip("\n").splitlines()
+        col = 2
+    else:
+        lines = text.splitlines()
+        if not lines:
+            return []
+        rows = lines[1:]
+        col = lines[0].split("\t").index("q.hits")
+    best = {}
+    for line in rows:
+        fields = line.split("\t")
+        if fields[col] == "":
+            continue
+        colon = fields[1].rfind(":")
+        symbol = fields[1][:colon] if 0 <= colon < len(fields[1]) - 1 \
+            else fields[1]
+        best[symbol] = max(best.get(symbol, 0), int(fields[col]))
+    return sorted("%s\t%d\n" % item for item in best.items())
+
+
+def write_lines(path, lines):
+    with open(path, "w") as f:
+        f.writelines(lines)
+
+
+def run_piped(args, path, cwd):
+    """run with path piped to its standard input, named /dev/stdin in args"""
+    cat = subprocess.Popen(["cat", path], stdout=subprocess.PIPE)
+    status, out = run(args, cwd, cat.stdout)
+    cat.stdout.close()
+    cat.wait()
+    return status, out
+
+
+def same_bytes(a, b):
+    with open(a, "rb") as f, open(b, "rb") as g:
+        return f.read() == g.read()
+
+
+def check_cppmatch(c, ref, new, data, threads, variants):
+    db = os.path.join(data, "db.txt")
+    query = os.path.join(data, "query.txt")
+    db_gz = os.path.join(data, "db.txt.gz")
+    query_gz = os.path.join(data, "query_gz.txt.gz")
+    #--window 2000,500 reads the annotation of every transcript and matches
+    #what tss2db.pl -r 2000 -f 500 writes, plus the transcripts that drops
+    #for a tss inside an earlier window of the same symbol
+    tss = os.path.join(data, "genes.tss")
+    annotation = tss2db(["-a"], tss, c.work)
+    db_window = tss2db(["-r", "2000", "-f", "500"], tss, c.work)
+    dropped = first_fields(annotation) - first_fields(db_window)
+    #four renamed copies of the query, every hit of a copy ties with the same
+    #hit of the others and the piped copy is read in several batches
+    query_copies = os.path.join(c.work, "query_copies.txt")
+    with open(query) as f:
+        lines = f.readlines()
+    write_lines(query_copies, ["c%d_%s" % (k, line) for k in range(4)
+        for line in lines])
+    detail_files = ["res", "res_sense", "res_antisense"]
+    for mode in ["i", "s", "o", "bf", "bs"]:
+        ref_dir = c.fresh("cppmatch_%s_ref" % mode)
+        status, out = run([ref, "-s", mode, db, query, "res"], ref_dir)
+        if status != 0:
+            print("FAIL reference cppmatch -s %s exited %d" % (mode, status))
+            c.failures += 1
+            continue
+        index = os.path.join(c.fresh("cppmatch_%s_index" % mode), "db.idx")
+        run([new, "-s", mode, "--build-index", index, db], c.work)
+
+        #(name, options, DB, query, output names against the reference's)
+        cases = [("t%d" % t, ["-t", str(t)], db, query, {}) for t in threads]
+        #a 16K --max-mem holds about one chromosome of the DB, so the DB is
+        #cached and the query matched in many groups
+        cases += [
+            ("sorted", ["--sorted"], db, query, {}),
+            ("index", ["--index", index], db, query, {}),
+            ("gzip", ["-t", str(max(threads))], db_gz, query_gz, {}),
+            ("max_mem", ["--max-mem", "64"], db, query, {}),
+            ("max_mem_split", ["--max-mem", "16K", "-t", str(max(threads))],
+                db, query, {}),
+            ("max_mem_gzip", ["--max-mem", "16K", "-t", str(max(threads))],
+                db_gz, query_gz, {}),
+            ("sort", ["--sort"], db, query, {}),
+            ("totals_only", ["--totals-only"], db, query,
+                dict((f, None) for f in detail_files)),
+        ]
+        cases += [("variant%d" % i, v.split(), db, query, {})
+            for i, v in enumerate(variants)]
+        for name, opts, db_file, query_file, names in cases:
+            new_dir = c.fresh("cppmatch_%s_%s" % (mode, name))
+            status, out = run([new, "-s", mode] + opts +
+                [db_file, query_file, "res"], new_dir)
+            if status != 0:
+                print("FAIL cppmatch -s %s %s exited %d" % (mode, " ".join(opts),
+                    status))
+                print("  " + out.strip().replace("\n", "\n  "))
+                c.failures += 1
+                continue
+            if c.compare("cppmatch -s %s %s" % (mode, " ".join(opts)), ref_dir,
+                    new_dir, names) and not c.keep:
+                shutil.rmtree(new_dir)
+
+        #--dedup, each _deduplicated file against the most hits per symbol of
+        #the reference's file
+        new_dir = c.fresh("cppmatch_%s_dedup" % mode)
+        status, out = run([new, "-s", mode, "-t", str(max(threads)), "--dedup",
+            db, query, "res"], new_dir)
+        if status != 0:
+            print("FAIL cppmatch -s %s --dedup exited %d" % (mode, status))
+            print("  " + out.strip().replace("\n", "\n  "))
+            c.failures += 1
+        else:
+            want_dir = c.fresh("cppmatch_%s_dedup_want" % mode)
+            got_dir = c.fresh("cppmatch_%s_dedup_got" % mode)
+            for ref_name in os.listdir(ref_dir):
+                if ref_name == "log":
+                    continue
+                write_lines(os.path.join(want_dir, ref_name),
+                    dedup_symbols(os.path.join(ref_dir, ref_name)))
+                got = os.path.join(new_dir, ref_name + "_deduplicated")
+                if os.path.exists(got):
+                    write_lines(os.path.join(got_dir, ref_name),
+                        dedup_symbols(got))
+            if c.compare("cppmatch -s %s --dedup" % mode, want_dir, got_dir,
+                    {}) and not c.keep:
+                for d in [new_dir, want_dir, got_dir]:
+                    shutil.rmtree(d)
+
+        #--dedup breaks ties by input order, so piped and threaded runs must
+        #keep the same lines in the same order as a mapped one
+        order_dirs = [c.fresh("cppmatch_%s_dedup_order%d" % (mode, k))
+            for k in range(3)]
+        args = [new, "-s", mode, "--dedup", db]
+        statuses = [run(args + [query_copies, "res"], order_dirs[0])[0],
+            run_piped(args + ["/dev/stdin", "res"], query_copies,
+                order_dirs[1])[0],
+            run_piped(args[:1] + ["-t", str(max(threads))] + args[1:] +
+                ["/dev/stdin", "res"], query_copies, order_dirs[2])[0]]
+        c.cases += 1
+        problems = [name for name in sorted(os.listdir(order_dirs[0]))
+            if name.endswith("_deduplicated") and not all(
+                same_bytes(os.path.join(order_dirs[0], name),
+                os.path.join(d, name)) for d in order_dirs[1:])]
+        if any(statuses) or problems:
+            c.failures += 1
+            print("FAIL cppmatch -s %s --dedup piped input: exited %s, %s "
+                "differ" % (mode, statuses, ", ".join(problems)))
+        elif not c.keep:
+            for d in order_dirs:
+                shutil.rmtree(d)
+
+        #--window on the annotation against the reference run on the
+        #tss2db.pl DB file, less the transcripts tss2db.pl dropped, detail
+        #lines print the DB line as given so only totals compare
+        window_ref = c.fresh("cppmatch_%s_window_ref" % mode)
+        new_dir = c.fresh("cppmatch_%s_window" % mode)
+        ref_status, out = run([ref, "-s", mode, db_window, query, "res"],
+            window_ref)
+        status, out = run([new, "-s", mode, "-t", str(max(threads)),
+            "--window", "2000,500", annotation, query, "res"], new_dir)
+        if ref_status != 0 or status != 0:
+            print("FAIL cppmatch -s %s --window exited %d, reference %d" %
+                (mode, status, ref_status))
+            c.failures += 1
+        else:
+            got_dir = c.fresh("cppmatch_%s_window_got" % mode)
+            for name in os.listdir(new_dir):
+                if name.endswith("_total"):
+                    write_lines(os.path.join(got_dir, name),
+                        drop_rows(os.path.join(new_dir, name), dropped))
+            if c.compare("cppmatch -s %s --window 2000,500" % mode, window_ref,
+                    got_dir, dict((f, None) for f in detail_files)) and \
+                    not c.keep:
+                for d in [new_dir, window_ref, got_dir]:
+                    shutil.rmtree(d)
+
+        #batch names its files after the prefix and query file, the second
+        #sample reads the gzip copy
+        new_dir = c.fresh("cppmatch_%s_batch" % mode)
+        status, out = run([new, "-s", mode, "-t", str(max(threads)),
+            "--batch", "p_", db, query, query_gz], new_dir)
+        if status != 0:
+            print("FAIL cppmatch -s %s --batch exited %d" % (mode, status))
+            print("  " + out.strip().replace("\n", "\n  "))
+            c.failures += 1
+        passed = True
+        for sample in ["query", "query_gz"]:
+            names = {"res": "p_" + sample,
+                "res_total": "p_%s_total" % sample,
+                "res_sense": "p_%s_sense" % sample,
+                "res_antisense": "p_%s_antisense" % sample,
+                "res_sense_total": "p_%s_sense_total" % sample,
+                "_total": "p_%s_antisense_total" % sample}
+            if status == 0:
+                passed = c.compare("cppmatch -s %s --batch (%s)" % (mode,
+                    sample), ref_dir, new_dir, names) and passed
+        if status == 0 and passed and not c.keep:
+            shutil.rmtree(new_dir)
+        if not c.keep:
+            shutil.rmtree(ref_dir)
+
+
+#every value make_heatmap accepts for the options under test
+HEATMAP_OPTIONS = [
+    ("-s", "sob"),
+    ("-l", "sepdc"),
+    ("-a", "sepdu"),
+    ("-v", "tad"),
+    ("-d", "gp"),
+    ("-b", "fcv"),
+]
+
+#hit inputs as (name, arguments before the gene list)
+HEATMAP_HITS = [
+    ("g", ["-h", "g", "hits.bg"]),
+    ("b", ["-h", "b", "hits.bed"]),
+    ("e", ["-h", "e", "hits.ebed"]),
+    ("c", ["-h", "c", "hits.cpp"]),
+    ("pm", ["-p", "plus.bg", "-m", "minus.bg"]),
+    ("p", ["-p", "plus.bg"]),
+    ("m", ["-m", "minus.bg"]),
+]
+
+
+def heatmap_args(data, combo, hits, output, gz):
+    """full argument list of a make_heatmap run, bin arguments follow the -b
+    type, gz swaps in the gzip copies of the hit files"""
+    opts = []
+    for (flag, values), value in zip(HEATMAP_OPTIONS, combo):
+        opts += [flag, value]
+    files = []
+    for a in hits:
+        if a.startswith("-"):
+            files.append(a)
+        else:
+            files.append(os.path.join(data, a + (".gz" if gz else "")))
+    opts += files + [os.path.join(data, "genes.txt"), output]
+    bin_type = combo[-1]
+    if bin_type == "f":
+        opts.append(os.path.join(data, "bins.txt"))
+    elif bin_type == "c":
+        opts += ["--", "-5000", "250", "40"]
+    else:
+        opts.append("30")
+    return opts
+
+
+def check_make_heatmap(c, ref, new, data, threads, variants):
+    """every combination of the options, each with the first hit input in a
+    rotating order that the reference accepts for it"""
+    combos = list(itertools.product(*[v for f, v in HEATMAP_OPTIONS]))
+    runs = [("t%d" % t, ["-t", str(t)], False) for t in threads]
+    #gzip input runs on every fifth combination, coprime with the rotation of
+    #the hit inputs so each input is read compressed
+    gzip_run = ("gzip", ["-t", str(max(threads))], True)
+    runs.append(("prefix", ["-t", str(max(threads)), "--prefix-sums"], False))
+    runs += [("variant%d" % i, v.split(), False)
+        for i, v in enumerate(variants)]
+    for n, combo in enumerate(combos):
+        label = " ".join("%s %s" % (f, v)
+            for (f, vs), v in zip(HEATMAP_OPTIONS, combo))
+        ref_dir = c.fresh("heatmap_ref")
+        accepted = None
+        for k in range(len(HEATMAP_HITS)):
+            hit_name, hits = HEATMAP_HITS[(n + k) % len(HEATMAP_HITS)]
+            status, out = run([ref] + heatmap_args(data, combo, hits,
+                os.path.join(ref_dir, "heatmap"), False), ref_dir)
+            if status == 0 and "Error" not in out:
+                accepted = (hit_name, hits)
+                break
+        if accepted is None:
+            #the reference rejects the combination with every input, so must
+            #the tools under test
+            c.rejected += 1
+            status, out = run([new] + heatmap_args(data, combo,
+                HEATMAP_HITS[0][1], os.path.join(ref_dir, "heatmap"), False),
+                ref_dir)
+            c.cases += 1
+            if status == 0 and "Error" not in out:
+                c.failures += 1
+                print("FAIL make_heatmap %s is accepted, the reference rejects"
+                    " it" % label)
+            continue
+        hit_name, hits = accepted
+        for name, opts, gz in runs + ([gzip_run] if n % 5 == 0 else []):
+            new_dir = c.fresh("heatmap_%s" % name)
+            status, out = run([new] + opts + heatmap_args(data, combo, hits,
+                os.path.join(new_dir, "heatmap"), gz), new_dir)
+            case = "make_heatmap %s %s (%s)" % (" ".join(opts), label, hit_name)
+            if status != 0:
+                c.failures += 1
+                print("FAIL %s exited %d" % (case, status))
+                continue
+            #a failed run is kept under the combination's number
+            if not c.compare(case, ref_dir, new_dir, {}):
+                shutil.copytree(ref_dir, new_dir + "_%d_ref" % n)
+                os.rename(new_dir, new_dir + "_%d" % n)
+        if not c.keep:
+            shutil.rmtree(ref_dir)
+
+
+def main():
+    parser = OptionParser(usage="%prog [options]")
+    parser.add_option("-b", "--bin-dir", default=".",
+        help="directory holding the cppmatch and make_heatmap under test "
+        "[%default]")
+    parser.add_option("-r", "--ref-dir",
+        help="directory holding reference builds, otherwise they are built "
+        "from --ref-rev")
+    parser.add_option("--ref-rev",
+        help="git revision the reference is built from [first commit]")
+    parser.add_option("-w", "--work", default="check_data",
+        help="directory for the inputs, reference builds and runs [%default]")
+    parser.add_option("-t", "--threads", default="1,3",
+        help="comma separated thread counts to run the tools with [%default]")
+    parser.add_option("--tolerance", type="float",
+        default=10.0 ** (1 - PRINTED_DIGITS),
+        help="relative difference allowed between numbers, one in the last "
+        "printed digit [%default]")
+    parser.add_option("--cppmatch-variant", action="append", default=[],
+        help="extra cppmatch options to check as a variant, repeatable")
+    parser.add_option("--heatmap-variant", action="append", default=[],
+        help="extra make_heatmap options to check as a variant, repeatable")
+    parser.add_option("--only", choices=["cppmatch", "make_heatmap"],
+        help="check only one of the tools")
+    parser.add_option("-k", "--keep", action="store_true",
+        help="keep the outputs of every run rather than only failing ones")
+    (options, args) = parser.parse_args()
+
+    work = os.path.abspath(options.work)
+    data = os.path.join(work, "data")
+    #the gzip query copy is written last, genes.tss is missing from
+    #workloads written before it was added
+    if not os.path.exists(os.path.join(data, "query_gz.txt.gz")) or \
+            not os.path.exists(os.path.join(data, "genes.tss")):
+        #small enough that every combination runs quickly, large enough that
+        #every chromosome has genes on both strands
+        subprocess.check_call([sys.executable,
+            os.path.join(HERE, "gen_workload.py"), "--genes", "600",
+            "--hits", "20000", "--seed", "7", data])
+        for name in ["db.txt", "hits.bg", "hits.bed", "hits.ebed", "hits.cpp",
+                "plus.bg", "minus.bg"]:
+            gzip_copy(os.path.join(data, name),
+                os.path.join(data, name + ".gz"))
+        #named apart from query.txt so batch mode can read both
+        gzip_copy(os.path.join(data, "query.txt"),
+            os.path.join(data, "query_gz.txt.gz"))
+
+    if options.ref_dir:
+        ref_dir = os.path.abspath(options.ref_dir)
+    else:
+        ref_dir = os.path.join(work, "ref")
+        build_reference(options.ref_rev or git_root_commit(), ref_dir)
+    bin_dir = os.path.abspath(options.bin_dir)
+    threads = [int(t) for t in options.threads.split(",")]
+
+    c = Checker(work, options.tolerance, options.keep)
+    if options.only != "make_heatmap":
+        check_cppmatch(c, os.path.join(ref_dir, "cppmatch"),
+            os.path.join(bin_dir, "cppmatch"), data, threads,
+            options.cppmatch_variant)
+    if options.only != "cppmatch":
+        check_make_heatmap(c, os.path.join(ref_dir, "make_heatmap"),
+            os.path.join(bin_dir, "make_heatmap"), data, threads,
+            options.heatmap_variant)
+
+    print("%d cases, %d failed, %d option combinations rejected by both" %
+        (c.cases, c.failures, c.rejected))
+    sys.exit(1 if c.failures else 0)
+
+
+if __name__ == "__main__":
+    main()
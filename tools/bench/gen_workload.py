@@ -0,0 +1,184 @@
+#!/usr/bin/env python
+"""Write a deterministic synthetic workload for cppmatch and make_heatmap"""
+
+from __future__ import print_function
+
+import os
+import random
+from optparse import OptionParser
+
+#hg19 chromosome lengths, genes and hits are spread over the chromosomes in
+#proportion to these, chrY gets fewer genes as it does in the real genome
+CHROMOSOMES = [
+    ("chr1", 249250621), ("chr2", 243199373), ("chr3", 198022430),
+    ("chr4", 191154276), ("chr5", 180915260), ("chr6", 171115067),
+    ("chr7", 159138663), ("chr8", 146364022), ("chr9", 141213431),
+    ("chr10", 135534747), ("chr11", 135006516), ("chr12", 133851895),
+    ("chr13", 115169878), ("chr14", 107349540), ("chr15", 102531392),
+    ("chr16", 90354753), ("chr17", 81195210), ("chr18", 78077248),
+    ("chr19", 59128983), ("chr20", 63025520), ("chr21", 48129895),
+    ("chr22", 51304566), ("chrX", 155270560), ("chrY", 59373566),
+]
+GENE_WEIGHT = {"chrY": 0.1}
+
+
+def pick_chromosome(rng, cumulative, total):
+    """a chromosome index drawn in proportion to the weights"""
+    x = rng.random() * total
+    lo, hi = 0, len(cumulative) - 1
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if cumulative[mid] < x:
+            lo = mid + 1
+        else:
+            hi = mid
+    return lo
+
+
+def weights(gene):
+    """cumulative chromosome weights for genes or hits"""
+    cumulative = []
+    total = 0.0
+    for name, length in CHROMOSOMES:
+        total += length * (GENE_WEIGHT.get(name, 1.0) if gene else 1.0)
+        cumulative.append(total)
+    return cumulative, total
+
+
+def make_genes(rng, count, isoforms):
+    """genes as (chr index, tss, strand, symbol, id), a symbol has one to
+    isoforms transcripts whose tss are close together, as known gene has"""
+    cumulative, total = weights(True)
+    genes = []
+    symbol = 0
+    while len(genes) < count:
+        c = pick_chromosome(rng, cumulative, total)
+        tss = rng.randint(20000, CHROMOSOMES[c][1] - 20000)
+        strand = rng.choice("+-")
+        for i in range(rng.randint(1, isoforms)):
+            if len(genes) == count:
+                break
+            genes.append((c, tss + rng.randint(-300, 300) * i, strand,
+                "SYM%d" % symbol, "NM_%06d" % len(genes)))
+        symbol += 1
+    genes.sort()
+    return genes
+
+
+def make_hits(rng, count, genes, near):
+    """hits as (chr index, start, end, value, strand), a share of them lands
+    within 5kb of a tss the way ChIP-Seq reads pile up near promoters"""
+    cumulative, total = weights(False)
+    hits = []
+    for i in range(count):
+        if genes and rng.random() < near:
+            c, tss = rng.choice(genes)[:2]
+            start = max(1, tss + int(rng.gauss(0, 2000)))
+        else:
+            c = pick_chromosome(rng, cumulative, total)
+            start = rng.randint(1, CHROMOSOMES[c][1] - 1000)
+        end = start + rng.randint(25, 400)
+        value = rng.randint(1, 50)
+        hits.append((c, start, end, value, rng.choice("+-")))
+    hits.sort()
+    return hits
+
+
+def main():
+    parser = OptionParser(usage="%prog [options] output_directory")
+    parser.add_option("-g", "--genes", type="int", default=20000,
+        help="number of transcripts in the DB and gene list [%default]")
+    parser.add_option("-n", "--hits", type="int", default=1000000,
+        help="number of hits in each hit and query file [%default]")
+    parser.add_option("-i", "--isoforms", type="int", default=4,
+        help="most transcripts sharing a gene symbol [%default]")
+    parser.add_option("-p", "--near", type="float", default=0.3,
+        help="share of hits placed near a tss [%default]")
+    parser.add_option("-u", "--upstream", type="int", default=1000,
+        help="DB interval start before the tss [%default]")
+    parser.add_option("-d", "--downstream", type="int", default=500,
+        help="DB interval end after the tss [%default]")
+    parser.add_option("-s", "--seed", type="int", default=1,
+        help="random seed, the same seed writes the same files [%default]")
+    (options, args) = parser.parse_args()
+    if len(args) != 1:
+        parser.error("the output directory must be given")
+    out = args[0]
+    if not os.path.isdir(out):
+        os.makedirs(out)
+
+    rng = random.Random(options.seed)
+    genes = make_genes(rng, options.genes, options.isoforms)
+    hits = make_hits(rng, options.hits, genes, options.near)
+    names = [name for name, length in CHROMOSOMES]
+    long_strand = {"+": "plus", "-": "minus"}
+    #the bedgraph files hold reads per million to 6 digits, so their sums are
+    #not exact the way integer counts are and often round on a tie
+    per_million = 1e6 / max(1, sum(hit[3] for hit in hits))
+
+    #every file is sorted by chromosome and start so --sorted can read it
+    #cppmatch DB, as tss2db.pl writes it with symbol:tss descriptions
+    rows = []
+    for c, tss, strand, symbol, gene_id in genes:
+        if strand == "+":
+            start, end = tss - options.upstream, tss + options.downstream
+        else:
+            start, end = tss - options.downstream, tss + options.upstream
+        rows.append((c, start, end, gene_id, symbol, tss, strand))
+    rows.sort()
+    with open(os.path.join(out, "db.txt"), "w") as f:
+        for c, start, end, gene_id, symbol, tss, strand in rows:
+            f.write("%s\t%s:%d\t%s\t%d\t%d\t%s\n" %
+                (gene_id, symbol, tss, names[c], start, end, strand))
+
+    #make_heatmap gene list, the description is the tss for -a u
+    with open(os.path.join(out, "genes.txt"), "w") as f:
+        for c, tss, strand, symbol, gene_id in genes:
+            f.write("%s\t%d\t%s\t%d\t%d\t%s\n" % (gene_id, tss, names[c],
+                tss - 2000, tss + 2000, long_strand[strand]))
+
+    #known gene transcripts for tss2db.pl (name, chrom, strand, txstart,
+    #txend, symbol), each running 1kb to 50kb downstream of its tss
+    with open(os.path.join(out, "genes.tss"), "w") as f:
+        for c, tss, strand, symbol, gene_id in genes:
+            length = rng.randint(1000, 50000)
+            if strand == "+":
+                start, end = tss, tss + length
+            else:
+                start, end = tss - length, tss
+            f.write("%s\t%s\t%s\t%d\t%d\t%s\n" % (gene_id, names[c], strand,
+                start, end, symbol))
+
+    #40 bins of 250 across 10kb around the anchor
+    with open(os.path.join(out, "bins.txt"), "w") as f:
+        for b in range(-5000, 5000, 250):
+            f.write("%d\t%d\n" % (b, b + 249))
+
+    with open(os.path.join(out, "query.txt"), "w") as query, \
+            open(os.path.join(out, "hits.cpp"), "w") as cpp, \
+            open(os.path.join(out, "hits.bg"), "w") as bg, \
+            open(os.path.join(out, "hits.bed"), "w") as bed, \
+            open(os.path.join(out, "hits.ebed"), "w") as ebed, \
+            open(os.path.join(out, "plus.bg"), "w") as plus, \
+            open(os.path.join(out, "minus.bg"), "w") as minus:
+        for n, (c, start, end, value, strand) in enumerate(hits):
+            chrom = names[c]
+            #cppmatch query, as bedgraph2cppmatch.pl writes it
+            query.write("row_%07d\t%d\t%s\t%d\t%d\t%s\n" %
+                (n, value, chrom, start, end, strand))
+            cpp.write("row_%07d\t%d\t%s\t%d\t%d\t%s\n" %
+                (n, value, chrom, start, end, long_strand[strand]))
+            bg.write("%s\t%d\t%d\t%.6g\n" %
+                (chrom, start, end, value * per_million))
+            bed.write("%s\t%d\t%d\n" % (chrom, start, end))
+            ebed.write("%s\t%d\t%d\tread%d\t%d\t%s\n" %
+                (chrom, start, end, n, value, strand))
+            (plus if strand == "+" else minus).write("%s\t%d\t%d\t%.6g\n" %
+                (chrom, start, end, value * per_million))
+
+    print("wrote %d transcripts and %d hits to %s" %
+        (len(genes), len(hits), out))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+"""Run cppmatch and make_heatmap over a synthetic workload and report
+throughput and peak memory from their --stats=json output"""
+
+from __future__ import print_function
+
+import json
+import os
+import shutil
+import subprocess
+import sys
+from optparse import OptionParser
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+#cppmatch strand options, each also run with --sorted on one thread
+CPPMATCH_MODES = ["i", "s", "o", "bf", "bs"]
+
+#make_heatmap runs as (name, hit file arguments, options), every hit type
+#with the strand options it supports, and --prefix-sums on the unstranded
+#and strand split bedgraph runs
+HEATMAP_MODES = [
+    ("g_b", ["hits.bg"], ["-h", "g", "--nostrand"]),
+    ("b_b", ["hits.bed"], ["-h", "b", "-s", "b", "-l", "p", "-a", "p", "-d", "p"]),
+    ("e_s", ["hits.ebed"], ["-h", "e", "-s", "s"]),
+    ("e_o", ["hits.ebed"], ["-h", "e", "-s", "o"]),
+    ("e_b", ["hits.ebed"], ["-h", "e", "-s", "b", "-l", "p", "-a", "p", "-d", "p"]),
+    ("c_s", ["hits.cpp"], ["-h", "c", "-s", "s"]),
+    ("c_o", ["hits.cpp"], ["-h", "c", "-s", "o"]),
+    ("c_b", ["hits.cpp"], ["-h", "c", "-s", "b", "-l", "p", "-a", "p", "-d", "p"]),
+    ("pm_s", [], ["-p", "plus.bg", "-m", "minus.bg", "-s", "s"]),
+    ("pm_o", [], ["-p", "plus.bg", "-m", "minus.bg", "-s", "o"]),
+    ("g_b_prefix", ["hits.bg"], ["-h", "g", "--nostrand", "--prefix-sums"]),
+    ("pm_s_prefix", [], ["-p", "plus.bg", "-m", "minus.bg", "-s", "s",
+        "--prefix-sums"]),
+]
+
+
+def run(args, work):
+    """run a tool with --stats=json, returns the parsed stats or None"""
+    proc = subprocess.Popen(args, cwd=work, stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE)
+    out, err = proc.communicate()
+    if proc.returncode != 0:
+        print("failed (%d): %s" % (proc.returncode, " ".join(args)),
+            file=sys.stderr)
+        return None
+    for line in reversed(err.decode().splitlines()):
+        if line.startswith("{"):
+            return json.loads(line)
+    print("no stats from: %s" % " ".join(args), file=sys.stderr)
+    return None
+
+
+def best_of(args, work, repeat):
+    """the run with the least total wall time of repeat runs"""
+    best = None
+    for i in range(repeat):
+        stats = run(args, work)
+        if stats is None:
+            return None
+        stats["total"] = sum(p["wall"] for p in stats["phases"])
+        if best is None or stats["total"] < best["total"]:
+            best = stats
+    return best
+
+
+def row(tool, mode, threads, stats, phases, lines):
+    """a report line, throughput is over the phases that match the hits"""
+    wall = sum(p["wall"] for p in stats["phases"] if p["name"] in phases)
+    lines = stats["counters"][lines]
+    return [tool, mode, str(threads), str(lines), "%.3f" % wall,
+        "%.3f" % stats["total"], "%.0f" % (lines / wall if wall > 0 else 0),
+        str(stats["peak_rss_kb"])]
+
+
+def main():
+    parser = OptionParser(usage="%prog [options]")
+    parser.add_option("-b", "--bin-dir", default=".",
+        help="directory holding cppmatch and make_heatmap [%default]")
+    parser.add_option("-w", "--work", default="bench_data",
+        help="workload directory, written by gen_workload.py if it has no "
+        "db.txt [%default]")
+    parser.add_option("-t", "--threads", default="1,2,4",
+        help="comma separated thread counts [%default]")
+    parser.add_option("-r", "--repeat", type="int", default=3,
+        help="runs of each case, the fastest is reported [%default]")
+    parser.add_option("-g", "--genes", type="int", default=20000,
+        help="transcripts for a new workload [%default]")
+    parser.add_option("-n", "--hits", type="int", default=1000000,
+        help="hits for a new workload [%default]")
+    parser.add_option("-s", "--seed", type="int", default=1,
+        help="seed for a new workload [%default]")
+    parser.add_option("-o", "--out", help="also write the report to this file")
+    parser.add_option("--only", choices=["cppmatch", "make_heatmap"],
+        help="benchmark only one of the tools")
+    (options, args) = parser.parse_args()
+
+    work = os.path.abspath(options.work)
+    if not os.path.exists(os.path.join(work, "db.txt")):
+        subprocess.check_call([sys.executable,
+            os.path.join(HERE, "gen_workload.py"),
+            "--genes", str(options.genes), "--hits", str(options.hits),
+            "--seed", str(options.seed), work])
+    cppmatch = os.path.abspath(os.path.join(options.bin_dir, "cppmatch"))
+    make_heatmap = os.path.abspath(os.path.join(options.bin_dir,
+        "make_heatmap"))
+    threads = [int(t) for t in options.threads.split(",")]
+    outdir = os.path.join(work, "out")
+
+    report = [["tool", "mode", "threads", "lines", "match_s", "total_s",
+        "hits_per_s", "peak_rss_kb"]]
+    print("\t".join(report[0]))
+
+    def add(r):
+        report.append(r)
+        print("\t".join(r))
+        sys.stdout.flush()
+
+    if options.only != "make_heatmap":
+        for mode in CPPMATCH_MODES:
+            for t, sorted_run in [(t, False) for t in threads] + [(1, True)]:
+                if os.path.isdir(outdir):
+                    shutil.rmtree(outdir)
+                os.makedirs(outdir)
+                args = [cppmatch, "--stats=json", "-s", mode, "-t", str(t)]
+                if sorted_run:
+                    args.append("--sorted")
+                #run from the output directory, a single -s bs run writes its
+                #antisense totals to "_total" there
+                args += [os.path.join(work, "db.txt"),
+                    os.path.join(work, "query.txt"), "r"]
+                stats = best_of(args, outdir, options.repeat)
+                if stats is not None:
+                    add(row("cppmatch", mode + ("_sorted" if sorted_run else ""),
+                        t, stats, ["match"], "query_lines"))
+
+    if options.only != "cppmatch":
+        if not os.path.isdir(outdir):
+            os.makedirs(outdir)
+        for mode, hits, opts in HEATMAP_MODES:
+            for t in threads:
+                args = [make_heatmap, "--stats=json", "-t", str(t)] + opts + \
+                    hits + ["genes.txt", os.path.join(outdir, "heatmap"),
+                    "bins.txt"]
+                stats = best_of(args, work, options.repeat)
+                if stats is not None:
+                    #the bins of --prefix-sums and of each thread are only
+                    #summed once the hits are read
+                    add(row("make_heatmap", mode, t, stats,
+                        ["hits", "sums", "merge"], "hit_lines"))
+
+    if os.path.isdir(outdir):
+        shutil.rmtree(outdir)
+    if options.out:
+        with open(options.out, "w") as f:
+            for r in report:
+                f.write("\t".join(r) + "\n")
+
+
+if __name__ == "__main__":
+    main()
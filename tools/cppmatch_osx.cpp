@@ -18,9 +18,32 @@
 #include <tr1/unordered_map>
 #include <errno.h>
 #include <set>
+#include <deque>
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+#ifndef SINGLE
+#include <pthread.h>
+#endif
+
+//the overlap kernels use AVX2 or SSE4.2 when the CPU running the program has
+//them, compile with -DNO_SIMD to always use the portable loop
+#if !defined(NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#define OVERLAP_SIMD
+#include <immintrin.h>
+#endif
 
 enum processing_options {IGNORE_STRAND, SAME_STRAND, OPPOSITE_STRAND, SENSE, SENSE_SPLIT};
 enum cache_types {CACHE_IGNORE_STRAND, CACHE_STRAND, CACHE_SENSE};
@@ -28,652 +51,4691 @@ enum cache_types {CACHE_IGNORE_STRAND, CACHE_STRAND, CACHE_SENSE};
 using namespace std;
 using tr1::unordered_map;
 
-class chr_entry {
-	public:
-		vector<string> dbdesc1;
-		vector<string> dbdesc2;
-		vector<long> dbphysical_start;
-		vector<long> dbphysical_end;
-		vector<string> dbwhole;
-		vector<int> dbfound;
+//a run of bytes inside an input file, written out as is
+struct slice {
+	const char *p;
+	size_t len;
 };
 
-class chr_entry_s : public chr_entry {
-	public:
-		vector<string> dbstrand;
-};
+inline ostream &operator<<(ostream &out, const slice &s) {
+	out.write(s.p, s.len);
+	return out;
+}
 
-//describes the fields in an entry
+//describes the fields in an entry, chr points into the file and chr_id is
+//its id in the chromosome dictionary
 struct entry {
-	string desc1;
-	string chr;
+	slice chr;
+	int chr_id;
 	long physical_start;
 	long physical_end;
 	string strand;
-	string whole;
 	int found;
 };
 
 //description2 for a database entry is a string
+//the text fields point into the DB file until the entry is cached, whole is
+//the entry as written to the output
 struct dentry : public entry {
-	string desc2;
+	slice desc1;
+	slice desc2;
+	slice whole;
 };
 
 //description2 for a query entry is a long
+//whole points at the parsed fields of the original query line
 struct qentry : public entry {
 	long desc2;
+	slice whole;
 };
 
-struct ptr_entry {
-	string *desc1;
-	string *desc2;
-	string *chr;
-	long *physical_start;
-	long *physical_end;
-	string *strand;
-	string *whole;
-	int *found;
-};
+//gzip input, a BGZF file is a series of gzip members of at most 64KB each
+//whose headers record their compressed size, so the members can be found
+//without inflating anything and inflated in parallel, any other gzip file
+//is inflated as one stream
+const size_t BGZF_MAX_BLOCK = 65536;
 
-struct option long_options[] = {
-		{"help", 0, NULL, 'h'},
-		{"strands", 1, NULL, 's'},
-		{"no_zeros", 0, NULL, 'z'}
-};
+inline size_t read_le16(const unsigned char *p) {
+	return(p[0] | (p[1] << 8));
+}
 
-ofstream outfile, outfile2;
-ofstream totalfile, totalfile2;
-unordered_map<string, chr_entry> db;
-unordered_map<string, unordered_map<string, chr_entry> > db_strand;
-unordered_map<string, chr_entry_s> db_sense;
-map<string, long> table;
-map<string, long> table2;
-set<string> strand_list;
-unordered_map<string, string> strand_map;
+inline size_t read_le32(const unsigned char *p) {
+	return(p[0] | (p[1] << 8) | (p[2] << 16) | ((size_t)p[3] << 24));
+}
 
-void usage(void) {
-	cout << "Usage: cppmatch [options] [DB File Name] [Query File Name] [Output File Name]\n";
-	cout << "Available Options:\n";
-	cout << "  --help                      produce this help message\n";
-	cout << "  -s [ --strands] arg (=i)    specify handling of strand identifiers:\n";
-	cout << "                                 i    ignore strand identifiers\n";
-	cout << "                                 s    report only same-strand hits\n";
-	cout << "                                 o    report only opposite-strand hits\n";
-	cout << "                                 bf   flag each hit as sense or antisense\n";
-	cout << "                                 bs   write sense and antisense hits to separate\n";
-	cout << "                                      files\n";
-	cout << "  -z [ --no_zeros]             remove zero valued genes in the final result, default false\n";
-	return;
+//size of the BGZF block starting at p, 0 if there is not a whole one
+size_t bgzf_block_size(const unsigned char *p, size_t avail) {
+	if(avail < 18 || p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4))
+		return(0);
+	size_t xend = 12 + read_le16(p + 10);
+	if(xend > avail)
+		return(0);
+	for(size_t x = 12; x + 4 <= xend; x += 4 + read_le16(p + x + 2)) {
+		if(p[x] == 'B' && p[x + 1] == 'C' && read_le16(p + x + 2) == 2
+			&& x + 6 <= xend
+		) {
+			size_t size = read_le16(p + x + 4) + 1;
+			return(size >= xend + 8 && size <= avail ? size : 0);
+		}
+	}
+	return(0);
 }
 
-//caching reads in the transcription start sites from the genome data and
-//organizes them into a map for indexed access the different flavors of
-//caching here could be combined into one general function cache ignore drops
-//the strand information from the db file and assumes everything is on the
-//same strand
-void cache_ignore_strand(ifstream &db_file) {
-	dentry dbentry;
-	string line;
-	getline(db_file, line);
-	while(!db_file.eof()) {
-		istringstream in_stream(line);
+//one block of a BGZF file and the slot its inflated data goes to
+struct bgzf_block {
+	const unsigned char *in;
+	size_t in_len;
+	char *out;
+	size_t out_len;
+};
 
-		in_stream >> dbentry.desc1 >> dbentry.desc2 >> dbentry.chr >>
-		  	dbentry.physical_start >> dbentry.physical_end;
+bool bgzf_inflate(const bgzf_block &b) {
+	size_t xend = 12 + read_le16(b.in + 10);
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(inflateInit2(&zs, -15) != Z_OK)
+		return(false);
+	zs.next_in = const_cast<Bytef*>(b.in + xend);
+	zs.avail_in = b.in_len - xend - 8;
+	zs.next_out = reinterpret_cast<Bytef*>(b.out);
+	zs.avail_out = b.out_len;
+	int r = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if(r != Z_STREAM_END || zs.avail_out != 0)
+		return(false);
+	return(crc32(crc32(0, NULL, 0), reinterpret_cast<Bytef*>(b.out), b.out_len)
+		== read_le32(b.in + b.in_len - 8));
+}
 
-		if(in_stream.fail()) {
-			cout << "DB File contains bad line, skipping: " << line << endl;
-		}else {
-			ostringstream out_stream;
-			out_stream << dbentry.desc1 << '\t' << dbentry.desc2 << '\t' <<
-				dbentry.chr << '\t' << dbentry.physical_start << '\t' <<
-				dbentry.physical_end;
-			db[dbentry.chr].dbdesc1.push_back(dbentry.desc1);
-			db[dbentry.chr].dbdesc2.push_back(dbentry.desc2);
-			db[dbentry.chr].dbphysical_start.push_back(dbentry.physical_start);
-			db[dbentry.chr].dbphysical_end.push_back(dbentry.physical_end);
-			db[dbentry.chr].dbfound.push_back(0);
-			db[dbentry.chr].dbwhole.push_back(out_stream.str());
-		}
-		getline(db_file, line);
+#ifndef SINGLE
+struct inflate_pool {
+	vector<bgzf_block> *blocks;
+	size_t next;
+	int bad;
+};
+
+//worker thread, inflates blocks until none are left
+void *t_inflate(void *arg) {
+	inflate_pool *pool = reinterpret_cast<inflate_pool*>(arg);
+	size_t i;
+	while((i = __sync_fetch_and_add(&pool->next, 1)) < pool->blocks->size()) {
+		if(!bgzf_inflate((*pool->blocks)[i]))
+			pool->bad = 1;
 	}
-	db_file.close();
-	return;
+	pthread_exit(NULL);
 }
+#endif
 
-//cache_strand splits the db file into separate caches for the + and - strands
-void cache_strand(ifstream &db_file) {
-	dentry dbentry;
-	string line;
-	getline(db_file, line);
-	while(!db_file.eof()) {
-		istringstream in_stream(line);
-		in_stream >> dbentry.desc1 >> dbentry.desc2 >> dbentry.chr >>
-			dbentry.physical_start >> dbentry.physical_end >> dbentry.strand;
+//streambuf writing BGZF, data is deflated a block at a time as the buffer
+//fills, an ordinary gzip reader sees a multi member gzip file
+class bgzf_buf : public streambuf {
+		FILE *file;
+		vector<char> block;
+		vector<char> packed;
 
-		if(in_stream.fail()) {
-			cout << "DB File contains bad line, skipping: " << line << endl;
-		}else {
-			ostringstream out_stream;
-			out_stream << dbentry.desc1 << '\t' << dbentry.desc2 << '\t' <<
-				dbentry.chr << '\t' << dbentry.physical_start << '\t' <<
-				dbentry.physical_end << '\t' << dbentry.strand;
+		bool deflate_block(size_t len) {
+			z_stream zs;
+			memset(&zs, 0, sizeof(zs));
+			if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK
+			)
+				return(false);
+			unsigned char *p = reinterpret_cast<unsigned char*>(&packed[0]);
+			const unsigned char header[18] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255,
+				6, 0, 'B', 'C', 2, 0, 0, 0};
+			memcpy(p, header, 18);
+			zs.next_in = reinterpret_cast<Bytef*>(len ? &block[0] : NULL);
+			zs.avail_in = len;
+			zs.next_out = p + 18;
+			zs.avail_out = packed.size() - 26;
+			int r = deflate(&zs, Z_FINISH);
+			size_t size = 18 + zs.total_out + 8;
+			deflateEnd(&zs);
+			if(r != Z_STREAM_END)
+				return(false);
+			unsigned long crc = crc32(crc32(0, NULL, 0),
+				reinterpret_cast<Bytef*>(len ? &block[0] : NULL), len);
+			p[16] = (size - 1) & 0xff;
+			p[17] = (size - 1) >> 8;
+			for(int b = 0; b < 4; b++) {
+				p[size - 8 + b] = (crc >> (8 * b)) & 0xff;
+				p[size - 4 + b] = (len >> (8 * b)) & 0xff;
+			}
+			return(fwrite(p, 1, size, file) == size);
+		}
 
-			strand_list.insert(dbentry.strand);
-			db_strand[dbentry.strand][dbentry.chr].dbdesc1.push_back(dbentry.desc1);
-			db_strand[dbentry.strand][dbentry.chr].dbdesc2.push_back(dbentry.desc2);
-			db_strand[dbentry.strand][dbentry.chr].dbphysical_start.push_back(
-				dbentry.physical_start
-			);
+	protected:
+		int overflow(int c) {
+			if(file == NULL)
+				return(EOF);
+			if(pptr() > pbase() && !deflate_block(pptr() - pbase()))
+				return(EOF);
+			setp(&block[0], &block[0] + block.size());
+			if(c != EOF) {
+				*pptr() = c;
+				pbump(1);
+			}
+			return(c == EOF ? 0 : c);
+		}
+
+		//endl flushes, a block is only written once it is full so that lines
+		//are not each packed on their own
+		int sync() {
+			return(file == NULL ? -1 : 0);
+		}
+
+	public:
+		//a full block leaves room for the worst case deflate expansion plus
+		//header and trailer within the 64KB BGZF limit
+		bgzf_buf() : file(NULL), block(0xff00), packed(BGZF_MAX_BLOCK) { }
+
+		~bgzf_buf() {
+			close();
+		}
 
-			db_strand[dbentry.strand][dbentry.chr].dbphysical_end.push_back(
-				dbentry.physical_end
-			);
+		bool open(const char *name) {
+			close();
+			file = fopen(name, "wb");
+			setp(&block[0], &block[0] + block.size());
+			return(file != NULL);
+		}
+
+		bool is_open() {
+			return(file != NULL);
+		}
+
+		//write what is left and the empty block marking the end of the file
+		bool close() {
+			if(file == NULL)
+				return(true);
+			bool ok = (pptr() == pbase() || deflate_block(pptr() - pbase()))
+				&& deflate_block(0);
+			ok = (fclose(file) == 0) && ok;
+			file = NULL;
+			setp(NULL, NULL);
+			return(ok);
+		}
+};
+
+//a key of --sort, a column counted from 1 compared as a number (n), in
+//dictionary order (d, only letters, digits and blanks count) or byte by
+//byte, r reverses it, like the -k keys of sort(1) with tab separated columns
+struct sort_key {
+	int field;
+	bool numeric;
+	bool dictionary;
+	bool reverse;
+};
 
-			db_strand[dbentry.strand][dbentry.chr].dbfound.push_back(0);
-			db_strand[dbentry.strand][dbentry.chr].dbwhole.push_back(
-				out_stream.str()
-			);
+//how an output file is ordered, without keys it is left in the order
+//written, mem bounds the text held before a sorted run is spilled to disk
+struct sort_spec {
+	vector<sort_key> keys;
+	size_t mem;
+	int threads;
+	sort_spec() : mem(0), threads(1) { }
+};
 
+//parse a key list like "7n,9n"
+bool parse_sort_keys(const char *arg, sort_spec &spec) {
+	spec.keys.clear();
+	for(const char *p = arg; *p; ) {
+		sort_key k;
+		char *end;
+		long field = strtol(p, &end, 10);
+		if(end == p || field < 1 || field > INT_MAX)
+			return(false);
+		k.field = field;
+		k.numeric = k.dictionary = k.reverse = false;
+		for(p = end; *p && *p != ','; p++) {
+			if(*p == 'n')
+				k.numeric = true;
+			else if(*p == 'd')
+				k.dictionary = true;
+			else if(*p == 'r')
+				k.reverse = true;
+			else
+				return(false);
 		}
-		getline(db_file, line);
+		spec.keys.push_back(k);
+		if(*p == ',' && *++p == '\0')
+			return(false);
 	}
-	db_file.close();
-	return;
+	return(!spec.keys.empty());
 }
 
-//cache_sense maintains the strand information but does not split the data
-//into seperate caches
-void cache_sense(ifstream &db_file) {
-	dentry dbentry;
-	string line;
-	getline(db_file, line);
-	while(!db_file.eof()) {
-		istringstream in_stream(line);
-		in_stream >> dbentry.desc1 >> dbentry.desc2 >> dbentry.chr >>
-			dbentry.physical_start >> dbentry.physical_end >> dbentry.strand;
+//a column of a line, empty when the line is shorter
+inline slice line_field(const char *p, const char *end, int field) {
+	for(int f = 1; f < field; f++) {
+		const char *tab = static_cast<const char*>(memchr(p, '\t', end - p));
+		if(tab == NULL) {
+			slice s = {end, 0};
+			return(s);
+		}
+		p = tab + 1;
+	}
+	const char *tab = static_cast<const char*>(memchr(p, '\t', end - p));
+	slice s = {p, static_cast<size_t>((tab == NULL ? end : tab) - p)};
+	return(s);
+}
 
-		if(in_stream.fail()) {
-			cout << "DB File contains bad line, skipping: " << line << endl;
-		}else {
-			ostringstream out_stream;
-			out_stream << dbentry.desc1 << '\t' << dbentry.desc2 << '\t' <<
-				dbentry.chr << '\t' << dbentry.physical_start << '\t' <<
-				dbentry.physical_end << '\t' << dbentry.strand;
+//the leading number of a column, anything else counts as 0 as with sort -n
+inline double field_number(const slice &s) {
+	const char *p = s.p;
+	const char *end = s.p + s.len;
+	while(p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	bool negative = (p < end && *p == '-');
+	if(negative)
+		p++;
+	double value = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; p++)
+		value = value * 10 + (*p - '0');
+	if(p < end && *p == '.') {
+		double scale = 1;
+		for(p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			scale /= 10;
+			value += (*p - '0') * scale;
+		}
+	}
+	return(negative ? -value : value);
+}
 
-			strand_list.insert(dbentry.strand);
-			db_sense[dbentry.chr].dbdesc1.push_back(dbentry.desc1);
-			db_sense[dbentry.chr].dbdesc2.push_back(dbentry.desc2);
-			db_sense[dbentry.chr].dbphysical_start.push_back(dbentry.physical_start);
-			db_sense[dbentry.chr].dbphysical_end.push_back(dbentry.physical_end);
-			db_sense[dbentry.chr].dbstrand.push_back(dbentry.strand);
-			db_sense[dbentry.chr].dbfound.push_back(0);
-			db_sense[dbentry.chr].dbwhole.push_back(out_stream.str());
+inline bool dictionary_char(char c) {
+	return(isalnum(static_cast<unsigned char>(c)) || c == ' ' || c == '\t');
+}
+
+inline int compare_dictionary(const slice &a, const slice &b) {
+	size_t i = 0, j = 0;
+	while(true) {
+		while(i < a.len && !dictionary_char(a.p[i]))
+			i++;
+		while(j < b.len && !dictionary_char(b.p[j]))
+			j++;
+		if(i == a.len || j == b.len)
+			return((i < a.len) - (j < b.len));
+		if(a.p[i] != b.p[j])
+			return(static_cast<unsigned char>(a.p[i]) <
+				static_cast<unsigned char>(b.p[j]) ? -1 : 1);
+		i++;
+		j++;
+	}
+}
+
+inline int compare_bytes(const char *a, size_t alen, const char *b,
+	size_t blen
+) {
+	int r = memcmp(a, b, min(alen, blen));
+	if(r != 0)
+		return(r);
+	return((alen > blen) - (alen < blen));
+}
+
+//the column of a line a key compares, numbers are parsed once
+struct sort_field {
+	slice text;
+	double number;
+};
+
+inline sort_field key_field(const char *line, size_t len, const sort_key &key) {
+	sort_field f;
+	f.text = line_field(line, line + len, key.field);
+	f.number = key.numeric ? field_number(f.text) : 0;
+	return(f);
+}
+
+inline int compare_fields(const sort_field &a, const sort_field &b,
+	const sort_key &key
+) {
+	int r;
+	if(key.numeric)
+		r = (a.number > b.number) - (a.number < b.number);
+	else if(key.dictionary)
+		r = compare_dictionary(a.text, b.text);
+	else
+		r = compare_bytes(a.text.p, a.text.len, b.text.p, b.text.len);
+	return(key.reverse ? -r : r);
+}
+
+//compare two lines by the keys, equal keys fall back to the whole line so
+//the order never depends on the order the lines were written in
+int compare_lines(const char *a, size_t alen, const char *b, size_t blen,
+	const vector<sort_key> &keys
+) {
+	for(size_t k = 0; k < keys.size(); k++) {
+		int r = compare_fields(key_field(a, alen, keys[k]),
+			key_field(b, blen, keys[k]), keys[k]);
+		if(r != 0)
+			return(r);
+	}
+	return(compare_bytes(a, alen, b, blen));
+}
+
+//a line of the sort buffer without its newline, its key columns are found
+//once and kept from fields[key] on
+struct sort_rec {
+	size_t offset;
+	size_t length;
+	size_t key;
+};
+
+struct sort_rec_less {
+	const char *text;
+	const sort_field *fields;
+	const vector<sort_key> *keys;
+
+	bool operator()(const sort_rec &a, const sort_rec &b) const {
+		for(size_t k = 0; k < keys->size(); k++) {
+			int r = compare_fields(fields[a.key + k], fields[b.key + k],
+				(*keys)[k]);
+			if(r != 0)
+				return(r < 0);
 		}
-		getline(db_file, line);
+		return(compare_bytes(text + a.offset, a.length, text + b.offset,
+			b.length) < 0);
 	}
-	db_file.close();
-	return;
+};
+
+#ifndef SINGLE
+//one slice of the records, sorted on its own or merged with its neighbour
+struct sort_part {
+	vector<sort_rec>::iterator begin, middle, end;
+	const sort_rec_less *less;
+};
+
+void *t_sort_part(void *arg) {
+	sort_part *part = reinterpret_cast<sort_part*>(arg);
+	sort(part->begin, part->end, *part->less);
+	pthread_exit(NULL);
 }
 
-//"query" the "database"
-//do a linear scan over the subset of the cache corresponding to this chromosome
-//check for matches
-void query_ignore_strand(void *line) {
-	qentry q;
-	bool qstartcmp;
-	bool qendcmp;
-	ptr_entry arrays;
-	ostringstream acc;
-	istringstream in_stream(*reinterpret_cast<string*>(line));
-	in_stream >> q.desc1 >> q.desc2 >> q.chr >> q.physical_start >> q.physical_end;
-	if(in_stream.fail()) {
-		cout << "Query File contains bad line, skipping: " <<
-			*reinterpret_cast<string*>(line) << endl;
+void *t_merge_parts(void *arg) {
+	sort_part *part = reinterpret_cast<sort_part*>(arg);
+	inplace_merge(part->begin, part->middle, part->end, *part->less);
+	pthread_exit(NULL);
+}
+#endif
 
-	}else {
-		ostringstream out_stream;
-		out_stream << q.desc1 << '\t' << q.desc2 << '\t' << q.chr << '\t' <<
-			q.physical_start << '\t' << q.physical_end;
-
-		q.whole = out_stream.str();
-		//is this chromosome in the db?
-		if(db.find(q.chr) != db.end()) {
-			//find our length and set starting pointers
-			size_t max = db[q.chr].dbwhole.size();
-			arrays.desc1 = &db[q.chr].dbdesc1[0];
-			arrays.desc2 = &db[q.chr].dbdesc2[0];
-			arrays.physical_start = &db[q.chr].dbphysical_start[0];
-			arrays.physical_end = &db[q.chr].dbphysical_end[0];
-			arrays.found = &db[q.chr].dbfound[0];
-			arrays.whole = &db[q.chr].dbwhole[0];
-			//iterate over our pointers
-			for(size_t i = 0; i < max; i++) {
-				//if the array end is before the q start
-				// we are off the right side of the array
-				//if the array start is before the q end
-				// we are off the left side of the array
-				//in either case, skip to the next entry
-				//if we knew these were sorted
-				// we could stop once we are off the left side
-				if(arrays.physical_end[i] < q.physical_start
-					 || arrays.physical_start[i] > q.physical_end
-				)
-					 continue;
-				//we didn't skip so we know there is some type of overlap
-				//determine what type
-
-				arrays.found[i] += 1;
-				qstartcmp = (q.physical_start >= arrays.physical_start[i]);
-				qendcmp = (q.physical_end <= arrays.physical_end[i]);
-				if(qstartcmp && qendcmp){
-					//the query is contained by the db entry
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tB" << endl;
-				}else if(qstartcmp == 1){
-					//the query overlaps the start of the db entry
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tS" << endl;
-				}else if(qendcmp == 1){
-					//the query overlaps the end of the db entry
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tE" << endl;
-				}else{
-					//the query contains the db entry
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tC" << endl;
-				}
-
-				//generate data for the total file
-				//note desc1 and desc2 here are the desc
-				//values from the db file not the query file
-				ostringstream table_key;
-				table_key << arrays.desc1[i] << '\t' << arrays.desc2[i];
-
-				//set a number of hits
-				//or if we already encountered this, increase the number of hits
-				//later we will conglomerate all this
-				if(table.find(table_key.str()) == table.end()) {
-					table[table_key.str()] = q.desc2;
-				}else {
-					table[table_key.str()] += q.desc2;
-				}
+//sort the records, each thread sorts a slice and the slices are then merged
+//in pairs, also in parallel
+void sort_records(vector<sort_rec> &recs, const sort_rec_less &less,
+	int threads
+) {
+#ifndef SINGLE
+	size_t parts = min(static_cast<size_t>(threads), recs.size() / 65536 + 1);
+	if(parts > 1) {
+		vector<size_t> bound(parts + 1);
+		for(size_t i = 0; i <= parts; i++) {
+			bound[i] = recs.size() * i / parts;
+		}
+		vector<sort_part> work(parts);
+		vector<pthread_t> tid(parts);
+		for(size_t i = 0; i < parts; i++) {
+			work[i].begin = recs.begin() + bound[i];
+			work[i].end = recs.begin() + bound[i + 1];
+			work[i].less = &less;
+			pthread_create(&tid[i], NULL, t_sort_part,
+				reinterpret_cast<void*>(&work[i]));
+		}
+		for(size_t i = 0; i < parts; i++) {
+			pthread_join(tid[i], NULL);
+		}
+		for(size_t width = 1; width < parts; width *= 2) {
+			size_t n = 0;
+			for(size_t i = 0; i + width < parts; i += 2 * width, n++) {
+				work[n].begin = recs.begin() + bound[i];
+				work[n].middle = recs.begin() + bound[i + width];
+				work[n].end = recs.begin() + bound[min(i + 2 * width, parts)];
+				work[n].less = &less;
+				pthread_create(&tid[n], NULL, t_merge_parts,
+					reinterpret_cast<void*>(&work[n]));
+			}
+			for(size_t i = 0; i < n; i++) {
+				pthread_join(tid[i], NULL);
 			}
-			outfile << acc.str();
 		}
+		return;
 	}
+#endif
+	sort(recs.begin(), recs.end(), less);
 	return;
 }
 
-void query_split(void *line) {
-	qentry q;
-	bool qstartcmp;
-	bool qendcmp;
-	ptr_entry arrays;
-	ostringstream acc;
-	istringstream in_stream(*reinterpret_cast<string*>(line));
-	in_stream >> q.desc1 >> q.desc2 >> q.chr >> q.physical_start >>
-		q.physical_end >> q.strand;
+//anonymous temporary file under $TMPDIR, or /tmp when it is not set, unlike
+//tmpfile() which always uses /tmp, the name is unlinked at once so the file
+//goes away when it is closed
+FILE *temp_file() {
+	const char *dir = getenv("TMPDIR");
+	string name = string(dir != NULL && *dir != '\0' ? dir : "/tmp") +
+		"/cppmatch.XXXXXX";
+	vector<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	int fd = mkstemp(&path[0]);
+	if(fd < 0)
+		return(NULL);
+	unlink(&path[0]);
+	FILE *file = fdopen(fd, "w+");
+	if(file == NULL)
+		::close(fd);
+	return(file);
+}
 
-	if(in_stream.fail()) {
-		cout << "Query File contains bad line, skipping: " <<
-			*reinterpret_cast<string*>(line) << endl;
+//a sorted run spilled to disk, read back a line at a time for the merge
+struct sort_run {
+	FILE *file;
+	char *line;
+	size_t cap;
+	ssize_t len;
 
-	}else {
-		ostringstream out_stream;
-		out_stream << q.desc1 << '\t' << q.desc2 << '\t' << q.chr << '\t' <<
-			q.physical_start << '\t' << q.physical_end << '\t' << q.strand;
-
-		q.whole = out_stream.str();
-		string strand = strand_map[q.strand];
-		if(strand == "") {
-			strand = strand_map["dummy"];
-		}
-		if(db_strand.find(strand) != db_strand.end()) {
-			if(db_strand[strand].find(q.chr) != db_strand[strand].end()) {
-				size_t max = db_strand[strand][q.chr].dbwhole.size();
-				arrays.desc1 = &db_strand[strand][q.chr].dbdesc1[0];
-				arrays.desc2 = &db_strand[strand][q.chr].dbdesc2[0];
-				arrays.physical_start = &db_strand[strand][q.chr].dbphysical_start[0];
-				arrays.physical_end = &db_strand[strand][q.chr].dbphysical_end[0];
-				arrays.found = &db_strand[strand][q.chr].dbfound[0];
-				arrays.whole = &db_strand[strand][q.chr].dbwhole[0];
-				for(size_t i = 0; i < max; i++) {
-					if(arrays.physical_end[i] < q.physical_start
-						|| arrays.physical_start[i] > q.physical_end)
-						continue;
-					arrays.found[i] += 1;
-
-					qstartcmp = (q.physical_start >= arrays.physical_start[i]);
-					qendcmp = (q.physical_end <= arrays.physical_end[i]);
-					if(qstartcmp && qendcmp){
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tB" << endl;
-						/* seq in QUERY within DB */
-					}else if(qstartcmp == 1){
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tS" << endl;
-					}else if(qendcmp == 1){
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tE" << endl;
-					}else{
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tC" << endl;
-						/* containment */
-					}
+	bool next() {
+		len = getline(&line, &cap, file);
+		return(len > 0);
+	}
+};
 
-					ostringstream table_key;
-					table_key << arrays.desc1[i] << '\t' << arrays.desc2[i];
+struct sort_run_greater {
+	const vector<sort_run> *runs;
+	const vector<sort_key> *keys;
 
-					if(table.find(table_key.str()) == table.end()) {
-						table[table_key.str()] = q.desc2;
-					}else {
-						table[table_key.str()] += q.desc2;
-					}
+	bool operator()(size_t a, size_t b) const {
+		const sort_run &ra = (*runs)[a], &rb = (*runs)[b];
+		return(compare_lines(ra.line, ra.len - 1, rb.line, rb.len - 1, *keys)
+			> 0);
+	}
+};
+
+//streambuf sorting the lines after the first (the header) before they are
+//written to the file, lines are held in memory up to the budget of the sort
+//spec and then spilled as sorted runs that are merged when the file closes
+class sort_buf : public streambuf {
+		streambuf *target;
+		sort_spec spec;
+		bool header;
+		vector<char> block;
+		vector<char> text;
+		size_t lines;
+		vector<FILE*> runs;
+		bool failed;
+
+		void put(const char *p, size_t len) {
+			if(static_cast<size_t>(target->sputn(p, len)) != len)
+				failed = true;
+			return;
+		}
+
+		//move the put area into the text, passing the header straight on
+		void drain() {
+			const char *p = pbase();
+			const char *end = pptr();
+			if(header && p < end) {
+				const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+				const char *stop = (nl == NULL) ? end : nl + 1;
+				put(p, stop - p);
+				header = (nl == NULL);
+				p = stop;
+			}
+			text.insert(text.end(), p, end);
+			lines += count(p, end, '\n');
+			setp(&block[0], &block[0] + block.size());
+			if(text.size() + lines * (sizeof(sort_rec)
+				+ spec.keys.size() * sizeof(sort_field)) > spec.mem
+			)
+				spill(false);
+			return;
+		}
+
+		//sort the complete lines held in memory
+		void sort_text(size_t used, vector<sort_rec> &recs) {
+			vector<sort_field> fields;
+			recs.clear();
+			recs.reserve(lines);
+			fields.reserve(lines * spec.keys.size());
+			for(size_t p = 0; p < used; ) {
+				const char *line = &text[p];
+				const char *nl = static_cast<const char*>(
+					memchr(line, '\n', used - p));
+				sort_rec r = {p, static_cast<size_t>(nl - line), fields.size()};
+				for(size_t k = 0; k < spec.keys.size(); k++) {
+					fields.push_back(key_field(line, r.length, spec.keys[k]));
 				}
-				outfile << acc.str();
+				recs.push_back(r);
+				p += r.length + 1;
 			}
+			sort_rec_less less = {text.empty() ? NULL : &text[0],
+				fields.empty() ? NULL : &fields[0], &spec.keys};
+			sort_records(recs, less, spec.threads);
+			return;
 		}
-	}
-	return;
-}
 
-void query_sf(void *line) {
-	qentry q;
-	bool qstartcmp;
-	bool qendcmp;
-	ptr_entry arrays;
-	ostringstream acc;
-	istringstream in_stream(*reinterpret_cast<string*>(line));
-	in_stream >> q.desc1 >> q.desc2 >> q.chr >> q.physical_start >>
-		q.physical_end >> q.strand;
+		void write_sorted(size_t used, FILE *file) {
+			vector<sort_rec> recs;
+			sort_text(used, recs);
+			for(size_t i = 0; i < recs.size(); i++) {
+				const char *line = &text[recs[i].offset];
+				if(file == NULL)
+					put(line, recs[i].length + 1);
+				else if(fwrite(line, 1, recs[i].length + 1, file)
+					!= recs[i].length + 1
+				)
+					failed = true;
+			}
+			return;
+		}
 
-	if(in_stream.fail()) {
-		cout << "Query File contains bad line, skipping: " <<
-			*reinterpret_cast<string*>(line) << endl;
+		//write the complete lines as a sorted run, a partial last line stays
+		void spill(bool all) {
+			size_t used = text.size();
+			while(used > 0 && text[used - 1] != '\n')
+				used--;
+			if(used == 0 && !all)
+				return;
+			FILE *run = temp_file();
+			if(run == NULL) {
+				failed = true;
+				return;
+			}
+			write_sorted(used, run);
+			runs.push_back(run);
+			text.erase(text.begin(), text.begin() + used);
+			lines = 0;
+			return;
+		}
 
-	}else {
-		ostringstream out_stream;
-		out_stream << q.desc1 << '\t' << q.desc2 << '\t' << q.chr << '\t' <<
-			q.physical_start << '\t' << q.physical_end << '\t' << q.strand;
-
-		q.whole = out_stream.str();
-		if(db_sense.find(q.chr) != db_sense.end()) {
-			size_t max = db_sense[q.chr].dbwhole.size();
-			arrays.desc1 = &db_sense[q.chr].dbdesc1[0];
-			arrays.desc2 = &db_sense[q.chr].dbdesc2[0];
-			arrays.physical_start = &db_sense[q.chr].dbphysical_start[0];
-			arrays.physical_end = &db_sense[q.chr].dbphysical_end[0];
-			arrays.found = &db_sense[q.chr].dbfound[0];
-			arrays.strand = &db_sense[q.chr].dbstrand[0];
-			arrays.whole = &db_sense[q.chr].dbwhole[0];
-			for(size_t i = 0; i < max; i++) {
-				if(arrays.physical_end[i] < q.physical_start
-					|| arrays.physical_start[i] > q.physical_end)
-					continue;
+		//k-way merge of the spilled runs
+		void merge() {
+			vector<sort_run> readers(runs.size());
+			vector<size_t> heap;
+			sort_run_greater greater = {&readers, &spec.keys};
+			for(size_t i = 0; i < runs.size(); i++) {
+				rewind(runs[i]);
+				readers[i].file = runs[i];
+				readers[i].line = NULL;
+				readers[i].cap = 0;
+				if(readers[i].next())
+					heap.push_back(i);
+			}
+			make_heap(heap.begin(), heap.end(), greater);
+			while(!heap.empty()) {
+				pop_heap(heap.begin(), heap.end(), greater);
+				sort_run &r = readers[heap.back()];
+				put(r.line, r.len);
+				if(r.next())
+					push_heap(heap.begin(), heap.end(), greater);
+				else
+					heap.pop_back();
+			}
+			for(size_t i = 0; i < readers.size(); i++) {
+				free(readers[i].line);
+				if(ferror(runs[i]))
+					failed = true;
+				fclose(runs[i]);
+			}
+			runs.clear();
+			return;
+		}
 
-				arrays.found[i] += 1;
-				qstartcmp = (q.physical_start >= arrays.physical_start[i]);
-				qendcmp = (q.physical_end <= arrays.physical_end[i]);
-				if(qstartcmp && qendcmp){
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tB";
-					/* seq in QUERY within DB */
-				}else if(qstartcmp == 1){
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tS";
-				}else if(qendcmp == 1){
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tE";
-				}else{
-					acc << arrays.whole[i] << '\t' << q.whole  << "\tC";
-					/* containment */
-				}
-
-				if(q.strand == arrays.strand[i]) {
-					acc << "\tS\n";
-				}else {
-					acc << "\tA\n";
-				}
+	protected:
+		int overflow(int c) {
+			if(target == NULL)
+				return(EOF);
+			drain();
+			if(c != EOF) {
+				*pptr() = c;
+				pbump(1);
+			}
+			return(c == EOF ? 0 : c);
+		}
 
-				ostringstream table_key;
-				table_key << arrays.desc1[i] << '\t' << arrays.desc2[i];
+		//like bgzf_buf, endl does not force anything out
+		int sync() {
+			return(target == NULL ? -1 : 0);
+		}
 
-				if(table.find(table_key.str()) == table.end()) {
-					table[table_key.str()] = q.desc2;
-				}else {
-					table[table_key.str()] += q.desc2;
+	public:
+		sort_buf() : target(NULL), header(true), block(65536), lines(0),
+			failed(false) { }
+
+		~sort_buf() {
+			close();
+		}
+
+		void open(streambuf *out, const sort_spec &order) {
+			close();
+			target = out;
+			spec = order;
+			header = true;
+			failed = false;
+			setp(&block[0], &block[0] + block.size());
+			return;
+		}
+
+		bool is_open() {
+			return(target != NULL);
+		}
+
+		//sort or merge everything written and hand it to the file
+		bool close() {
+			if(target == NULL)
+				return(true);
+			drain();
+			if(!text.empty() && text[text.size() - 1] != '\n') {
+				text.push_back('\n');
+				lines++;
+			}
+			if(runs.empty()) {
+				write_sorted(text.size(), NULL);
+			}else {
+				spill(true);
+				merge();
+			}
+			vector<char>().swap(text);
+			lines = 0;
+			target = NULL;
+			setp(NULL, NULL);
+			return(!failed);
+		}
+};
+
+//an output file, BGZF compressed when asked for so the result can be read
+//back by cppmatch and make_heatmap without unpacking it first, and sorted
+//when the order has keys
+class output_file : public ostream {
+		filebuf plain;
+		bgzf_buf packed;
+		sort_buf sorter;
+	public:
+		output_file() : ostream(NULL) { }
+
+		void open(const char *name, bool compress = false,
+			const sort_spec &order = sort_spec()
+		) {
+			close();
+			if(compress ? packed.open(name)
+				: plain.open(name, ios::out | ios::trunc) != NULL
+			) {
+				rdbuf(compress ? static_cast<streambuf*>(&packed) : &plain);
+				if(!order.keys.empty()) {
+					sorter.open(rdbuf(), order);
+					rdbuf(&sorter);
 				}
+			}else {
+				setstate(ios::failbit);
 			}
-			outfile << acc.str();
+			return;
 		}
-	}
-	return;
+
+		bool is_open() {
+			return(plain.is_open() || packed.is_open());
+		}
+
+		void close() {
+			if(sorter.is_open() && !sorter.close())
+				setstate(ios::failbit);
+			if(plain.is_open() && plain.close() == NULL)
+				setstate(ios::failbit);
+			if(packed.is_open() && !packed.close())
+				setstate(ios::failbit);
+			return;
+		}
+};
+
+//true for a regular file that is not gzip compressed, which is mapped as it
+//is, anything else is read through an input_reader
+bool plain_file(int fd) {
+	struct stat st;
+	unsigned char magic[2];
+	return(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (st.st_size < 2
+		|| (pread(fd, magic, 2, 0) == 2 && (magic[0] != 31 || magic[1] != 139))));
 }
 
-void query_ss(void *line) {
-	qentry q;
-	bool qstartcmp;
-	bool qendcmp;
-	ptr_entry arrays;
-	ostringstream acc;
-	ostringstream acc2;
-	istringstream in_stream(*reinterpret_cast<string*>(line));
-	in_stream >> q.desc1 >> q.desc2 >> q.chr >> q.physical_start >>
-		q.physical_end >> q.strand;
+//input that cannot be mapped as it is (pipes and gzip or BGZF files) is read
+//or inflated a bounded batch at a time, BGZF blocks of a batch across
+//threads, any other gzip file as one stream
+const size_t READ_BYTES = 4 << 20;
+const size_t STREAM_BYTES = 1 << 20;
 
-	if(in_stream.fail()) {
-		cout << "Query File contains bad line, skipping: " <<
-			*reinterpret_cast<string*>(line) << endl;
+class input_reader {
+		enum modes {PLAIN, BGZF, STREAM};
+		int fd;
+		int threads;
+		int mode;
+		bool eof_in;
+		bool member_done;
+		bool zs_open;
+		bool failed;
+		//data read from the file but not yet used
+		vector<unsigned char> in;
+		size_t in_pos;
+		size_t in_end;
+		z_stream zs;
 
-	}else {
-		ostringstream out_stream;
-		out_stream << q.desc1 << '\t' << q.desc2 << '\t' << q.chr << '\t' <<
-			q.physical_start << '\t' << q.physical_end << '\t' << q.strand;
-
-		q.whole = out_stream.str();
-		if(db_sense.find(q.chr) != db_sense.end()) {
-			size_t max = db_sense[q.chr].dbwhole.size();
-			arrays.desc1 = &db_sense[q.chr].dbdesc1[0];
-			arrays.desc2 = &db_sense[q.chr].dbdesc2[0];
-			arrays.physical_start = &db_sense[q.chr].dbphysical_start[0];
-			arrays.physical_end = &db_sense[q.chr].dbphysical_end[0];
-			arrays.found = &db_sense[q.chr].dbfound[0];
-			arrays.strand = &db_sense[q.chr].dbstrand[0];
-			arrays.whole = &db_sense[q.chr].dbwhole[0];
-			for(size_t i = 0; i < max; i++) {
-				if(arrays.physical_end[i] < q.physical_start
-					|| arrays.physical_start[i] > q.physical_end)
+		//move what is left to the front of in and read more after it
+		void fill() {
+			if(in_pos > 0) {
+				memmove(&in[0], &in[in_pos], in_end - in_pos);
+				in_end -= in_pos;
+				in_pos = 0;
+			}
+			while(!eof_in && in_end < in.size()) {
+				ssize_t n = ::read(fd, &in[in_end], in.size() - in_end);
+				if(n < 0 && errno == EINTR)
 					continue;
+				if(n < 0)
+					failed = true;
+				if(n <= 0)
+					eof_in = true;
+				else
+					in_end += n;
+			}
+			return;
+		}
 
-				qstartcmp = (q.physical_start >= arrays.physical_start[i]);
-				qendcmp = (q.physical_end <= arrays.physical_end[i]);
-				if(q.strand == arrays.strand[i]) {
-					arrays.found[i] += 1;
-					if(qstartcmp && qendcmp){
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tB" << endl;
-						/* seq in QUERY within DB */
-					}else if(qstartcmp == 1){
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tS" << endl;
-					}else if(qendcmp == 1){
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tE" << endl;
-					}else{
-						acc << arrays.whole[i] << '\t' << q.whole  << "\tC" << endl;
-						/* containment */
-					}
-
-					ostringstream table_key;
-					table_key << arrays.desc1[i] << '\t' << arrays.desc2[i];
+		size_t read_plain(vector<char> &out, size_t at) {
+			if(in_pos == in_end)
+				fill();
+			size_t n = in_end - in_pos;
+			out.resize(at + n);
+			if(n > 0)
+				memcpy(&out[at], &in[in_pos], n);
+			in_pos = in_end;
+			return(n);
+		}
 
-					if(table.find(table_key.str()) == table.end()) {
-						table[table_key.str()] = q.desc2;
-					}else {
-						table[table_key.str()] += q.desc2;
+		size_t read_blocks(vector<char> &out, size_t at) {
+			while(true) {
+				vector<bgzf_block> blocks;
+				size_t total = 0;
+				size_t pos = in_pos;
+				size_t len;
+				while(blocks.size() < (size_t)threads * 16 && (len =
+					bgzf_block_size(&in[0] + pos, in_end - pos)) != 0
+				) {
+					bgzf_block b = {&in[0] + pos, len, NULL,
+						read_le32(&in[0] + pos + len - 4)};
+					if(b.out_len > BGZF_MAX_BLOCK) {
+						failed = true;
+						return(0);
 					}
-				}else {
-					arrays.found[i] += 1;
-					if(qstartcmp && qendcmp){
-						acc2 << arrays.whole[i] << '\t' << q.whole  << "\tB" << endl;
-						/* seq in QUERY within DB */
-					}else if(qstartcmp == 1){
-						acc2 << arrays.whole[i] << '\t' << q.whole  << "\tS" << endl;
-					}else if(qendcmp == 1){
-						acc2 << arrays.whole[i] << '\t' << q.whole  << "\tE" << endl;
-					}else{
-						acc2 << arrays.whole[i] << '\t' << q.whole  << "\tC" << endl;
-						/* containment */
+					blocks.push_back(b);
+					total += b.out_len;
+					pos += len;
+				}
+				if(blocks.empty()) {
+					//the next block may just be cut off at the end of in
+					if(!eof_in && in_end - in_pos < BGZF_MAX_BLOCK) {
+						fill();
+						continue;
 					}
+					if(in_pos == in_end)
+						return(0);
+					//not BGZF from here on
+					mode = STREAM;
+					return(read_stream(out, at));
+				}
+				//one byte over so that an empty block's output is not NULL,
+				//which zlib rejects
+				out.resize(at + total + 1);
+				for(size_t i = 0, to = at; i < blocks.size(); i++) {
+					blocks[i].out = &out[to];
+					to += blocks[i].out_len;
+				}
+				bool ok = true;
+#ifndef SINGLE
+				if(threads > 1 && blocks.size() > 1) {
+					inflate_pool pool = {&blocks, 0, 0};
+					pthread_t tid[threads];
+					for(int ti = 0; ti < threads; ti++) {
+						pthread_create(&tid[ti], NULL, t_inflate,
+							reinterpret_cast<void*>(&pool));
+					}
+					for(int ti = 0; ti < threads; ti++) {
+						pthread_join(tid[ti], NULL);
+					}
+					ok = !pool.bad;
+				}else
+#endif
+				for(size_t i = 0; i < blocks.size() && ok; i++) {
+					ok = bgzf_inflate(blocks[i]);
+				}
+				out.resize(at + total);
+				if(!ok) {
+					failed = true;
+					return(0);
+				}
+				in_pos = pos;
+				//an empty block marks the end of the file, more may follow
+				if(total > 0)
+					return(total);
+			}
+		}
 
-					ostringstream table_key;
-					table_key << arrays.desc1[i] << '\t' << arrays.desc2[i];
-
-					if(table2.find(table_key.str()) == table2.end()) {
-						table2[table_key.str()] = q.desc2;
-					}else {
-						table2[table_key.str()] += q.desc2;
+		size_t read_stream(vector<char> &out, size_t at) {
+			if(!zs_open) {
+				memset(&zs, 0, sizeof(zs));
+				if(inflateInit2(&zs, 15 + 16) != Z_OK) {
+					failed = true;
+					return(0);
+				}
+				zs_open = true;
+			}
+			out.resize(at + STREAM_BYTES);
+			zs.next_out = reinterpret_cast<Bytef*>(&out[at]);
+			zs.avail_out = STREAM_BYTES;
+			while(zs.avail_out > 0) {
+				if(in_pos == in_end) {
+					if(eof_in) {
+						//a cut off member
+						if(!member_done)
+							failed = true;
+						break;
 					}
+					fill();
+					continue;
+				}
+				zs.next_in = &in[0] + in_pos;
+				zs.avail_in = in_end - in_pos;
+				int r = inflate(&zs, Z_NO_FLUSH);
+				in_pos = in_end - zs.avail_in;
+				if(r == Z_STREAM_END) {
+					//several gzip members may follow one another
+					inflateReset(&zs);
+					member_done = true;
+				}else if(r == Z_OK) {
+					member_done = false;
+				}else if(r != Z_BUF_ERROR) {
+					failed = true;
+					break;
 				}
 			}
-			outfile << acc.str();
-			outfile2 << acc2.str();
+			size_t n = failed ? 0 : STREAM_BYTES - zs.avail_out;
+			out.resize(at + n);
+			return(n);
+		}
+
+	public:
+		input_reader() : fd(-1), zs_open(false), failed(false) { }
+
+		~input_reader() {
+			close();
+		}
+
+		//take over an open file descriptor, threads inflate BGZF blocks
+		void open(int f, int t = 1) {
+			close();
+			fd = f;
+			threads = t;
+			eof_in = false;
+			member_done = true;
+			failed = false;
+			in.resize(READ_BYTES);
+			in_pos = in_end = 0;
+			fill();
+			//gzip magic bytes, read_blocks falls back to STREAM for other gzip
+			mode = (in_end >= 2 && in[0] == 31 && in[1] == 139) ? BGZF : PLAIN;
+			return;
+		}
+
+		//append the next batch to out after its first at bytes, returns the
+		//bytes added, 0 at the end of the input or if it could not be read
+		size_t read(vector<char> &out, size_t at) {
+			if(fd < 0 || failed) {
+				out.resize(at);
+				return(0);
+			}
+			switch(mode) {
+				case BGZF:
+					return(read_blocks(out, at));
+				case STREAM:
+					return(read_stream(out, at));
+				default:
+					return(read_plain(out, at));
+			}
+		}
+
+		bool bad() const {
+			return(failed);
+		}
+
+		void close() {
+			if(fd >= 0)
+				::close(fd);
+			fd = -1;
+			if(zs_open)
+				inflateEnd(&zs);
+			zs_open = false;
+			vector<unsigned char>().swap(in);
+			return;
+		}
+};
+
+//read only view of a whole input file, memory mapped, input that cannot be
+//mapped as it is (pipes and gzip files) is first copied or inflated a batch
+//at a time into a temp_file, so under $TMPDIR, which is mapped instead, so
+//the pages of either can be let go
+class mapped_file {
+		bool mapped;
+
+		bool map(int fd) {
+			if(size == 0)
+				return(true);
+			void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(m == MAP_FAILED)
+				return(false);
+			madvise(m, size, MADV_SEQUENTIAL);
+			data = reinterpret_cast<const char*>(m);
+			mapped = true;
+			return(true);
+		}
+
+	public:
+		const char *data;
+		size_t size;
+
+		mapped_file() : mapped(false), data(NULL), size(0) { }
+
+		~mapped_file() {
+			close();
+		}
+
+		//threads is the number of threads inflating a BGZF file
+		bool open(const char *name, int threads = 1) {
+			close();
+			int fd = ::open(name, O_RDONLY);
+			if(fd < 0)
+				return(false);
+			if(plain_file(fd)) {
+				struct stat st;
+				fstat(fd, &st);
+				size = st.st_size;
+				bool ok = map(fd);
+				::close(fd);
+				return(ok);
+			}
+
+			input_reader reader;
+			reader.open(fd, threads);
+			FILE *spool = temp_file();
+			if(spool == NULL)
+				return(false);
+			vector<char> batch;
+			bool ok = true;
+			while(size_t n = reader.read(batch, 0)) {
+				if(fwrite(&batch[0], 1, n, spool) != n) {
+					ok = false;
+					break;
+				}
+				size += n;
+			}
+			//the mapping keeps the file until it is unmapped
+			ok = ok && !reader.bad() && fflush(spool) == 0 && map(fileno(spool));
+			fclose(spool);
+			if(!ok)
+				size = 0;
+			return(ok);
+		}
+
+		//let the whole pages in [from, to) go, they are read again if they are
+		//touched later
+		void drop_pages(const char *from, const char *to) {
+			if(!mapped)
+				return;
+			size_t page = sysconf(_SC_PAGESIZE);
+			size_t first = (from - data + page - 1) / page * page;
+			size_t last = (to - data) / page * page;
+			if(first < last)
+				madvise(const_cast<char*>(data) + first, last - first, MADV_DONTNEED);
+			return;
+		}
+
+		void close() {
+			if(mapped)
+				munmap(const_cast<char*>(data), size);
+			mapped = false;
+			data = NULL;
+			size = 0;
+			return;
+		}
+};
+
+//find the end of the line starting at p, lines may lack a final newline
+inline const char *line_end(const char *p, const char *end) {
+	const char *eol = reinterpret_cast<const char*>(memchr(p, '\n', end - p));
+	return(eol == NULL ? end : eol);
+}
+
+//step past the newline ending a line
+inline const char *next_line(const char *eol, const char *end) {
+	return(eol < end ? eol + 1 : end);
+}
+
+//an input file read front to back a batch of whole lines at a time, a
+//regular file is mapped and handed out in one piece, anything else is read
+//into a bounded buffer so that a pipe need not fit in memory
+class line_stream {
+		mapped_file map;
+		input_reader reader;
+		//the one batch of a mapped file or of lines already in memory
+		const char *whole;
+		size_t whole_len;
+		bool streamed;
+		bool done;
+		bool failed;
+		vector<char> buf;
+		size_t len;
+		//bytes of buf already handed out, the rest starts the next batch
+		size_t cut;
+		//input offset of buf[0] or of whole
+		size_t start;
+
+	public:
+		line_stream() : whole(NULL), whole_len(0), streamed(false), done(true),
+			failed(false), len(0), cut(0), start(0) { }
+
+		bool open(const char *name, int threads = 1) {
+			close();
+			failed = false;
+			done = false;
+			int fd = ::open(name, O_RDONLY);
+			if(fd < 0)
+				return(false);
+			if(plain_file(fd)) {
+				::close(fd);
+				if(!map.open(name))
+					return(false);
+				whole = map.data;
+				whole_len = map.size;
+				return(true);
+			}
+			streamed = true;
+			reader.open(fd, threads);
+			len = reader.read(buf, 0);
+			return(!reader.bad());
+		}
+
+		//hand out lines the caller holds in memory, at is their offset in the
+		//input they were taken from
+		void open(const char *begin, const char *end, size_t at = 0) {
+			close();
+			failed = false;
+			done = false;
+			whole = begin;
+			whole_len = end - begin;
+			start = at;
+			return;
+		}
+
+		//the next batch [begin, end), valid until the next call, false once
+		//the input is used up
+		bool next(const char *&begin, const char *&end) {
+			if(!streamed) {
+				if(done || whole_len == 0)
+					return(false);
+				done = true;
+				begin = whole;
+				end = whole + whole_len;
+				return(true);
+			}
+			if(cut > 0) {
+				memmove(&buf[0], &buf[cut], len - cut);
+				len -= cut;
+				start += cut;
+				cut = 0;
+			}
+			//the first batch was read by open
+			size_t n = len;
+			while(!done) {
+				for(size_t i = len; i > len - n; i--) {
+					if(buf[i - 1] == '\n') {
+						cut = i;
+						begin = &buf[0];
+						end = begin + cut;
+						return(true);
+					}
+				}
+				n = reader.read(buf, len);
+				if(n == 0) {
+					done = true;
+					failed = reader.bad();
+				}
+				len += n;
+			}
+			//what is left is a last line without a newline
+			if(len == 0)
+				return(false);
+			cut = len;
+			begin = &buf[0];
+			end = begin + len;
+			return(true);
+		}
+
+		//input offset of the first byte of the last batch, so lines can be
+		//ordered by where they were read whatever buffer they sit in
+		size_t offset() const {
+			return(start);
+		}
+
+		//a mapped file's batch stays valid until the stream is closed
+		bool stable() const {
+			return(!streamed);
+		}
+
+		//the input could not be read to the end, kept after close
+		bool bad() const {
+			return(failed);
+		}
+
+		void close() {
+			map.close();
+			reader.close();
+			whole = NULL;
+			whole_len = 0;
+			vector<char>().swap(buf);
+			streamed = false;
+			done = true;
+			len = 0;
+			cut = 0;
+			start = 0;
+			return;
+		}
+};
+
+inline bool is_space(char c) {
+	return(c == '\t' || c == ' ' || c == '\r' || c == '\v' || c == '\f');
+}
+
+//split a line into whitespace separated fields as >> would, returns the
+//number of fields found up to max
+inline size_t split_fields(const char *p, const char *end, slice *fields,
+	size_t max
+) {
+	size_t n = 0;
+	while(n < max) {
+		while(p < end && is_space(*p))
+			p++;
+		if(p == end)
+			break;
+		fields[n].p = p;
+		while(p < end && !is_space(*p))
+			p++;
+		fields[n].len = p - fields[n].p;
+		n++;
+	}
+	return(n);
+}
+
+//parse a whole field as a decimal integer, one that does not fit a long
+//fails as it would with >>
+inline bool parse_long(const slice &field, long &value) {
+	const char *p = field.p;
+	const char *end = field.p + field.len;
+	bool negative = false;
+	long v = 0;
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	if(p == end)
+		return(false);
+	for(; p < end; p++) {
+		if(*p < '0' || *p > '9')
+			return(false);
+		long d = *p - '0';
+		if(v > (LONG_MAX - d) / 10)
+			return(false);
+		v = v * 10 + d;
+	}
+	value = negative ? -v : v;
+	return(true);
+}
+
+//--stats, counts kept per query thread and added to the run's totals when
+//the thread is done, candidates are the DB entries the interval index
+//compared against a query and matches those that overlapped it
+struct run_counts {
+	long lines;
+	long bad;
+	long candidates;
+	long matches;
+
+	run_counts() : lines(0), bad(0), candidates(0), matches(0) { }
+};
+
+//wall and cpu seconds of each phase of a run, cpu is that of the whole
+//process so it covers every thread
+struct phase_time {
+	string name;
+	double wall;
+	double cpu;
+};
+
+class run_stats {
+	public:
+		bool enabled;
+		bool json;
+		long db_lines;
+		long db_bad;
+		run_counts query;
+
+		run_stats() : enabled(false), json(false), db_lines(0), db_bad(0) {
+			clock(start_wall, start_cpu);
+		}
+
+		//end the phase running since the last one ended
+		void phase(const char *name) {
+			phase_time t;
+			double wall, cpu;
+			clock(wall, cpu);
+			t.name = name;
+			t.wall = wall - start_wall;
+			t.cpu = cpu - start_cpu;
+			phases.push_back(t);
+			start_wall = wall;
+			start_cpu = cpu;
+			return;
+		}
+
+		//add a thread's counts, batch samples finish on several threads at once
+		void add(const run_counts &c) {
+#ifndef SINGLE
+			__sync_fetch_and_add(&query.lines, c.lines);
+			__sync_fetch_and_add(&query.bad, c.bad);
+			__sync_fetch_and_add(&query.candidates, c.candidates);
+			__sync_fetch_and_add(&query.matches, c.matches);
+#else
+			query.lines += c.lines;
+			query.bad += c.bad;
+			query.candidates += c.candidates;
+			query.matches += c.matches;
+#endif
+			return;
+		}
+
+		//one "name\tvalue" line per figure, or a single JSON object
+		void write(ostream &out) {
+			if(!enabled)
+				return;
+			struct rusage ru;
+			getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+			long rss_kb = ru.ru_maxrss / 1024;
+#else
+			long rss_kb = ru.ru_maxrss;
+#endif
+			const char *names[] = {"db_lines", "db_bad_lines", "query_lines",
+				"query_bad_lines", "candidates", "matches"};
+			long values[] = {db_lines, db_bad, query.lines, query.bad,
+				query.candidates, query.matches};
+			size_t count = sizeof(values) / sizeof(values[0]);
+			char buf[64];
+			if(json) {
+				out << "{\"program\":\"cppmatch\",\"phases\":[";
+				for(size_t i = 0; i < phases.size(); i++) {
+					snprintf(buf, sizeof(buf), "%.6f,\"cpu\":%.6f", phases[i].wall,
+						phases[i].cpu);
+					out << (i ? "," : "") << "{\"name\":\"" << phases[i].name <<
+						"\",\"wall\":" << buf << '}';
+				}
+				out << "],\"counters\":{";
+				for(size_t i = 0; i < count; i++) {
+					out << (i ? "," : "") << '"' << names[i] << "\":" << values[i];
+				}
+				out << "},\"peak_rss_kb\":" << rss_kb << "}\n";
+			}else {
+				for(size_t i = 0; i < phases.size(); i++) {
+					snprintf(buf, sizeof(buf), "\t%.6f\t%.6f", phases[i].wall,
+						phases[i].cpu);
+					out << "phase\t" << phases[i].name << buf << '\n';
+				}
+				for(size_t i = 0; i < count; i++) {
+					out << names[i] << '\t' << values[i] << '\n';
+				}
+				out << "peak_rss_kb\t" << rss_kb << '\n';
+			}
+			out.flush();
+			return;
+		}
+
+	private:
+		vector<phase_time> phases;
+		double start_wall;
+		double start_cpu;
+
+		static void clock(double &wall, double &cpu) {
+			struct timeval tv;
+			struct rusage ru;
+			gettimeofday(&tv, NULL);
+			getrusage(RUSAGE_SELF, &ru);
+			wall = tv.tv_sec + tv.tv_usec / 1e6;
+			cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+				+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+			return;
+		}
+};
+
+run_stats stats;
+
+//--dedup, collapses the lines of a file to the best one per gene symbol the
+//way tools/deduplicate.pl does, the symbol is desc2 up to its last ':' and
+//the best line has the most hits, the first one written winning a tie
+struct dedup_line {
+	string symbol;
+	long hits;
+	//where the line was written, the query line and the hit within it for
+	//detail lines, the order offered for totals lines
+	size_t pos;
+	size_t seq;
+	string line;
+};
+
+class dedup_table {
+	public:
+		dedup_table() : count(0) { }
+
+		//desc2 up to its last ':', a desc2 without a tss after a ':' is a
+		//symbol of its own
+		static slice symbol(const slice &desc2) {
+			slice s = desc2;
+			size_t colon = desc2.len;
+			while(colon > 0 && desc2.p[colon - 1] != ':')
+				colon--;
+			if(colon > 0 && colon < desc2.len)
+				s.len = colon - 1;
+			return(s);
+		}
+
+		//the line of a symbol if one with these hits written at pos, seq
+		//replaces it, the caller then fills in its text, NULL otherwise
+		dedup_line *offer_symbol(const slice &symbol, long hits, size_t pos,
+			size_t seq
+		) {
+			key.assign(symbol.p, symbol.len);
+			unordered_map<string, size_t>::iterator it = index.find(key);
+			size_t i;
+			if(it == index.end()) {
+				i = lines.size();
+				index[key] = i;
+				lines.push_back(dedup_line());
+				lines[i].symbol = key;
+			}else {
+				i = it->second;
+				dedup_line &best = lines[i];
+				if(hits < best.hits || (hits == best.hits
+					&& (pos > best.pos || (pos == best.pos && seq > best.seq)))
+				)
+					return(NULL);
+			}
+			lines[i].hits = hits;
+			lines[i].pos = pos;
+			lines[i].seq = seq;
+			return(&lines[i]);
+		}
+
+		dedup_line *offer(const slice &desc2, long hits, size_t pos, size_t seq) {
+			return(offer_symbol(symbol(desc2), hits, pos, seq));
+		}
+
+		//lines offered one after another, ordered as offered
+		dedup_line *offer(const slice &desc2, long hits) {
+			return(offer(desc2, hits, count++, 0));
+		}
+
+		//fold in the lines another thread kept
+		void merge(const dedup_table &other) {
+			for(size_t i = 0; i < other.lines.size(); i++) {
+				const dedup_line &l = other.lines[i];
+				slice s = {l.symbol.data(), l.symbol.size()};
+				dedup_line *best = offer_symbol(s, l.hits, l.pos, l.seq);
+				if(best != NULL)
+					best->line = l.line;
+			}
+			return;
+		}
+
+		//the kept lines in the order they were written
+		void write(ostream &out) const {
+			vector<pair<pair<size_t, size_t>, size_t> > order;
+			for(size_t i = 0; i < lines.size(); i++) {
+				order.push_back(make_pair(make_pair(lines[i].pos, lines[i].seq), i));
+			}
+			sort(order.begin(), order.end());
+			for(size_t i = 0; i < order.size(); i++) {
+				out << lines[order[i].second].line << '\n';
+			}
+			return;
+		}
+
+		void clear() {
+			index.clear();
+			lines.clear();
+			count = 0;
+			return;
+		}
+
+	private:
+		unordered_map<string, size_t> index;
+		vector<dedup_line> lines;
+		size_t count;
+		string key;
+};
+
+//a query file and everything written for it, a normal run has one sample,
+//batch mode one per query file, slot picks the sample's set of counters in
+//each chr_entry
+struct sample_ctx {
+	string query_file_name;
+	//output name before the _sense/_total endings and the .gz suffix
+	string output_name;
+	string suffix;
+	bool compress;
+	bool totals_only;   // no detail files, only counters and _total files
+	bool dedup;         // also write _deduplicated files
+	//--sort orders of the detail and the total files
+	sort_spec detail_order;
+	sort_spec total_order;
+	string antisense_total_name;
+	size_t slot;
+	output_file outfile, outfile2;
+	output_file totalfile, totalfile2;
+	//hit totals per "desc1\tdesc2" key, filled from the per entry counters
+	//once matching is done (or as entries leave the window in sorted mode)
+	map<string, long> table;
+	map<string, long> table2;
+	//--dedup, the best detail and totals lines of each symbol, [1] for the
+	//antisense files of -s bs
+	dedup_table dedup_detail[2];
+	dedup_table dedup_total[2];
+
+	sample_ctx() : compress(false), totals_only(false), dedup(false),
+		slot(0) { }
+};
+
+//remembers the last chromosome name looked up, a run of lines on one
+//chromosome is then resolved by a compare instead of a hash
+struct chr_cache {
+	string name;
+	int id;
+	bool valid;
+	chr_cache() : id(-1), valid(false) { }
+};
+
+//chromosome names are given a small id as the DB is loaded, the caches are
+//indexed by it
+class chr_dict {
+		unordered_map<string, int> ids;
+	public:
+		vector<string> names;
+
+		//id of a chromosome the dictionary has, -1 if it has none, read only
+		//so safe from worker threads as long as each has its own cache
+		int find(const slice &name, chr_cache &last) const {
+			if(last.valid && last.name.size() == name.len
+				&& memcmp(last.name.data(), name.p, name.len) == 0
+			)
+				return(last.id);
+			last.name.assign(name.p, name.len);
+			unordered_map<string, int>::const_iterator it = ids.find(last.name);
+			last.id = (it == ids.end()) ? -1 : it->second;
+			last.valid = true;
+			return(last.id);
+		}
+
+		//id of a chromosome, a new name is given the next id
+		int add(const slice &name, chr_cache &last) {
+			if(find(name, last) < 0) {
+				last.id = names.size();
+				ids[last.name] = last.id;
+				names.push_back(last.name);
+			}
+			return(last.id);
+		}
+
+		void clear() {
+			ids.clear();
+			names.clear();
+			return;
+		}
+};
+
+chr_dict chromosomes;
+
+//strand identifiers are stored with each DB entry as an index into
+//strand_names, queries carrying an identifier no entry uses get NO_STRAND
+const unsigned char NO_STRAND = UCHAR_MAX;
+vector<string> strand_names;
+
+//code for a DB strand identifier, new identifiers are added while caching
+unsigned char add_strand_code(const string &strand) {
+	for(size_t i = 0; i < strand_names.size(); i++) {
+		if(strand_names[i] == strand)
+			return(i);
+	}
+	if(strand_names.size() >= NO_STRAND)
+		return(NO_STRAND);
+	strand_names.push_back(strand);
+	return(strand_names.size() - 1);
+}
+
+//code for a query strand identifier, read only so safe from worker threads
+inline unsigned char strand_code(const string &strand) {
+	for(size_t i = 0; i < strand_names.size(); i++) {
+		if(strand_names[i] == strand)
+			return(i);
+	}
+	return(NO_STRAND);
+}
+
+//--window up,down, the DB holds annotation rather than windows and each
+//entry is matched as the window around its tss, the start on the plus strand
+//and the end on the minus strand, up bases before it and down after it in
+//the direction of transcription as tools/tss2db.pl would have written it
+struct flank_spec {
+	bool on;
+	long up;
+	long down;
+};
+
+flank_spec flank = {false, 0, 0};
+
+inline bool minus_strand(const string &strand) {
+	return(strand == "-" || strand == "minus");
+}
+
+//replace an annotation interval with the window around its tss
+inline void flank_coords(long &start, long &end, bool minus) {
+	if(minus) {
+		start = end - flank.down;
+		end += flank.up;
+	}else {
+		end = start + flank.down;
+		start -= flank.up;
+	}
+	return;
+}
+
+//the furthest a window can start before its annotation's start, sorted mode
+//reads that far ahead of a query so every window that may reach it is held
+inline long flank_reach() {
+	if(!flank.on)
+		return(0);
+	return(flank.up > flank.down ? flank.up : flank.down);
+}
+
+//where the text of an entry sits in its chromosome's arena, the whole entry
+//starts with desc1 and desc2 begins desc2_offset bytes in
+struct text_ref {
+	size_t offset;
+	unsigned int length;
+	unsigned int desc1_length;
+	unsigned int desc2_offset;
+	unsigned int desc2_length;
+
+	slice whole(const char *text) const {
+		slice s = {text + offset, length};
+		return(s);
+	}
+
+	slice desc1(const char *text) const {
+		slice s = {text + offset, desc1_length};
+		return(s);
+	}
+
+	slice desc2(const char *text) const {
+		slice s = {text + offset + desc2_offset, desc2_length};
+		return(s);
+	}
+};
+
+//binary DB index written by --build-index and read back by --index, every
+//array starts on an 8 byte boundary so the file can be used from a mapping
+const char INDEX_MAGIC[8] = {'c', 'p', 'p', 'm', 'i', 'd', 'x', '\n'};
+const unsigned int INDEX_VERSION = 3;
+
+struct index_header {
+	char magic[8];
+	unsigned int version;
+	//sizes of the stored types, an index from a different platform is refused
+	unsigned int long_size;
+	unsigned int ref_size;
+	unsigned int cache_type;
+	//the DB file the index was built from
+	long long db_size;
+	long long db_mtime;
+	unsigned long long tables;
+};
+
+class index_writer {
+		FILE *file;
+		size_t pos;
+	public:
+		bool ok;
+
+		index_writer(FILE *f) : file(f), pos(0), ok(true) { }
+
+		void put(const void *p, size_t len) {
+			if(len && fwrite(p, 1, len, file) != len)
+				ok = false;
+			pos += len;
+			return;
+		}
+
+		void align() {
+			const char zeros[8] = {0};
+			put(zeros, (8 - pos % 8) % 8);
+			return;
+		}
+
+		void put_size(size_t n) {
+			unsigned long long v = n;
+			put(&v, sizeof(v));
+			return;
+		}
+
+		void put_string(const string &s) {
+			put_size(s.size());
+			put(s.data(), s.size());
+			align();
+			return;
+		}
+
+		template <class T>
+		void put_vector(const vector<T> &v) {
+			put(v.empty() ? NULL : &v[0], v.size() * sizeof(T));
+			align();
+			return;
+		}
+};
+
+//reads an index from memory, every read is checked against the end so a
+//truncated file is refused rather than read past
+class index_reader {
+		const char *base;
+		const char *p;
+		const char *end;
+	public:
+		index_reader(const char *data, size_t size)
+			: base(data), p(data), end(data + size) { }
+
+		bool get(void *out, size_t len) {
+			if((size_t)(end - p) < len)
+				return(false);
+			memcpy(out, p, len);
+			p += len;
+			return(true);
+		}
+
+		void align() {
+			size_t off = (p - base) % 8;
+			p += (off && (size_t)(end - p) >= 8 - off) ? 8 - off : 0;
+			return;
+		}
+
+		bool get_size(size_t &n) {
+			unsigned long long v;
+			if(!get(&v, sizeof(v)))
+				return(false);
+			n = v;
+			return(true);
+		}
+
+		bool get_string(string &s) {
+			size_t n;
+			if(!get_size(n) || (size_t)(end - p) < n)
+				return(false);
+			s.assign(p, n);
+			p += n;
+			align();
+			return(true);
+		}
+
+		template <class T>
+		bool get_vector(vector<T> &v, size_t n) {
+			if((size_t)(end - p) / sizeof(T) < n)
+				return(false);
+			const T *first = reinterpret_cast<const T*>(p);
+			v.assign(first, first + n);
+			p += n * sizeof(T);
+			align();
+			return(true);
+		}
+};
+
+//overlap kernels, bit i of mask is set when [start[i], end[i]] overlaps
+//[lo, hi], mask holds (n + 63) / 64 words, the coordinates are tested as
+//contiguous arrays so the test vectorizes and the caller walks the set bits
+typedef unsigned long long mask_word;
+typedef void (*overlap_mask_fn)(const long *start, const long *end, size_t n,
+	long lo, long hi, mask_word *mask);
+
+inline void overlap_mask_tail(const long *start, const long *end, size_t i,
+	size_t n, long lo, long hi, mask_word *mask
+) {
+	//a branch rather than an or per entry, most entries miss
+	for(; i < n; i++) {
+		if(start[i] <= hi && end[i] >= lo)
+			mask[i >> 6] |= (mask_word)1 << (i & 63);
+	}
+	return;
+}
+
+void overlap_mask_scalar(const long *start, const long *end, size_t n,
+	long lo, long hi, mask_word *mask
+) {
+	memset(mask, 0, (n + 63) / 64 * sizeof(mask_word));
+	overlap_mask_tail(start, end, 0, n, lo, hi, mask);
+	return;
+}
+
+#ifdef OVERLAP_SIMD
+//4 entries per step, a lane fails when start > hi or lo > end, i steps by 4
+//so a step's bits never straddle two words
+__attribute__((target("avx2")))
+void overlap_mask_avx2(const long *start, const long *end, size_t n,
+	long lo, long hi, mask_word *mask
+) {
+	__m256i vlo = _mm256_set1_epi64x(lo);
+	__m256i vhi = _mm256_set1_epi64x(hi);
+	size_t i = 0;
+	memset(mask, 0, (n + 63) / 64 * sizeof(mask_word));
+	for(; i + 4 <= n; i += 4) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(start + i));
+		__m256i e = _mm256_loadu_si256((const __m256i*)(end + i));
+		__m256i miss = _mm256_or_si256(_mm256_cmpgt_epi64(s, vhi),
+			_mm256_cmpgt_epi64(vlo, e));
+		mask_word bits = ~_mm256_movemask_pd(_mm256_castsi256_pd(miss)) & 0xf;
+		mask[i >> 6] |= bits << (i & 63);
+	}
+	overlap_mask_tail(start, end, i, n, lo, hi, mask);
+	return;
+}
+
+//2 entries per step, 64 bit compares need SSE4.2
+__attribute__((target("sse4.2")))
+void overlap_mask_sse42(const long *start, const long *end, size_t n,
+	long lo, long hi, mask_word *mask
+) {
+	__m128i vlo = _mm_set1_epi64x(lo);
+	__m128i vhi = _mm_set1_epi64x(hi);
+	size_t i = 0;
+	memset(mask, 0, (n + 63) / 64 * sizeof(mask_word));
+	for(; i + 2 <= n; i += 2) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(start + i));
+		__m128i e = _mm_loadu_si128((const __m128i*)(end + i));
+		__m128i miss = _mm_or_si128(_mm_cmpgt_epi64(s, vhi),
+			_mm_cmpgt_epi64(vlo, e));
+		mask_word bits = ~_mm_movemask_pd(_mm_castsi128_pd(miss)) & 0x3;
+		mask[i >> 6] |= bits << (i & 63);
+	}
+	overlap_mask_tail(start, end, i, n, lo, hi, mask);
+	return;
+}
+#endif
+
+//the widest kernel the CPU supports, chosen once at startup
+overlap_mask_fn pick_overlap_mask(void) {
+#ifdef OVERLAP_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return(overlap_mask_avx2);
+	if(__builtin_cpu_supports("sse4.2"))
+		return(overlap_mask_sse42);
+#endif
+	return(overlap_mask_scalar);
+}
+
+const overlap_mask_fn overlap_mask = pick_overlap_mask();
+
+//entries tested per kernel call when scanning a table without its index
+const size_t SCAN_WORDS = 4;
+
+//push base + the position of every set bit of the mask to rows, lowest first
+inline void mask_rows(const mask_word *mask, size_t n, size_t base,
+	vector<size_t> &rows
+) {
+	for(size_t w = 0; w < (n + 63) / 64; w++) {
+		for(mask_word bits = mask[w]; bits; bits &= bits - 1) {
+			rows.push_back(base + w * 64 + __builtin_ctzll(bits));
+		}
+	}
+	return;
+}
+
+class chr_entry {
+	public:
+		//the text of every entry is copied back to back into dbtext, dbref
+		//locates each entry's desc1, desc2 and whole line in it
+		vector<char> dbtext;
+		vector<text_ref> dbref;
+		vector<long> dbphysical_start;
+		vector<long> dbphysical_end;
+		//whether each entry is on the minus strand, so an index built from
+		//annotation can be loaded with any --window
+		vector<unsigned char> dbminus;
+		//match count and sum of the query hits matched to each entry, there is
+		//a set of counters per sample slot, slot s starting at s * entries
+		vector<int> dbfound;
+		vector<long> dbhits;
+
+		//implicit interval tree over the entries of this chromosome
+		//idxstart/idxend hold the entries sorted by start, idxrow maps a tree
+		//position back to the row in the db vectors above, idxmax holds the
+		//largest end coordinate in the subtree rooted at each position
+		vector<size_t> idxrow;
+		vector<long> idxstart;
+		vector<long> idxend;
+		vector<long> idxmax;
+		int idxroot;
+
+		chr_entry() : idxroot(-1) { }
+
+		virtual ~chr_entry() { }
+
+		//append an entry, with --window its interval becomes the window
+		void push(dentry &e) {
+			bool minus = minus_strand(e.strand);
+			long start = e.physical_start;
+			long end = e.physical_end;
+			if(flank.on)
+				flank_coords(start, end, minus);
+			text_ref r;
+			r.offset = dbtext.size();
+			r.length = e.whole.len;
+			r.desc1_length = e.desc1.len;
+			r.desc2_offset = e.desc2.p - e.whole.p;
+			r.desc2_length = e.desc2.len;
+			dbtext.insert(dbtext.end(), e.whole.p, e.whole.p + e.whole.len);
+			dbref.push_back(r);
+			dbphysical_start.push_back(start);
+			dbphysical_end.push_back(end);
+			dbminus.push_back(minus);
+			dbfound.push_back(0);
+			dbhits.push_back(0);
+		}
+
+		slice whole(size_t i) {
+			return(dbref[i].whole(&dbtext[0]));
+		}
+
+		//the "desc1\tdesc2" totals key of entry i
+		string key(size_t i) {
+			slice desc1 = dbref[i].desc1(&dbtext[0]);
+			slice desc2 = dbref[i].desc2(&dbtext[0]);
+			string k(desc1.p, desc1.len);
+			k += '\t';
+			k.append(desc2.p, desc2.len);
+			return(k);
+		}
+
+		//first counter of a sample slot
+		size_t base(size_t slot) {
+			return(slot * dbref.size());
+		}
+
+		//make room for the counters of the given number of sample slots, all
+		//starting at zero
+		virtual void counters(size_t slots) {
+			dbfound.assign(dbref.size() * slots, 0);
+			dbhits.assign(dbref.size() * slots, 0);
+			return;
+		}
+
+		//zero the counters of one slot for the next sample
+		virtual void clear(size_t slot) {
+			size_t b = base(slot);
+			fill(dbfound.begin() + b, dbfound.begin() + b + dbref.size(), 0);
+			fill(dbhits.begin() + b, dbhits.begin() + b + dbref.size(), 0);
+			return;
+		}
+
+		//add the counters of slot from to those of slot to and zero them, a
+		//query thread's slot is folded into its sample's when the threads join
+		virtual void fold(size_t from, size_t to) {
+			size_t f = base(from);
+			size_t t = base(to);
+			for(size_t i = 0; i < dbref.size(); i++) {
+				dbfound[t + i] += dbfound[f + i];
+				dbhits[t + i] += dbhits[f + i];
+			}
+			clear(from);
+			return;
+		}
+
+		//add the hits of entry i to the sample's totals tables, entries sharing
+		//a desc1/desc2 key are summed, only matched entries get a key
+		virtual void total(size_t i, sample_ctx &smp) {
+			size_t c = base(smp.slot) + i;
+			if(dbfound[c])
+				smp.table[key(i)] += dbhits[c];
+			return;
+		}
+
+		void totals(sample_ctx &smp) {
+			for(size_t i = 0; i < dbref.size(); i++) {
+				total(i, smp);
+			}
+			return;
+		}
+
+		//move entry i to position j and truncate to n entries, used to drop
+		//entries from the middle, the text stays where it is until evict
+		//compacts the arena
+		virtual void move(size_t i, size_t j) {
+			dbref[j] = dbref[i];
+			dbphysical_start[j] = dbphysical_start[i];
+			dbphysical_end[j] = dbphysical_end[i];
+			dbminus[j] = dbminus[i];
+			dbfound[j] = dbfound[i];
+			dbhits[j] = dbhits[i];
+			return;
+		}
+
+		virtual void resize(size_t n) {
+			dbref.resize(n);
+			dbphysical_start.resize(n);
+			dbphysical_end.resize(n);
+			dbminus.resize(n);
+			dbfound.resize(n);
+			dbhits.resize(n);
+			return;
+		}
+
+		//give the memory of every vector back, assigning an empty table would
+		//keep their capacity
+		virtual void release() {
+			vector<char>().swap(dbtext);
+			vector<text_ref>().swap(dbref);
+			vector<long>().swap(dbphysical_start);
+			vector<long>().swap(dbphysical_end);
+			vector<unsigned char>().swap(dbminus);
+			vector<int>().swap(dbfound);
+			vector<long>().swap(dbhits);
+			vector<size_t>().swap(idxrow);
+			vector<long>().swap(idxstart);
+			vector<long>().swap(idxend);
+			vector<long>().swap(idxmax);
+			idxroot = -1;
+			return;
+		}
+
+		//drop entries ending before the given coordinate, keeping the order of
+		//the rest, the hits of dropped entries go to the totals tables and
+		//entries that were never matched are written to spill, the window only
+		//ever has the one sample so its counters line up with the rows
+		void evict(long before, FILE *spill, sample_ctx &smp) {
+			size_t j = 0;
+			for(size_t i = 0; i < dbphysical_end.size(); i++) {
+				if(dbphysical_end[i] < before) {
+					total(i, smp);
+					if(spill != NULL && !dbfound[i]) {
+						slice line = whole(i);
+						fwrite(line.p, 1, line.len, spill);
+						fputc('\n', spill);
+					}
+					continue;
+				}
+				if(j != i)
+					move(i, j);
+				j++;
+			}
+			resize(j);
+
+			//the kept entries' text is in row order, slide it down over the gaps
+			size_t pos = 0;
+			for(size_t i = 0; i < j; i++) {
+				if(dbref[i].offset != pos)
+					memmove(&dbtext[pos], &dbtext[dbref[i].offset], dbref[i].length);
+				dbref[i].offset = pos;
+				pos += dbref[i].length;
+			}
+			dbtext.resize(pos);
+			return;
+		}
+
+		//build the tree, call once after all entries have been cached
+		void build_index() {
+			size_t n = dbphysical_start.size();
+			vector<pair<long, size_t> > order(n);
+			for(size_t i = 0; i < n; i++) {
+				order[i] = pair<long, size_t>(dbphysical_start[i], i);
+			}
+			sort(order.begin(), order.end());
+
+			idxrow.resize(n);
+			idxstart.resize(n);
+			idxend.resize(n);
+			idxmax.resize(n);
+			for(size_t i = 0; i < n; i++) {
+				idxrow[i] = order[i].second;
+				idxstart[i] = order[i].first;
+				idxend[i] = dbphysical_end[order[i].second];
+			}
+
+			idxroot = -1;
+			if(n == 0)
+				return;
+
+			//leaves sit at even positions, a node at level k has k trailing ones
+			//last tracks the max end of the rightmost, possibly incomplete, subtree
+			size_t last_i = 0;
+			long last = 0;
+			for(size_t i = 0; i < n; i += 2) {
+				last_i = i;
+				last = idxmax[i] = idxend[i];
+			}
+			int k;
+			for(k = 1; ((size_t)1 << k) <= n; k++) {
+				size_t x = (size_t)1 << (k - 1);
+				size_t step = x << 2;
+				for(size_t i = (x << 1) - 1; i < n; i += step) {
+					long e = idxend[i];
+					long el = idxmax[i - x];
+					long er = (i + x < n) ? idxmax[i + x] : last;
+					if(el > e)
+						e = el;
+					if(er > e)
+						e = er;
+					idxmax[i] = e;
+				}
+				last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+				if(last_i < n && idxmax[last_i] > last)
+					last = idxmax[last_i];
+			}
+			idxroot = k - 1;
+			return;
+		}
+
+		//write the entry's columns and interval tree to an index, the
+		//counters start at zero on every run so they are not stored
+		virtual void save(index_writer &w) {
+			long long root = idxroot;
+			w.put_size(dbref.size());
+			w.put_size(dbtext.size());
+			w.put(&root, sizeof(root));
+			w.put_vector(dbtext);
+			w.put_vector(dbref);
+			w.put_vector(dbphysical_start);
+			w.put_vector(dbphysical_end);
+			w.put_vector(dbminus);
+			w.put_vector(idxrow);
+			w.put_vector(idxstart);
+			w.put_vector(idxend);
+			w.put_vector(idxmax);
+			return;
+		}
+
+		virtual bool load(index_reader &r) {
+			size_t n, text;
+			long long root;
+			if(!r.get_size(n) || !r.get_size(text) || !r.get(&root, sizeof(root))
+				|| !r.get_vector(dbtext, text) || !r.get_vector(dbref, n)
+				|| !r.get_vector(dbphysical_start, n)
+				|| !r.get_vector(dbphysical_end, n) || !r.get_vector(dbminus, n)
+				|| !r.get_vector(idxrow, n)
+				|| !r.get_vector(idxstart, n) || !r.get_vector(idxend, n)
+				|| !r.get_vector(idxmax, n)
+			)
+				return(false);
+			for(size_t i = 0; i < n; i++) {
+				if(dbref[i].offset > text || dbref[i].length > text - dbref[i].offset
+					|| dbref[i].desc2_offset + dbref[i].desc2_length > dbref[i].length
+					|| dbref[i].desc1_length > dbref[i].length || idxrow[i] >= n
+				)
+					return(false);
+			}
+			idxroot = root;
+			dbfound.assign(n, 0);
+			dbhits.assign(n, 0);
+			//the index holds the annotation, the windows are placed and the
+			//tree rebuilt over them
+			if(flank.on) {
+				for(size_t i = 0; i < n; i++) {
+					flank_coords(dbphysical_start[i], dbphysical_end[i], dbminus[i]);
+				}
+				build_index();
+			}
+			return(true);
+		}
+
+		//collect the rows overlapping [start, end] in ascending row order, which
+		//is the order a linear scan over the db vectors would visit them in,
+		//returns the number of entries compared
+		size_t overlaps(long start, long end, vector<size_t> &rows) {
+			struct node {
+				int k;
+				size_t x;
+				int w;
+			} stack[64];
+			size_t n = idxstart.size();
+			size_t tested = 0;
+			int t = 0;
+
+			rows.clear();
+			if(n != dbphysical_start.size()) {
+				//not indexed (sorted mode window), scan the entries directly a
+				//block at a time
+				mask_word mask[SCAN_WORDS];
+				size_t m = dbphysical_start.size();
+				for(size_t i = 0; i < m; i += SCAN_WORDS * 64) {
+					size_t len = (m - i < SCAN_WORDS * 64) ? m - i : SCAN_WORDS * 64;
+					overlap_mask(&dbphysical_start[i], &dbphysical_end[i], len, start,
+						end, mask);
+					mask_rows(mask, len, i, rows);
+				}
+				return(m);
+			}
+			if(idxroot < 0)
+				return(0);
+
+			stack[t].k = idxroot;
+			stack[t].x = ((size_t)1 << idxroot) - 1;
+			stack[t++].w = 0;
+			while(t) {
+				node z = stack[--t];
+				if(z.k <= 3) {
+					//small subtree, scan it directly, the kernel's call and mask
+					//walk cost more than they save over so few entries
+					size_t i0 = z.x >> z.k << z.k;
+					size_t i1 = i0 + ((size_t)1 << (z.k + 1)) - 1;
+					if(i1 > n)
+						i1 = n;
+					for(size_t i = i0; i < i1 && idxstart[i] <= end; i++) {
+						tested++;
+						if(idxend[i] >= start)
+							rows.push_back(idxrow[i]);
+					}
+				}else if(z.w == 0) {
+					//revisit this node once the left subtree is done, descend left
+					//only if something there can still reach the query start
+					size_t y = z.x - ((size_t)1 << (z.k - 1));
+					stack[t].k = z.k;
+					stack[t].x = z.x;
+					stack[t++].w = 1;
+					if(y >= n || idxmax[y] >= start) {
+						stack[t].k = z.k - 1;
+						stack[t].x = y;
+						stack[t++].w = 0;
+					}
+				}else if(z.x < n && idxstart[z.x] <= end) {
+					tested++;
+					if(idxend[z.x] >= start)
+						rows.push_back(idxrow[z.x]);
+					stack[t].k = z.k - 1;
+					stack[t].x = z.x + ((size_t)1 << (z.k - 1));
+					stack[t++].w = 0;
+				}
+			}
+			sort(rows.begin(), rows.end());
+			return(tested);
+		}
+};
+
+class chr_entry_s : public chr_entry {
+	public:
+		vector<unsigned char> dbstrand;
+		//antisense matches and hits for -s bs, dbfound counts both
+		vector<int> dbfound2;
+		vector<long> dbhits2;
+
+		void push(dentry &e) {
+			dbstrand.push_back(add_strand_code(e.strand));
+			dbfound2.push_back(0);
+			dbhits2.push_back(0);
+			chr_entry::push(e);
+		}
+
+		void counters(size_t slots) {
+			dbfound2.assign(dbref.size() * slots, 0);
+			dbhits2.assign(dbref.size() * slots, 0);
+			chr_entry::counters(slots);
+			return;
+		}
+
+		void clear(size_t slot) {
+			size_t b = base(slot);
+			fill(dbfound2.begin() + b, dbfound2.begin() + b + dbref.size(), 0);
+			fill(dbhits2.begin() + b, dbhits2.begin() + b + dbref.size(), 0);
+			chr_entry::clear(slot);
+			return;
+		}
+
+		void fold(size_t from, size_t to) {
+			size_t f = base(from);
+			size_t t = base(to);
+			for(size_t i = 0; i < dbref.size(); i++) {
+				dbfound2[t + i] += dbfound2[f + i];
+				dbhits2[t + i] += dbhits2[f + i];
+			}
+			chr_entry::fold(from, to);
+			return;
+		}
+
+		void total(size_t i, sample_ctx &smp) {
+			size_t c = base(smp.slot) + i;
+			string k = key(i);
+			if(dbfound[c] > dbfound2[c])
+				smp.table[k] += dbhits[c];
+			if(dbfound2[c])
+				smp.table2[k] += dbhits2[c];
+			return;
+		}
+
+		void move(size_t i, size_t j) {
+			dbstrand[j] = dbstrand[i];
+			dbfound2[j] = dbfound2[i];
+			dbhits2[j] = dbhits2[i];
+			chr_entry::move(i, j);
+			return;
+		}
+
+		void resize(size_t n) {
+			dbstrand.resize(n);
+			dbfound2.resize(n);
+			dbhits2.resize(n);
+			chr_entry::resize(n);
+			return;
+		}
+
+		void release() {
+			vector<unsigned char>().swap(dbstrand);
+			vector<int>().swap(dbfound2);
+			vector<long>().swap(dbhits2);
+			chr_entry::release();
+			return;
+		}
+
+		void save(index_writer &w) {
+			chr_entry::save(w);
+			w.put_vector(dbstrand);
+			return;
+		}
+
+		bool load(index_reader &r) {
+			if(!chr_entry::load(r) || !r.get_vector(dbstrand, dbref.size()))
+				return(false);
+			dbfound2.assign(dbref.size(), 0);
+			dbhits2.assign(dbref.size(), 0);
+			return(true);
+		}
+};
+
+struct ptr_entry {
+	const char *text;
+	text_ref *ref;
+	string *chr;
+	long *physical_start;
+	long *physical_end;
+	unsigned char *strand;
+	int *found;
+	int *found2;
+	long *hits;
+	long *hits2;
+};
+
+struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"strands", 1, NULL, 's'},
+		{"no_zeros", 0, NULL, 'z'},
+		{"sorted", 0, NULL, 'S'},
+		{"threads", 1, NULL, 't'},
+		{"build-index", 1, NULL, 'B'},
+		{"index", 1, NULL, 'I'},
+		{"batch", 1, NULL, 'P'},
+		{"manifest", 1, NULL, 'M'},
+		{"totals-only", 0, NULL, 'T'},
+		{"dedup", 0, NULL, 'D'},
+		{"stats", 2, NULL, 'X'},
+		{"sort", 2, NULL, 'O'},
+		{"sort-total", 1, NULL, 'K'},
+		{"sort-mem", 1, NULL, 'm'},
+		{"window", 1, NULL, 'W'},
+		{"max-mem", 1, NULL, 'L'},
+		{NULL, 0, NULL, 0}
+};
+
+//the caches, one table per chromosome id, deques so that adding a
+//chromosome leaves the tables already filled where they are
+deque<chr_entry> db;
+unordered_map<string, deque<chr_entry> > db_strand;
+deque<chr_entry_s> db_sense;
+
+//the table of a chromosome id, the cache is grown to hold it
+template <class T>
+T &chr_table(deque<T> &tables, int id) {
+	if((size_t)id >= tables.size())
+		tables.resize(id + 1);
+	return(tables[id]);
+}
+
+//the table of a chromosome id if the cache has entries for it
+template <class T>
+T *find_table(deque<T> &tables, int id) {
+	if(id < 0 || (size_t)id >= tables.size() || tables[id].dbref.empty())
+		return(NULL);
+	return(&tables[id]);
+}
+set<string> strand_list;
+//-s s and -s o, the split cache matched by each query strand code, set up
+//by check_strands so queries never hash their identifier
+deque<chr_entry> *split_tables[NO_STRAND + 1];
+
+struct match_ctx;
+typedef void (*match_fn)(qentry &q, match_ctx &ctx);
+
+//per thread state for the query functions, detail lines accumulate in acc
+//(acc2 for antisense hits) until written out to the sample's files, match
+//is the kernel chosen for the strand option, slot the counters it adds to
+struct match_ctx {
+	ostringstream acc;
+	ostringstream acc2;
+	vector<size_t> hits;
+	match_fn match;
+	sample_ctx *smp;
+	size_t slot;
+	//input offset of the query line being matched, --dedup keeps the first
+	//line of a tie by it
+	size_t pos;
+	chr_cache chr_last;
+	//--dedup, the best detail lines this thread wrote, acc's and acc2's
+	dedup_table dedup[2];
+	size_t seq;
+	run_counts counts;
+
+	match_ctx() : match(NULL), smp(NULL), slot(0), pos(0), seq(0) { }
+};
+
+#ifndef SINGLE
+//query lines are handed to the worker threads in chunks of whole lines,
+//each chunk's output is written back in input order so the result matches
+//a single thread run
+enum chunk_states {CHUNK_EMPTY, CHUNK_READY, CHUNK_BUSY, CHUNK_DONE};
+const size_t CHUNK_BYTES = 1 << 20;
+
+struct query_chunk {
+	const char *begin;
+	const char *end;
+	//the chunk's lines when the query is not mapped
+	string text;
+	//input offset of the chunk's first line
+	size_t at;
+	string out;
+	string out2;
+	int state;
+};
+
+//chunk n of the query file lives in slot n % chunks.size(), queued counts
+//the chunks read so far and next the chunks taken by a worker
+struct query_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t done;
+	vector<query_chunk> chunks;
+	size_t queued;
+	size_t next;
+	int eof;
+	int option;
+};
+
+struct query_worker {
+	query_pool *pool;
+	match_ctx ctx;
+};
+#endif
+
+//sorted mode state, the byte offset of each chromosome's block in the DB
+//file, the chromosomes in file order, the block currently being streamed
+//with one entry of lookahead, and a spill file for entries never matched
+mapped_file *db_stream = NULL;
+vector<long> db_blocks;
+vector<int> db_block_order;
+set<int> db_done;
+int window_chr = -1;
+const char *window_pos = NULL;
+dentry window_next;
+chr_cache window_last;
+bool window_next_valid = false;
+FILE *zero_spill = NULL;
+
+void usage(void) {
+	cout << "Usage: cppmatch [options] [DB File Name] [Query File Name] [Output File Name]\n";
+	cout << "       cppmatch [options] --batch [Output Prefix] [DB File Name] [Query File Names]\n";
+	cout << "Available Options:\n";
+	cout << "  --help                      produce this help message\n";
+	cout << "  -s [ --strands] arg (=i)    specify handling of strand identifiers:\n";
+	cout << "                                 i    ignore strand identifiers\n";
+	cout << "                                 s    report only same-strand hits\n";
+	cout << "                                 o    report only opposite-strand hits\n";
+	cout << "                                 bf   flag each hit as sense or antisense\n";
+	cout << "                                 bs   write sense and antisense hits to separate\n";
+	cout << "                                      files\n";
+	cout << "  -z [ --no_zeros]             remove zero valued genes in the final result, default false\n";
+#ifndef SINGLE
+	cout << "  -t [ --threads ] arg (=1)   specify number of threads to use\n";
+#endif
+	cout << "  --sorted                    stream DB and query files sorted by chromosome and\n";
+	cout << "                              start, holding only the DB entries that can still\n";
+	cout << "                              overlap a query, exits if either file is out of order,\n";
+	cout << "                              a compressed or piped DB File is first inflated or\n";
+	cout << "                              copied to a temporary file in $TMPDIR (or /tmp)\n";
+	cout << "  --build-index arg           cache the DB File for the -s option given and write\n";
+	cout << "                              the cache to arg, then exit, only the DB File name\n";
+	cout << "                              is needed\n";
+	cout << "  --index arg                 load the DB cache from arg, written by --build-index,\n";
+	cout << "                              the DB File is read instead if it has changed since\n";
+	cout << "                              the index was built, a compressed or piped index is\n";
+	cout << "                              first inflated or copied to a temporary file in\n";
+	cout << "                              $TMPDIR (or /tmp)\n";
+	cout << "  --window up,down            match each DB entry as the window from up bases\n";
+	cout << "                              before its tss to down bases after it, the tss\n";
+	cout << "                              being the start, or the end for strand - or minus,\n";
+	cout << "                              so the annotation tools/tss2db.pl -a writes can be\n";
+	cout << "                              the DB File, every line of its -r up -f down output\n";
+	cout << "                              is matched, as are the transcripts it drops for a\n";
+	cout << "                              tss inside an earlier window of the same symbol, an\n";
+	cout << "                              --index built without --window serves every window\n";
+	cout << "  --totals-only               only write the _total files, matches are counted\n";
+	cout << "                              but no detail lines are written\n";
+	cout << "  --dedup                     also write each output file collapsed to the line\n";
+	cout << "                              with the most hits per gene symbol (desc2 up to its\n";
+	cout << "                              last ':') as tools/deduplicate.pl does, named with\n";
+	cout << "                              _deduplicated before the extension\n";
+	cout << "  --sort[=arg] (=7n,9n)       sort the output files after their header line,\n";
+	cout << "                              arg lists keys as column numbers each followed by\n";
+	cout << "                              n (numeric), d (dictionary order) or nothing (bytes)\n";
+	cout << "                              and r to reverse, lines with equal keys are ordered\n";
+	cout << "                              by their whole text, total files use 3n,2d\n";
+	cout << "  --sort-total arg            sort the total files by the keys in arg\n";
+	cout << "  --sort-mem arg (=1024)      megabytes of output held for sorting before sorted\n";
+	cout << "                              runs are spilled to temporary files in $TMPDIR and\n";
+	cout << "                              merged\n";
+	cout << "  --max-mem arg               megabytes the cached DB may use, K or G after the\n";
+	cout << "                              number gives kilobytes or gigabytes, the DB and\n";
+	cout << "                              query are indexed by chromosome and the chromosomes\n";
+	cout << "                              are cached and matched as many at a time as fit,\n";
+	cout << "                              the files themselves are mapped, compressed or\n";
+	cout << "                              piped ones after being inflated or copied to a\n";
+	cout << "                              temporary file in $TMPDIR (or /tmp)\n";
+	cout << "  --stats[=json]              write the wall and cpu seconds of each phase, line,\n";
+	cout << "                              candidate and match counts and peak memory to\n";
+	cout << "                              stderr, one name and value per line or as JSON\n";
+	cout << "  --batch arg                 match many query files against one DB load, the\n";
+	cout << "                              file names after the DB File are query files, each\n";
+	cout << "                              writes arg followed by its name without directory\n";
+	cout << "                              and extension, end arg with .gz to compress\n";
+	cout << "  --manifest arg              with --batch, also read query files from arg, one\n";
+	cout << "                              per line, optionally followed by the output name,\n";
+	cout << "                              a compressed or piped manifest is first inflated or\n";
+	cout << "                              copied to a temporary file in $TMPDIR (or /tmp)\n";
+	cout << "DB and query files may be gzip or BGZF compressed, an output file name ending\n";
+	cout << "in .gz writes every output file BGZF compressed with .gz appended\n";
+	return;
+}
+
+//parse a DB line in place, the strand column is only required when strand
+//identifiers are in use, -s i still reads it if present for --window,
+//whole keeps the parsed fields as they appear in the file
+bool parse_db_line(const char *begin, const char *end, dentry &e, int option) {
+	slice fields[6];
+	size_t want = (option == IGNORE_STRAND) ? 5 : 6;
+	size_t found = split_fields(begin, end, fields, 6);
+	if(found < want
+		|| !parse_long(fields[3], e.physical_start)
+		|| !parse_long(fields[4], e.physical_end)
+	)
+		return(false);
+
+	e.desc1 = fields[0];
+	e.desc2 = fields[1];
+	e.chr = fields[2];
+	if(found == 6)
+		e.strand.assign(fields[5].p, fields[5].len);
+	else
+		e.strand.clear();
+	e.whole.p = fields[0].p;
+	e.whole.len = fields[want - 1].p + fields[want - 1].len - fields[0].p;
+	return(true);
+}
+
+//parse a query line in place, the strand column is only read when strand
+//identifiers are in use
+bool parse_query_line(const char *begin, const char *end, qentry &q,
+	int option
+) {
+	slice fields[6];
+	size_t want = (option == IGNORE_STRAND) ? 5 : 6;
+	if(split_fields(begin, end, fields, want) != want
+		|| !parse_long(fields[1], q.desc2)
+		|| !parse_long(fields[3], q.physical_start)
+		|| !parse_long(fields[4], q.physical_end)
+	)
+		return(false);
+
+	q.chr = fields[2];
+	if(want == 6)
+		q.strand.assign(fields[5].p, fields[5].len);
+	q.whole.p = fields[0].p;
+	q.whole.len = fields[want - 1].p + fields[want - 1].len - fields[0].p;
+	return(true);
+}
+
+//caching reads in the transcription start sites from the genome data and
+//organizes them into a map for indexed access the different flavors of
+//caching here could be combined into one general function cache ignore drops
+//the strand information from the db file and assumes everything is on the
+//same strand
+void cache_ignore_strand(line_stream &db_in) {
+	dentry dbentry;
+	chr_cache last;
+	const char *begin, *end;
+	while(db_in.next(begin, end)) {
+		for(const char *p = begin, *eol; p < end; p = next_line(eol, end)) {
+			eol = line_end(p, end);
+			stats.db_lines++;
+			if(!parse_db_line(p, eol, dbentry, IGNORE_STRAND)) {
+				slice line = {p, (size_t)(eol - p)};
+				cout << "DB File contains bad line, skipping: " << line << endl;
+				stats.db_bad++;
+			}else {
+				chr_table(db, chromosomes.add(dbentry.chr, last)).push(dbentry);
+			}
+		}
+	}
+	db_in.close();
+
+	for(size_t c = 0; c < db.size(); c++) {
+		db[c].build_index();
+	}
+	return;
+}
+
+//cache_strand splits the db file into separate caches for the + and - strands
+void cache_strand(line_stream &db_in) {
+	dentry dbentry;
+	chr_cache last;
+	const char *begin, *end;
+	while(db_in.next(begin, end)) {
+		for(const char *p = begin, *eol; p < end; p = next_line(eol, end)) {
+			eol = line_end(p, end);
+			stats.db_lines++;
+			if(!parse_db_line(p, eol, dbentry, SAME_STRAND)) {
+				slice line = {p, (size_t)(eol - p)};
+				cout << "DB File contains bad line, skipping: " << line << endl;
+				stats.db_bad++;
+			}else {
+				strand_list.insert(dbentry.strand);
+				chr_table(db_strand[dbentry.strand],
+					chromosomes.add(dbentry.chr, last)).push(dbentry);
+			}
+		}
+	}
+	db_in.close();
+
+	for(
+		unordered_map<string, deque<chr_entry> >::iterator
+			db_strand_it = db_strand.begin();
+		db_strand_it != db_strand.end();
+		db_strand_it++
+	){
+		//a chromosome may only have entries on the other strand
+		for(size_t c = 0; c < db_strand_it->second.size(); c++) {
+			if(!db_strand_it->second[c].dbref.empty())
+				db_strand_it->second[c].build_index();
+		}
+	}
+	return;
+}
+
+//cache_sense maintains the strand information but does not split the data
+//into seperate caches
+void cache_sense(line_stream &db_in) {
+	dentry dbentry;
+	chr_cache last;
+	const char *begin, *end;
+	while(db_in.next(begin, end)) {
+		for(const char *p = begin, *eol; p < end; p = next_line(eol, end)) {
+			eol = line_end(p, end);
+			stats.db_lines++;
+			if(!parse_db_line(p, eol, dbentry, SENSE)) {
+				slice line = {p, (size_t)(eol - p)};
+				cout << "DB File contains bad line, skipping: " << line << endl;
+				stats.db_bad++;
+			}else {
+				strand_list.insert(dbentry.strand);
+				chr_table(db_sense, chromosomes.add(dbentry.chr, last)).push(dbentry);
+			}
+		}
+	}
+	db_in.close();
+
+	for(size_t c = 0; c < db_sense.size(); c++) {
+		db_sense[c].build_index();
+	}
+	return;
+}
+
+//fill the cache the strand option needs
+void cache_db(line_stream &db_in, int option) {
+	switch(option) {
+		case IGNORE_STRAND:
+			cache_ignore_strand(db_in);
+			break;
+		case SAME_STRAND:
+		case OPPOSITE_STRAND:
+			cache_strand(db_in);
+			break;
+		default:
+			cache_sense(db_in);
+			break;
+	}
+	return;
+}
+
+//the cache a strand option is matched against
+int cache_type(int option) {
+	switch(option) {
+		case IGNORE_STRAND:
+			return(CACHE_IGNORE_STRAND);
+		case SAME_STRAND:
+		case OPPOSITE_STRAND:
+			return(CACHE_STRAND);
+		default:
+			return(CACHE_SENSE);
+	}
+}
+
+//a cached chromosome table with entries, strand is the identifier the cache
+//was split by and empty when it is not split
+struct db_table {
+	string strand;
+	int chr;
+	chr_entry *entry;
+};
+
+//the tables with entries in chromosome id order, only one of the caches is
+//populated
+void all_tables(vector<db_table> &tables) {
+	tables.clear();
+	for(size_t c = 0; c < db.size(); c++) {
+		db_table t = {"", (int)c, &db[c]};
+		if(!db[c].dbref.empty())
+			tables.push_back(t);
+	}
+	for(
+		unordered_map<string, deque<chr_entry> >::iterator
+			db_strand_it = db_strand.begin();
+		db_strand_it != db_strand.end();
+		db_strand_it++
+	){
+		for(size_t c = 0; c < db_strand_it->second.size(); c++) {
+			db_table t = {db_strand_it->first, (int)c, &db_strand_it->second[c]};
+			if(!db_strand_it->second[c].dbref.empty())
+				tables.push_back(t);
+		}
+	}
+	for(size_t c = 0; c < db_sense.size(); c++) {
+		db_table t = {"", (int)c, &db_sense[c]};
+		if(!db_sense[c].dbref.empty())
+			tables.push_back(t);
+	}
+	return;
+}
+
+//write the populated cache to an index file, each table is stored with its
+//strand (empty unless the cache is split by strand) and chromosome
+int write_index(const string &index_name, const string &db_file_name,
+	int type
+) {
+	struct stat st;
+	if(stat(db_file_name.c_str(), &st) != 0) {
+		cerr << "Error: Could not stat DB file \"" << db_file_name << "\"" << endl;
+		return(1);
+	}
+	FILE *f = fopen(index_name.c_str(), "wb");
+	if(f == NULL) {
+		cerr << "Error: Could not create index file \"" << index_name << "\""
+			<< endl;
+		return(1);
+	}
+
+	index_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.version = INDEX_VERSION;
+	h.long_size = sizeof(long);
+	h.ref_size = sizeof(text_ref);
+	h.cache_type = type;
+	h.db_size = st.st_size;
+	h.db_mtime = st.st_mtime;
+	vector<db_table> tables;
+	all_tables(tables);
+	h.tables = tables.size();
+
+	index_writer w(f);
+	w.put(&h, sizeof(h));
+	w.align();
+	w.put_size(strand_list.size());
+	for(set<string>::iterator it = strand_list.begin();
+		it != strand_list.end();
+		it++
+	){
+		w.put_string(*it);
+	}
+	w.put_size(strand_names.size());
+	for(size_t i = 0; i < strand_names.size(); i++) {
+		w.put_string(strand_names[i]);
+	}
+	//the chromosomes in id order, so a run from the index numbers them as a
+	//run from the DB file would
+	w.put_size(chromosomes.names.size());
+	for(size_t i = 0; i < chromosomes.names.size(); i++) {
+		w.put_string(chromosomes.names[i]);
+	}
+
+	for(size_t t = 0; t < tables.size(); t++) {
+		w.put_string(tables[t].strand);
+		w.put_string(chromosomes.names[tables[t].chr]);
+		tables[t].entry->save(w);
+	}
+
+	if(fclose(f) != 0 || !w.ok) {
+		cerr << "Error: Could not write index file \"" << index_name << "\""
+			<< endl;
+		return(1);
+	}
+	return(0);
+}
+
+//populate the cache from an index file in place of the cache functions,
+//false if the index cannot be used, in which case the caches are left empty
+//and the DB file should be read instead
+bool read_index(const string &index_name, const string &db_file_name,
+	int type
+) {
+	struct stat st;
+	mapped_file index_file;
+	index_header h;
+	if(!index_file.open(index_name.c_str())) {
+		cerr << "Warning: Could not open index file \"" << index_name << "\""
+			<< endl;
+		return(false);
+	}
+	index_reader r(index_file.data, index_file.size);
+	if(!r.get(&h, sizeof(h))
+		|| memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) != 0
+		|| h.version != INDEX_VERSION || h.long_size != sizeof(long)
+		|| h.ref_size != sizeof(text_ref)
+	) {
+		cerr << "Warning: \"" << index_name << "\" is not an index file for this"
+			<< " version of cppmatch" << endl;
+		return(false);
+	}
+	if(stat(db_file_name.c_str(), &st) != 0 || h.db_size != st.st_size
+		|| h.db_mtime != st.st_mtime
+	) {
+		cerr << "Warning: index file \"" << index_name << "\" is out of date with"
+			<< " DB file \"" << db_file_name << "\"" << endl;
+		return(false);
+	}
+	if((int)h.cache_type != type) {
+		cerr << "Warning: index file \"" << index_name << "\" was built for a"
+			<< " different -s option" << endl;
+		return(false);
+	}
+
+	bool ok = true;
+	size_t n;
+	string strand, chr;
+	chr_cache last;
+	r.align();
+	ok = r.get_size(n);
+	for(size_t i = 0; ok && i < n; i++) {
+		ok = r.get_string(strand);
+		strand_list.insert(strand);
+	}
+	ok = ok && r.get_size(n);
+	for(size_t i = 0; ok && i < n; i++) {
+		ok = r.get_string(strand);
+		strand_names.push_back(strand);
+	}
+	ok = ok && r.get_size(n);
+	for(size_t i = 0; ok && i < n; i++) {
+		ok = r.get_string(chr);
+		slice name = {chr.data(), chr.size()};
+		chromosomes.add(name, last);
+	}
+	for(unsigned long long t = 0; ok && t < h.tables; t++) {
+		ok = r.get_string(strand) && r.get_string(chr);
+		if(!ok)
+			break;
+		slice name = {chr.data(), chr.size()};
+		int id = chromosomes.add(name, last);
+		switch(type) {
+			case CACHE_IGNORE_STRAND:
+				ok = chr_table(db, id).load(r);
+				break;
+			case CACHE_STRAND:
+				ok = chr_table(db_strand[strand], id).load(r);
+				break;
+			default:
+				ok = chr_table(db_sense, id).load(r);
+				break;
+		}
+	}
+	if(!ok) {
+		cerr << "Warning: index file \"" << index_name << "\" is damaged" << endl;
+		strand_list.clear();
+		strand_names.clear();
+		chromosomes.clear();
+		db.clear();
+		db_strand.clear();
+		db_sense.clear();
+		return(false);
+	}
+	return(true);
+}
+
+//"query" the "database"
+//each strand option is a policy for one match kernel, the policy finds the
+//cached entries for the query's chromosome and records a matched entry, the
+//sink decides what happens to the detail line, the option is turned into a
+//kernel once by select_kernel so the loop itself never switches on it
+
+//the match type of a query against an overlapping db entry
+//B the query is contained by the db entry
+//S the query overlaps the start of the db entry
+//E the query overlaps the end of the db entry
+//C the query contains the db entry
+inline char match_type(const qentry &q, long start, long end) {
+	int qstartcmp = (q.physical_start >= start);
+	int qendcmp = (q.physical_end <= end);
+	return("CESB"[qstartcmp * 2 + qendcmp]);
+}
+
+//writes the detail line of a match, flagged lines carry the sense/antisense
+//column of -s bf
+//the detail line of a hit goes to acc, or acc2 for file 1
+struct detail_sink {
+	static void write(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type
+	) {
+		(file ? ctx.acc2 : ctx.acc) << arrays.ref[i].whole(arrays.text) << '\t'
+			<< q.whole << '\t' << type << '\n';
+		return;
+	}
+
+	static void write(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type, char flag
+	) {
+		(file ? ctx.acc2 : ctx.acc) << arrays.ref[i].whole(arrays.text) << '\t'
+			<< q.whole << '\t' << type << '\t' << flag << '\n';
+		return;
+	}
+};
+
+//--totals-only, matches are only counted and no detail line is formatted
+struct null_sink {
+	static void write(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type
+	) {
+		return;
+	}
+
+	static void write(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type, char flag
+	) {
+		return;
+	}
+};
+
+//--dedup, the detail line is written and offered as the best of its symbol,
+//q.hits deciding as it does for tools/deduplicate.pl, the query line and the
+//hit count within the thread place it in the order lines were written
+struct dedup_sink {
+	static void write(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type
+	) {
+		detail_sink::write(ctx, file, arrays, i, q, type);
+		keep(ctx, file, arrays, i, q, type);
+		return;
+	}
+
+	static void write(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type, char flag
+	) {
+		detail_sink::write(ctx, file, arrays, i, q, type, flag);
+		dedup_line *best = keep(ctx, file, arrays, i, q, type);
+		if(best != NULL) {
+			best->line += '\t';
+			best->line += flag;
+		}
+		return;
+	}
+
+	static dedup_line *keep(match_ctx &ctx, int file, const ptr_entry &arrays,
+		size_t i, const qentry &q, char type
+	) {
+		dedup_line *best = ctx.dedup[file].offer(arrays.ref[i].desc2(arrays.text),
+			q.desc2, ctx.pos, ctx.seq++);
+		if(best == NULL)
+			return(NULL);
+		slice dbline = arrays.ref[i].whole(arrays.text);
+		best->line.assign(dbline.p, dbline.len);
+		best->line += '\t';
+		best->line.append(q.whole.p, q.whole.len);
+		best->line += '\t';
+		best->line += type;
+		return(best);
+	}
+};
+
+//point arrays at the first entry of each db vector, the counters at those
+//of the given slot
+void point_arrays(ptr_entry &arrays, chr_entry &e, size_t slot) {
+	arrays.text = &e.dbtext[0];
+	arrays.ref = &e.dbref[0];
+	arrays.physical_start = &e.dbphysical_start[0];
+	arrays.physical_end = &e.dbphysical_end[0];
+	arrays.found = &e.dbfound[e.base(slot)];
+	arrays.hits = &e.dbhits[e.base(slot)];
+	return;
+}
+
+void point_arrays(ptr_entry &arrays, chr_entry_s &e, size_t slot) {
+	point_arrays(arrays, static_cast<chr_entry&>(e), slot);
+	arrays.strand = &e.dbstrand[0];
+	arrays.found2 = &e.dbfound2[e.base(slot)];
+	arrays.hits2 = &e.dbhits2[e.base(slot)];
+	return;
+}
+
+//-s i, every overlap is a hit
+struct ignore_strand_policy {
+	typedef chr_entry entry_type;
+
+	static chr_entry *lookup(const qentry &q) {
+		return(find_table(db, q.chr_id));
+	}
+
+	static unsigned char query_strand(const qentry &q) {
+		return(NO_STRAND);
+	}
+
+	template <class sink>
+	static void hit(const qentry &q, ptr_entry &arrays, size_t i,
+		unsigned char qstrand, char type, match_ctx &ctx
+	) {
+		arrays.found[i]++;
+		sink::write(ctx, 0, arrays, i, q, type);
+		//count the query hits against the db entry, entries sharing desc1 and
+		//desc2 are summed when the total file is written
+		arrays.hits[i] += q.desc2;
+		return;
+	}
+};
+
+//-s s and -s o, the query strand code picks one of the split caches through
+//split_tables, so the hit itself is the same as for -s i
+struct split_policy : public ignore_strand_policy {
+	static chr_entry *lookup(const qentry &q) {
+		deque<chr_entry> *tables = split_tables[strand_code(q.strand)];
+		if(tables == NULL)
+			return(NULL);
+		return(find_table(*tables, q.chr_id));
+	}
+};
+
+//-s bf, every overlap is a hit flagged as sense or antisense
+struct sense_policy {
+	typedef chr_entry_s entry_type;
+
+	static chr_entry_s *lookup(const qentry &q) {
+		return(find_table(db_sense, q.chr_id));
+	}
+
+	static unsigned char query_strand(const qentry &q) {
+		return(strand_code(q.strand));
+	}
+
+	template <class sink>
+	static void hit(const qentry &q, ptr_entry &arrays, size_t i,
+		unsigned char qstrand, char type, match_ctx &ctx
+	) {
+		arrays.found[i]++;
+		sink::write(ctx, 0, arrays, i, q, type,
+			qstrand == arrays.strand[i] ? 'S' : 'A');
+		arrays.hits[i] += q.desc2;
+		return;
+	}
+};
+
+//-s bs, sense and antisense hits go to separate outputs and counters,
+//dbfound counts both so zero filling sees every matched entry
+struct sense_split_policy : public sense_policy {
+	template <class sink>
+	static void hit(const qentry &q, ptr_entry &arrays, size_t i,
+		unsigned char qstrand, char type, match_ctx &ctx
+	) {
+		arrays.found[i]++;
+		if(qstrand == arrays.strand[i]) {
+			sink::write(ctx, 0, arrays, i, q, type);
+			arrays.hits[i] += q.desc2;
+		}else {
+			sink::write(ctx, 1, arrays, i, q, type);
+			arrays.found2[i]++;
+			arrays.hits2[i] += q.desc2;
+		}
+		return;
+	}
+};
+
+//look up the entries overlapping the query in the interval index of the
+//subset of the cache corresponding to this chromosome, classify each match
+template <class strand_policy, class sink>
+void match_kernel(qentry &q, match_ctx &ctx) {
+	typename strand_policy::entry_type *e = strand_policy::lookup(q);
+	//is this chromosome in the db?
+	if(e == NULL)
+		return;
+	ctx.counts.candidates += e->overlaps(q.physical_start, q.physical_end,
+		ctx.hits);
+	if(ctx.hits.empty())
+		return;
+	ctx.counts.matches += ctx.hits.size();
+
+	ptr_entry arrays;
+	point_arrays(arrays, *e, ctx.slot);
+	unsigned char qstrand = strand_policy::query_strand(q);
+	//the index only returns entries with some type of overlap
+	for(size_t h = 0; h < ctx.hits.size(); h++) {
+		size_t i = ctx.hits[h];
+		char type = match_type(q, arrays.physical_start[i],
+			arrays.physical_end[i]);
+		strand_policy::template hit<sink>(q, arrays, i, qstrand, type, ctx);
+	}
+	return;
+}
+
+//resolve the strand option to its kernel
+template <class sink>
+match_fn select_kernel(int option) {
+	switch(option) {
+		case SAME_STRAND:
+		case OPPOSITE_STRAND:
+			return(match_kernel<split_policy, sink>);
+		case SENSE:
+			return(match_kernel<sense_policy, sink>);
+		case SENSE_SPLIT:
+			return(match_kernel<sense_split_policy, sink>);
+		default:
+			return(match_kernel<ignore_strand_policy, sink>);
+	}
+}
+
+match_fn select_kernel(const sample_ctx &smp, int option) {
+	if(smp.totals_only)
+		return(select_kernel<null_sink>(option));
+	if(smp.dedup)
+		return(select_kernel<dedup_sink>(option));
+	return(select_kernel<detail_sink>(option));
+}
+
+//every chr_entry of the DB, only one of the caches is populated
+void all_entries(vector<chr_entry*> &entries) {
+	entries.clear();
+	for(size_t c = 0; c < db.size(); c++) {
+		entries.push_back(&db[c]);
+	}
+	for(
+		unordered_map<string, deque<chr_entry> >::iterator
+			db_strand_it = db_strand.begin();
+		db_strand_it != db_strand.end();
+		db_strand_it++
+	){
+		for(size_t c = 0; c < db_strand_it->second.size(); c++) {
+			entries.push_back(&db_strand_it->second[c]);
+		}
+	}
+	for(size_t c = 0; c < db_sense.size(); c++) {
+		entries.push_back(&db_sense[c]);
+	}
+	return;
+}
+
+//counter slots a sample's queries use, one per query thread
+inline size_t query_slots(int threads) {
+#ifndef SINGLE
+	return(threads);
+#else
+	return(1);
+#endif
+}
+
+//make room for the given number of counter slots in every entry, a sample
+//run with n query threads owns n slots starting at its own
+void counter_slots(size_t slots) {
+	vector<chr_entry*> entries;
+	all_entries(entries);
+	for(size_t i = 0; i < entries.size(); i++) {
+		entries[i]->counters(slots);
+	}
+	return;
+}
+
+//walk the DB once, summing the hits of every entry the sample matched into
+//its totals tables by desc1/desc2 key
+void collect_totals(sample_ctx &smp) {
+	vector<chr_entry*> entries;
+	all_entries(entries);
+	for(size_t i = 0; i < entries.size(); i++) {
+		entries[i]->totals(smp);
+	}
+	return;
+}
+
+//write a line of a totals file, file 1 is the antisense totals of -s bs,
+//--dedup offers it as the best line of its symbol
+void write_total(sample_ctx &smp, int file, const slice &desc1,
+	const slice &desc2, long hits
+) {
+	(file ? smp.totalfile2 : smp.totalfile) << desc1 << '\t' << desc2 << '\t'
+		<< hits << endl;
+	if(!smp.dedup)
+		return;
+	dedup_line *best = smp.dedup_total[file].offer(desc2, hits);
+	if(best != NULL) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "\t%ld", hits);
+		best->line.assign(desc1.p, desc1.len);
+		best->line += '\t';
+		best->line.append(desc2.p, desc2.len);
+		best->line += buf;
+	}
+	return;
+}
+
+//the same for a "desc1\tdesc2" key
+void write_total(sample_ctx &smp, int file, const string &key, long hits) {
+	size_t tab = key.find('\t');
+	slice desc1 = {key.data(), tab};
+	slice desc2 = {key.data() + tab + 1, key.size() - tab - 1};
+	write_total(smp, file, desc1, desc2, hits);
+	return;
+}
+
+void *add_zeros_ignore_strand(sample_ctx &smp){
+
+	//iterater over the chromasomes
+	for(size_t c = 0; c < db.size(); c++) {
+		chr_entry &e = db[c];
+		if(e.dbref.empty())
+			continue;
+		//get the size of a entry
+		size_t max = e.dbref.size();
+		ptr_entry arrays;
+		const string &chr = chromosomes.names[c];
+		//point to the first entry	of each vector
+		arrays.text = &e.dbtext[0];
+		arrays.ref = &e.dbref[0];
+		arrays.physical_start = &e.dbphysical_start[0];
+		arrays.physical_end = &e.dbphysical_end[0];
+		arrays.found = &e.dbfound[e.base(smp.slot)];
+
+		//iterate over our pointers
+		for(size_t i = 0; i < max; i++) {
+			if(!arrays.found[i]){
+				slice desc1 = arrays.ref[i].desc1(arrays.text);
+				slice desc2 = arrays.ref[i].desc2(arrays.text);
+
+				write_total(smp, 0, desc1, desc2, 0);
+
+				if(smp.totals_only)
+					continue;
+				smp.outfile << desc1 << '\t' << desc2 << '\t' <<
+					chr << '\t' << arrays.physical_start[i] << '\t' <<
+					arrays.physical_end[i] << "\t\t\t\t\t\t" << endl;
+			}
+		}
+	}
+	return NULL;
+}
+
+void *add_zeros_strand(sample_ctx &smp){
+
+	//iterate over strands
+	for(
+		unordered_map<string, deque<chr_entry> >::iterator
+		  	db_strand_it = db_strand.begin();
+		db_strand_it != db_strand.end();
+		db_strand_it++
+	){
+		deque<chr_entry> *db_inner = &db_strand_it->second;
+		//iterate over chromasomes
+		string strand = db_strand_it->first;
+		for(size_t c = 0; c < db_inner->size(); c++) {
+			chr_entry &e = (*db_inner)[c];
+			if(e.dbref.empty())
+				continue;
+			//get the size of a entry
+			size_t max = e.dbref.size();
+			ptr_entry arrays;
+			const string &chr = chromosomes.names[c];
+	
+			//point to the first entry	
+			arrays.text = &e.dbtext[0];
+			arrays.ref = &e.dbref[0];
+			arrays.physical_start = &e.dbphysical_start[0];
+			arrays.physical_end = &e.dbphysical_end[0];
+			arrays.found = &e.dbfound[e.base(smp.slot)];
+
+			//iterate over the vectors of the chr entries by pointer
+			//note that's 6 or seven vectors at once, pointer math saves us from
+			//declaring 6 or 7 iterators.
+			for(size_t i = 0; i < max; i++) {
+				if(!arrays.found[i]){
+					slice desc1 = arrays.ref[i].desc1(arrays.text);
+					slice desc2 = arrays.ref[i].desc2(arrays.text);
+
+					write_total(smp, 0, desc1, desc2, 0);
+
+					if(smp.totals_only)
+						continue;
+					smp.outfile << desc1 << '\t' << desc2 << '\t' <<
+						chr << '\t' << arrays.physical_start[i] << '\t' <<
+						arrays.physical_end[i] << '\t' << strand <<
+						"\t\t\t\t\t\t\t" << endl;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+
+void *add_zeros_sense(sample_ctx &smp){
+
+	//iterater over the chromasomes
+	for(size_t c = 0; c < db_sense.size(); c++) {
+		chr_entry_s &e = db_sense[c];
+		if(e.dbref.empty())
+			continue;
+		//get the size of a entry
+		size_t max = e.dbref.size();
+		ptr_entry arrays;
+		const string &chr = chromosomes.names[c];
+	
+		//point to the first entry	
+		arrays.text = &e.dbtext[0];
+		arrays.ref = &e.dbref[0];
+		arrays.physical_start = &e.dbphysical_start[0];
+		arrays.physical_end = &e.dbphysical_end[0];
+		arrays.strand = &e.dbstrand[0];
+		arrays.found = &e.dbfound[e.base(smp.slot)];
+
+		//iterate over our pointers
+		for(size_t i = 0; i < max; i++) {
+			if(!arrays.found[i]){
+				slice desc1 = arrays.ref[i].desc1(arrays.text);
+				slice desc2 = arrays.ref[i].desc2(arrays.text);
+
+				write_total(smp, 0, desc1, desc2, 0);
+
+				write_total(smp, 1, desc1, desc2, 0);
+
+				if(smp.totals_only)
+					continue;
+				smp.outfile << desc1 << '\t' << desc2 << '\t' <<
+					chr << '\t' << arrays.physical_start[i] << '\t' <<
+					arrays.physical_end[i] << '\t' << strand_names[arrays.strand[i]] <<
+					"\t\t\t\t\t\t\t" << endl;
+
+				smp.outfile2 << desc1 << '\t' << desc2 << '\t' <<
+					chr << '\t' << arrays.physical_start[i] << '\t' <<
+					arrays.physical_end[i] << '\t' << strand_names[arrays.strand[i]] <<
+					"\t\t\t\t\t\t\t" << endl;
+			}
+		}
+	}
+	return NULL;
+}
+
+//parse and match every query line in [begin, end)
+void query(const char *begin, const char *end, size_t at, int option,
+	match_ctx &ctx
+) {
+	qentry q;
+	for(const char *p = begin, *eol; p < end; p = next_line(eol, end)) {
+		eol = line_end(p, end);
+		ctx.pos = at + (p - begin);
+		ctx.counts.lines++;
+		if(!parse_query_line(p, eol, q, option)) {
+			slice line = {p, (size_t)(eol - p)};
+			cout << "Query File contains bad line, skipping: " << line << endl;
+			ctx.counts.bad++;
+			continue;
+		}
+		q.chr_id = chromosomes.find(q.chr, ctx.chr_last);
+		ctx.match(q, ctx);
+	}
+	return;
+}
+
+//write out the detail lines accumulated so far
+void flush_ctx(match_ctx &ctx) {
+	if(ctx.smp->outfile.is_open()) {
+		ctx.smp->outfile << ctx.acc.str();
+		ctx.acc.str("");
+	}
+	if(ctx.smp->outfile2.is_open()) {
+		ctx.smp->outfile2 << ctx.acc2.str();
+		ctx.acc2.str("");
+	}
+	return;
+}
+
+//fold the --dedup lines and --stats counts a thread kept into those of its
+//sample and the run
+void merge_ctx(match_ctx &ctx) {
+	for(int f = 0; f < 2; f++) {
+		ctx.smp->dedup_detail[f].merge(ctx.dedup[f]);
+		ctx.dedup[f].clear();
+	}
+	stats.add(ctx.counts);
+	ctx.counts = run_counts();
+	return;
+}
+
+#ifndef SINGLE
+//worker thread, takes chunks in order until the reader has finished and
+//every chunk has been taken, output goes back into the chunk
+void *t_query(void *arg) {
+	query_worker *w = reinterpret_cast<query_worker*>(arg);
+	query_pool *pool = w->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while(true) {
+		while(pool->next == pool->queued && !pool->eof)
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		if(pool->next == pool->queued)
+			break;
+		query_chunk &chunk = pool->chunks[pool->next % pool->chunks.size()];
+		chunk.state = CHUNK_BUSY;
+		pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		query(chunk.begin, chunk.end, chunk.at, pool->option, w->ctx);
+		chunk.out = w->ctx.acc.str();
+		w->ctx.acc.str("");
+		chunk.out2 = w->ctx.acc2.str();
+		w->ctx.acc2.str("");
+
+		pthread_mutex_lock(&pool->lock);
+		chunk.state = CHUNK_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_exit(NULL);
+}
+
+//threaded replacement for the query loop, the calling thread cuts the query
+//lines into chunks and writes finished chunks in order while the workers run
+//the query functions, a chunk of a query that is not mapped is copied out of
+//the batch it was read in
+void query_threaded(line_stream &query_in, int option, int threads,
+	sample_ctx &smp
+) {
+	query_pool pool;
+	vector<query_worker> workers(threads);
+	pthread_t tid[threads];
+	size_t written = 0;
+	const char *p = NULL;
+	const char *end = NULL;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.ready, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.chunks.resize(threads * 4);
+	for(size_t i = 0; i < pool.chunks.size(); i++) {
+		pool.chunks[i].state = CHUNK_EMPTY;
+	}
+	pool.queued = 0;
+	pool.next = 0;
+	pool.eof = !query_in.next(p, end);
+	pool.option = option;
+	//the batch p was cut from, chunks take their input offset from it
+	const char *batch = p;
+	size_t batch_at = query_in.offset();
+
+	for(int ti = 0; ti < threads; ti++) {
+		workers[ti].pool = &pool;
+		workers[ti].ctx.match = select_kernel(smp, option);
+		workers[ti].ctx.smp = &smp;
+		workers[ti].ctx.slot = smp.slot + ti;
+		pthread_create(&tid[ti], NULL, t_query,
+			reinterpret_cast<void*>(&workers[ti]));
+	}
+
+	while(true) {
+		//fill every free slot, pool.queued is only written by this thread
+		while(!pool.eof && pool.queued - written < pool.chunks.size()) {
+			query_chunk &chunk = pool.chunks[pool.queued % pool.chunks.size()];
+			const char *from = p;
+			if((size_t)(end - p) > CHUNK_BYTES)
+				p = next_line(line_end(p + CHUNK_BYTES, end), end);
+			else
+				p = end;
+			if(query_in.stable()) {
+				chunk.begin = from;
+				chunk.end = p;
+			}else {
+				chunk.text.assign(from, p);
+				chunk.begin = chunk.text.data();
+				chunk.end = chunk.begin + chunk.text.size();
+			}
+			chunk.at = batch_at + (from - batch);
+			bool last = false;
+			if(p == end) {
+				last = !query_in.next(p, end);
+				batch = p;
+				batch_at = query_in.offset();
+			}
+			pthread_mutex_lock(&pool.lock);
+			chunk.state = CHUNK_READY;
+			pool.queued++;
+			if(last)
+				pool.eof = 1;
+			pthread_cond_broadcast(&pool.ready);
+			pthread_mutex_unlock(&pool.lock);
+		}
+		if(written == pool.queued)
+			break;
+
+		//write the oldest chunk once it is done
+		query_chunk &chunk = pool.chunks[written % pool.chunks.size()];
+		pthread_mutex_lock(&pool.lock);
+		while(chunk.state != CHUNK_DONE)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		if(smp.outfile.is_open())
+			smp.outfile << chunk.out;
+		if(smp.outfile2.is_open())
+			smp.outfile2 << chunk.out2;
+		chunk.out.clear();
+		chunk.out2.clear();
+		chunk.state = CHUNK_EMPTY;
+		written++;
+	}
+
+	for(int ti = 0; ti < threads; ti++) {
+		pthread_join(tid[ti], NULL);
+		merge_ctx(workers[ti].ctx);
+	}
+	//each thread counted into its own slot, add them up in the sample's
+	vector<chr_entry*> entries;
+	all_entries(entries);
+	for(size_t i = 0; i < entries.size(); i++) {
+		for(int ti = 1; ti < threads; ti++) {
+			entries[i]->fold(smp.slot + ti, smp.slot);
+		}
+	}
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.ready);
+	pthread_cond_destroy(&pool.done);
+	return;
+}
+#endif
+
+//sorted mode replacement for the cache functions, makes one pass over the DB
+//recording where each chromosome starts and which strand identifiers occur
+//every chromosome must form one block sorted by start
+int index_sorted_db(mapped_file &db_file, int option) {
+	dentry dbentry;
+	chr_cache last;
+	int chr = -1;
+	long start = 0;
+	const char *end = db_file.data + db_file.size;
+	for(const char *p = db_file.data, *eol; p < end; p = next_line(eol, end)) {
+		eol = line_end(p, end);
+		stats.db_lines++;
+		slice line = {p, (size_t)(eol - p)};
+		if(!parse_db_line(p, eol, dbentry, option)) {
+			cout << "DB File contains bad line, skipping: " << line << endl;
+			stats.db_bad++;
+			continue;
+		}
+		dbentry.chr_id = chromosomes.add(dbentry.chr, last);
+		if(dbentry.chr_id != chr) {
+			if((size_t)dbentry.chr_id < db_blocks.size()) {
+				cerr << "Error: DB File is not sorted, chromosome " <<
+					dbentry.chr << " appears in more than one block" << endl;
+				return(1);
+			}
+			chr = dbentry.chr_id;
+			start = dbentry.physical_start;
+			db_blocks.resize(chr + 1, -1);
+			db_blocks[chr] = p - db_file.data;
+			db_block_order.push_back(chr);
+		}
+		if(dbentry.physical_start < start) {
+			cerr << "Error: DB File is not sorted by start position: " << line
+				<< endl;
+			return(1);
+		}
+		start = dbentry.physical_start;
+		if(option != IGNORE_STRAND)
+			strand_list.insert(dbentry.strand);
+	}
+	db_stream = &db_file;
+	return(0);
+}
+
+//read the next good line of the block being streamed into the lookahead
+void window_read(int option) {
+	const char *end = db_stream->data + db_stream->size;
+	window_next_valid = false;
+	while(window_pos < end) {
+		const char *eol = line_end(window_pos, end);
+		const char *p = window_pos;
+		window_pos = next_line(eol, end);
+		if(parse_db_line(p, eol, window_next, option)) {
+			window_next.chr_id = chromosomes.find(window_next.chr, window_last);
+			window_next_valid = (window_next.chr_id == window_chr);
+			return;
+		}
+	}
+	return;
+}
+
+//drop window entries that end before the given coordinate
+void window_evict(long before, int option, sample_ctx &smp) {
+	FILE *spill = zero_spill;
+	switch(option) {
+		case IGNORE_STRAND:
+			if(find_table(db, window_chr) != NULL)
+				db[window_chr].evict(before, spill, smp);
+			break;
+		case SAME_STRAND:
+		case OPPOSITE_STRAND:
+			for(
+				unordered_map<string, deque<chr_entry> >::iterator
+					db_strand_it = db_strand.begin();
+				db_strand_it != db_strand.end();
+				db_strand_it++
+			){
+				if(find_table(db_strand_it->second, window_chr) != NULL)
+					db_strand_it->second[window_chr].evict(before, spill, smp);
+			}
+			break;
+		default:
+			if(find_table(db_sense, window_chr) != NULL)
+				db_sense[window_chr].evict(before, spill, smp);
+			break;
+	}
+	return;
+}
+
+//load every entry of the current block starting at or before end, with
+//--window every entry whose window may start by then
+void window_advance(long end, int option) {
+	long reach = flank_reach();
+	while(window_next_valid && window_next.physical_start - reach <= end) {
+		switch(option) {
+			case IGNORE_STRAND:
+				chr_table(db, window_chr).push(window_next);
+				break;
+			case SAME_STRAND:
+			case OPPOSITE_STRAND:
+				chr_table(db_strand[window_next.strand], window_chr).push(window_next);
+				break;
+			default:
+				chr_table(db_sense, window_chr).push(window_next);
+				break;
+		}
+		window_read(option);
+	}
+	return;
+}
+
+//release a finished chromosome's tables in every cache
+void release_tables(int chr) {
+	if((size_t)chr < db.size())
+		db[chr].release();
+	for(
+		unordered_map<string, deque<chr_entry> >::iterator
+			db_strand_it = db_strand.begin();
+		db_strand_it != db_strand.end();
+		db_strand_it++
+	){
+		if((size_t)chr < db_strand_it->second.size())
+			db_strand_it->second[chr].release();
+	}
+	if((size_t)chr < db_sense.size())
+		db_sense[chr].release();
+	return;
+}
+
+//flush the window of the previous chromosome and start streaming the block
+//of chr, if the DB has one, -1 only flushes
+void window_open(int chr, int option, sample_ctx &smp) {
+	window_evict(LONG_MAX, option, smp);
+	if(window_chr >= 0)
+		release_tables(window_chr);
+
+	window_chr = chr;
+	window_next_valid = false;
+	if(chr >= 0 && (size_t)chr < db_blocks.size() && db_blocks[chr] >= 0) {
+		db_done.insert(chr);
+		window_pos = db_stream->data + db_blocks[chr];
+		window_read(option);
+	}
+	return;
+}
+
+//sorted mode replacement for the query loop, a sweep over the query file
+//that keeps the window of DB entries in step with the query start position
+int query_sorted(line_stream &query_in, int option, match_ctx &ctx) {
+	qentry q;
+	set<int> chr_done;
+	long start = 0;
+	const char *begin, *end;
+	while(query_in.next(begin, end)) {
+		for(const char *p = begin, *eol; p < end; p = next_line(eol, end)) {
+			eol = line_end(p, end);
+			slice line = {p, (size_t)(eol - p)};
+			ctx.pos = query_in.offset() + (p - begin);
+			ctx.counts.lines++;
+			if(!parse_query_line(p, eol, q, option)) {
+				cout << "Query File contains bad line, skipping: " << line << endl;
+				ctx.counts.bad++;
+				continue;
+			}
+			//chromosomes the DB lacks get an id too, so a query file out of order
+			//on them is still caught
+			q.chr_id = chromosomes.add(q.chr, ctx.chr_last);
+			if(q.chr_id != window_chr) {
+				if(chr_done.find(q.chr_id) != chr_done.end()) {
+					cerr << "Error: Query File is not sorted, chromosome " << q.chr
+						<< " appears in more than one block" << endl;
+					return(1);
+				}
+				chr_done.insert(window_chr);
+				window_open(q.chr_id, option, *ctx.smp);
+				start = q.physical_start;
+			}
+			if(q.physical_start < start) {
+				cerr << "Error: Query File is not sorted by start position: " <<
+					line << endl;
+				return(1);
+			}
+			start = q.physical_start;
+			window_evict(q.physical_start, option, *ctx.smp);
+			window_advance(q.physical_end, option);
+
+			ctx.match(q, ctx);
+			if(ctx.acc.tellp() > 65536 || ctx.acc2.tellp() > 65536)
+				flush_ctx(ctx);
+		}
+	}
+	flush_ctx(ctx);
+	merge_ctx(ctx);
+
+	//flush the last window, then stream the blocks no query reached so their
+	//entries are zero filled too
+	window_open(-1, option, *ctx.smp);
+	if(zero_spill != NULL) {
+		for(size_t i = 0; i < db_block_order.size(); i++) {
+			if(db_done.find(db_block_order[i]) != db_done.end())
+				continue;
+			window_open(db_block_order[i], option, *ctx.smp);
+			window_advance(LONG_MAX, option);
+			window_open(-1, option, *ctx.smp);
+		}
+	}
+	db_stream->close();
+	return(0);
+}
+
+//sorted mode replacement for the add_zeros functions, writes the spilled
+//entries in the format the in-memory functions use
+void *add_zeros_sorted(sample_ctx &smp, int option){
+	string tail;
+	char buf[4096];
+	string line;
+
+	switch(option) {
+		case IGNORE_STRAND:
+			tail = "\t\t\t\t\t\t";
+			break;
+		case SENSE:
+			//the in-memory path fills -s bf from db_strand, which is empty for
+			//this option, so it writes no zero entries either
+			return NULL;
+		default:
+			tail = "\t\t\t\t\t\t\t";
+			break;
+	}
+
+	rewind(zero_spill);
+	while(fgets(buf, sizeof(buf), zero_spill) != NULL) {
+		line += buf;
+		if(line.empty() || line[line.size() - 1] != '\n')
+			continue;
+		line.resize(line.size() - 1);
+
+		size_t tab = line.find('\t');
+		tab = line.find('\t', tab + 1);
+		string key = line.substr(0, tab);
+
+		write_total(smp, 0, key, 0);
+		if(!smp.totals_only)
+			smp.outfile << line << tail << endl;
+		if(option == SENSE_SPLIT) {
+			write_total(smp, 1, key, 0);
+			if(!smp.totals_only)
+				smp.outfile2 << line << tail << endl;
+		}
+		line.clear();
+	}
+	fclose(zero_spill);
+	return NULL;
+}
+
+//verify the DB has one or two strand identifiers when strands are in use
+//and set up split_tables for -s s and -s o
+int check_strands(int option) {
+	if(option == IGNORE_STRAND)
+		return(0);
+
+	//if we care about strandedness, verify we have two strand identifiers
+	//exiting on finding bad strand data is probably a better approach
+	switch(strand_list.size()) {
+		case IGNORE_STRAND:
+			cerr << "Error: DB File does not contain a strand identifier column"
+				<< endl;
+			return(1);
+		case SAME_STRAND:
+			strand_list.insert("dummy");
+			break;
+		case OPPOSITE_STRAND:
+			break;
+		default:
+			cerr << "Error: DB File contains more than two strand identifiers"
+				<< endl;
+			return(1);
+	}
+
+	unordered_map<string, string> strand_map;
+	switch(option) {
+		case SAME_STRAND:
+			strand_map[*strand_list.begin()] = *strand_list.begin();
+			strand_map[*strand_list.rbegin()] = *strand_list.rbegin();
+			break;
+		case OPPOSITE_STRAND:
+			strand_map[*strand_list.begin()] = *strand_list.rbegin();
+			strand_map[*strand_list.rbegin()] = *strand_list.begin();
+			break;
+		default:
+			return(0);
+	}
+
+	//identifiers the DB does not use match as "dummy" does, the caches are
+	//created here so sorted and --max-mem loads fill the same deques
+	fill(split_tables, split_tables + NO_STRAND + 1, (deque<chr_entry> *)NULL);
+	for(set<string>::iterator it = strand_list.begin();
+		it != strand_list.end(); it++) {
+		const string &target = strand_map[*it];
+		deque<chr_entry> *tables = target == "dummy" ? NULL : &db_strand[target];
+		if(*it == "dummy")
+			split_tables[NO_STRAND] = tables;
+		else
+			split_tables[add_strand_code(*it)] = tables;
+	}
+	return(0);
+}
+
+//an output name ending in .gz asks for compressed output, every output
+//file then gets the suffix after its usual name
+void set_output_name(sample_ctx &smp, const string &name) {
+	smp.output_name = name;
+	smp.suffix = "";
+	smp.compress = false;
+	if(name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0) {
+		smp.output_name.resize(name.size() - 3);
+		smp.suffix = ".gz";
+		smp.compress = true;
+	}
+	return;
+}
+
+//the header line of the detail files
+const char *detail_header(int option) {
+	if(option == IGNORE_STRAND)
+		return("db.desc1\tdb.desc2\tdb.chr\tdb.start\tdb.end"
+			"\tq.desc1\tq.hits\tq.chr\tq.start\tq.end\tmatch\n");
+	return("db.desc1\tdb.desc2\tdb.chr\tdb.start\tdb.end\tdb.strand"
+		"\tq.desc1\tq.hits\tq.chr\tq.start\tq.end\tq.strand\tmatch\n");
+}
+
+//open the detail output files of a sample and write their headers, -s bs
+//writes sense hits to _sense and antisense hits to _antisense, --totals-only
+//has no detail files
+int open_outputs(sample_ctx &smp, int option) {
+	if(smp.totals_only)
+		return(0);
+
+	string name = smp.output_name;
+	if(option == SENSE_SPLIT) {
+		string antisense_file_name = name + "_antisense" + smp.suffix;
+		smp.outfile2.open(antisense_file_name.c_str(), smp.compress,
+			smp.detail_order);
+		if(smp.outfile2.fail()) {
+			cout << "Error: Could not create output file \"" <<
+			  	antisense_file_name << "\"\n";
+
+			return(1);
+		}
+
+		name += "_sense";
+	}
+
+	smp.outfile.open((name + smp.suffix).c_str(), smp.compress,
+		smp.detail_order);
+	if(smp.outfile.fail()) {
+		cout << "Error: Could not create output file \"" << name
+		  	<< smp.suffix << "\"\n";
+
+		return(1);
+	}
+
+	//write out a header
+	smp.outfile << detail_header(option);
+	if(option == SENSE_SPLIT)
+		smp.outfile2 << detail_header(option);
+	return(0);
+}
+
+//match the query lines in [p, end) against the cached DB, the whole of a
+//sample's query file unless --max-mem hands it over a run at a time
+void run_queries(sample_ctx &smp, line_stream &query_in, int option,
+	int threads
+) {
+	match_ctx ctx;
+	ctx.smp = &smp;
+	ctx.slot = smp.slot;
+	ctx.match = select_kernel(smp, option);
+#ifndef SINGLE
+	if(threads > 1) {
+		query_threaded(query_in, option, threads, smp);
+		return;
+	}
+#endif
+	const char *p, *end;
+	while(query_in.next(p, end)) {
+		const char *batch = p;
+		//match a block of lines at a time to keep the detail buffer small
+		while(p < end) {
+			const char *block_end = end;
+			if((size_t)(end - p) > 65536)
+				block_end = next_line(line_end(p + 65536, end), end);
+			query(p, block_end, query_in.offset() + (p - batch), option, ctx);
+			flush_ctx(ctx);
+			p = block_end;
+		}
+	}
+	merge_ctx(ctx);
+	return;
+}
+
+//--max-mem, the DB and query files are indexed by chromosome as runs of
+//consecutive lines, then the chromosomes are cached a group at a time, as
+//many as fit in the budget, and each group is matched against the query
+//lines of its chromosomes
+struct line_runs {
+	vector<slice> runs;
+	size_t lines;
+	size_t bytes;
+
+	line_runs() : lines(0), bytes(0) { }
+};
+
+//a run's detail lines in the spill files, written back in query order
+struct query_block {
+	const char *begin;
+	long pos[2];
+	long len[2];
+
+	bool operator<(const query_block &other) const {
+		return(begin < other.begin);
+	}
+};
+
+bool slice_before(const slice &a, const slice &b) {
+	return(a.p < b.p);
+}
+
+//the scans of the mapped files let the pages behind them go every
+//DROP_BYTES, they are read again a group at a time
+const long DROP_BYTES = 16 << 20;
+
+//what caching an entry costs besides its text: the coordinate, reference,
+//counter and interval tree vectors with room for their growth
+const size_t ENTRY_BYTES = 160;
+
+//streambuf appending to a temporary file, the position is the bytes written
+class spill_buf : public streambuf {
+		FILE *file;
+	public:
+		long pos;
+
+		spill_buf() : file(NULL), pos(0) { }
+
+		bool open() {
+			file = temp_file();
+			pos = 0;
+			return(file != NULL);
+		}
+
+		//copy len bytes from off to out
+		bool copy(long off, long len, ostream &out) {
+			char buf[65536];
+			if(fseek(file, off, SEEK_SET) != 0)
+				return(false);
+			while(len > 0) {
+				size_t n = fread(buf, 1, min((long)sizeof(buf), len), file);
+				if(n == 0)
+					return(false);
+				out.write(buf, n);
+				len -= n;
+			}
+			return(true);
+		}
+
+		void close() {
+			if(file != NULL)
+				fclose(file);
+			file = NULL;
+			return;
+		}
+
+	protected:
+		int overflow(int c) {
+			if(c == EOF)
+				return(0);
+			if(fputc(c, file) == EOF)
+				return(EOF);
+			pos++;
+			return(c);
+		}
+
+		streamsize xsputn(const char *p, streamsize n) {
+			size_t done = fwrite(p, 1, n, file);
+			pos += done;
+			return(done);
+		}
+
+		int sync() {
+			return(fflush(file) == 0 ? 0 : -1);
+		}
+};
+
+//add a line to the runs of its chromosome, extending the last run if the
+//line follows it
+void add_run(vector<line_runs> &table, int chr, const char *p,
+	const char *next
+) {
+	if(table.size() <= (size_t)chr)
+		table.resize(chr + 1);
+	line_runs &r = table[chr];
+	if(!r.runs.empty() && r.runs.back().p + r.runs.back().len == p) {
+		r.runs.back().len += next - p;
+	}else {
+		slice run = {p, (size_t)(next - p)};
+		r.runs.push_back(run);
+	}
+	r.lines++;
+	r.bytes += next - p;
+	return;
+}
+
+//one pass over the DB numbering its chromosomes and noting its strand
+//identifiers as caching it would, -s s and -s o get their split caches in
+//the order caching would create them so zero filling visits them alike
+void index_db_runs(mapped_file &db_file, int option,
+	vector<line_runs> &db_runs
+) {
+	dentry dbentry;
+	chr_cache last;
+	const char *end = db_file.data + db_file.size;
+	const char *kept = db_file.data;
+	for(const char *p = db_file.data, *eol; p < end; p = next_line(eol, end)) {
+		eol = line_end(p, end);
+		if(p - kept > DROP_BYTES) {
+			db_file.drop_pages(kept, p);
+			kept = p;
+		}
+		stats.db_lines++;
+		if(!parse_db_line(p, eol, dbentry, option)) {
+			slice line = {p, (size_t)(eol - p)};
+			cout << "DB File contains bad line, skipping: " << line << endl;
+			stats.db_bad++;
+			continue;
+		}
+		add_run(db_runs, chromosomes.add(dbentry.chr, last), p,
+			next_line(eol, end));
+		if(option == IGNORE_STRAND)
+			continue;
+		strand_list.insert(dbentry.strand);
+		if(option == SAME_STRAND || option == OPPOSITE_STRAND)
+			db_strand[dbentry.strand];
+	}
+	return;
+}
+
+//the same for the query, lines on a chromosome the DB lacks are counted and
+//left out as are bad lines, which are reported here and only here
+void index_query_runs(mapped_file &query_file, int option,
+	vector<line_runs> &query_runs
+) {
+	qentry q;
+	chr_cache last;
+	run_counts counts;
+	const char *end = query_file.data + query_file.size;
+	const char *kept = query_file.data;
+	for(const char *p = query_file.data, *eol; p < end;
+		p = next_line(eol, end)
+	) {
+		eol = line_end(p, end);
+		if(p - kept > DROP_BYTES) {
+			query_file.drop_pages(kept, p);
+			kept = p;
+		}
+		if(!parse_query_line(p, eol, q, option)) {
+			slice line = {p, (size_t)(eol - p)};
+			cout << "Query File contains bad line, skipping: " << line << endl;
+			counts.lines++;
+			counts.bad++;
+			continue;
+		}
+		int chr = chromosomes.find(q.chr, last);
+		if(chr < 0) {
+			counts.lines++;
+			continue;
+		}
+		add_run(query_runs, chr, p, next_line(eol, end));
+	}
+	stats.add(counts);
+	return;
+}
+
+//cache the DB lines of one chromosome as the cache functions would, with
+//the given number of counter slots
+void cache_runs(const line_runs &r, int chr, int option, size_t slots) {
+	dentry dbentry;
+	for(size_t i = 0; i < r.runs.size(); i++) {
+		const char *end = r.runs[i].p + r.runs[i].len;
+		for(const char *p = r.runs[i].p, *eol; p < end; p = next_line(eol, end)) {
+			eol = line_end(p, end);
+			parse_db_line(p, eol, dbentry, option);
+			switch(option) {
+				case IGNORE_STRAND:
+					chr_table(db, chr).push(dbentry);
+					break;
+				case SAME_STRAND:
+				case OPPOSITE_STRAND:
+					chr_table(db_strand[dbentry.strand], chr).push(dbentry);
+					break;
+				default:
+					chr_table(db_sense, chr).push(dbentry);
+					break;
+			}
+		}
+	}
+
+	vector<db_table> tables;
+	all_tables(tables);
+	for(size_t t = 0; t < tables.size(); t++) {
+		if(tables[t].chr == chr) {
+			tables[t].entry->build_index();
+			tables[t].entry->counters(slots);
+		}
+	}
+	return;
+}
+
+//total a finished chromosome table and spill the zero lines of the entries
+//it never matched formatted as the add_zeros functions write them, strand
+//is the column the table's entries get, empty for -s i
+void spill_zeros(chr_entry &e, int chr, const string &strand,
+	sample_ctx &smp, FILE *spill
+) {
+	e.totals(smp);
+	if(spill == NULL)
+		return;
+	size_t b = e.base(smp.slot);
+	for(size_t i = 0; i < e.dbref.size(); i++) {
+		if(e.dbfound[b + i])
+			continue;
+		const text_ref &ref = e.dbref[i];
+		slice desc1 = ref.desc1(&e.dbtext[0]);
+		slice desc2 = ref.desc2(&e.dbtext[0]);
+		fprintf(spill, "%.*s\t%.*s\t%s\t%ld\t%ld", (int)desc1.len, desc1.p,
+			(int)desc2.len, desc2.p, chromosomes.names[chr].c_str(),
+			e.dbphysical_start[i], e.dbphysical_end[i]);
+		if(!strand.empty())
+			fprintf(spill, "\t%s", strand.c_str());
+		fputc('\n', spill);
+	}
+	return;
+}
+
+void spill_zeros(chr_entry_s &e, int chr, sample_ctx &smp, FILE *spill) {
+	size_t b = e.base(smp.slot);
+	for(size_t i = 0; i < e.dbref.size(); i++) {
+		e.total(i, smp);
+		if(spill == NULL || e.dbfound[b + i])
+			continue;
+		const text_ref &ref = e.dbref[i];
+		slice desc1 = ref.desc1(&e.dbtext[0]);
+		slice desc2 = ref.desc2(&e.dbtext[0]);
+		fprintf(spill, "%.*s\t%.*s\t%s\t%ld\t%ld\t%s\n", (int)desc1.len, desc1.p,
+			(int)desc2.len, desc2.p, chromosomes.names[chr].c_str(),
+			e.dbphysical_start[i], e.dbphysical_end[i],
+			strand_names[e.dbstrand[i]].c_str());
+	}
+	return;
+}
+
+//total, spill and release the tables of a finished chromosome, -s s and -s o
+//spill each strand's zero lines to its own file, spills[k] for the k-th
+//split cache, since zero filling visits one strand after the other, -s bf
+//writes no zero lines as the in-memory path does not
+void finish_chr(int chr, int option, sample_ctx &smp, vector<FILE*> &spills) {
+	size_t k = 0;
+	switch(option) {
+		case IGNORE_STRAND:
+			if(find_table(db, chr) != NULL)
+				spill_zeros(db[chr], chr, "", smp, spills.empty() ? NULL : spills[0]);
+			break;
+		case SAME_STRAND:
+		case OPPOSITE_STRAND:
+			for(
+				unordered_map<string, deque<chr_entry> >::iterator
+					db_strand_it = db_strand.begin();
+				db_strand_it != db_strand.end();
+				db_strand_it++, k++
+			){
+				if(find_table(db_strand_it->second, chr) != NULL)
+					spill_zeros(db_strand_it->second[chr], chr, db_strand_it->first,
+						smp, spills.empty() ? NULL : spills[k]);
+			}
+			break;
+		case SENSE:
+			if(find_table(db_sense, chr) != NULL)
+				spill_zeros(db_sense[chr], chr, smp, NULL);
+			break;
+		default:
+			if(find_table(db_sense, chr) != NULL)
+				spill_zeros(db_sense[chr], chr, smp,
+					spills.empty() ? NULL : spills[0]);
+			break;
+	}
+	release_tables(chr);
+	return;
+}
+
+//--max-mem replacement for caching the DB and matching, the detail lines of
+//each query run are spilled and written back in query order once every
+//group is done, so the output is that of a run holding the whole DB, the
+//zero lines are left in zero_spill for write_results
+int query_by_chr(mapped_file &db_file, mapped_file &query_file,
+	vector<line_runs> &db_runs, int option, int threads, int no_zeros,
+	size_t max_mem, sample_ctx &smp
+) {
+	vector<line_runs> query_runs;
+	index_query_runs(query_file, option, query_runs);
+
+	vector<FILE*> spills;
+	size_t spill_count = (option == SAME_STRAND || option == OPPOSITE_STRAND)
+		? db_strand.size() : 1;
+	for(size_t i = 0; !no_zeros && option != SENSE && i < spill_count; i++) {
+		spills.push_back(temp_file());
+		if(spills.back() == NULL) {
+			cerr << "Error: Could not create a temporary file" << endl;
+			return(1);
+		}
+	}
+
+	//detail lines go to the spill files while the groups run
+	spill_buf detail[2];
+	output_file *outputs[2] = {&smp.outfile, &smp.outfile2};
+	streambuf *targets[2] = {NULL, NULL};
+	for(int f = 0; f < 2; f++) {
+		if(!outputs[f]->is_open())
+			continue;
+		if(!detail[f].open()) {
+			cerr << "Error: Could not create a temporary file" << endl;
+			return(1);
+		}
+		targets[f] = outputs[f]->rdbuf(&detail[f]);
+	}
+
+	vector<query_block> blocks;
+	size_t chr = 0;
+	while(chr < db_runs.size()) {
+		//as many chromosomes as fit, always at least one
+		size_t first = chr;
+		size_t used = 0;
+		do {
+			used += db_runs[chr].bytes + db_runs[chr].lines * ENTRY_BYTES;
+			chr++;
+		} while(chr < db_runs.size() && used + db_runs[chr].bytes
+			+ db_runs[chr].lines * ENTRY_BYTES <= max_mem);
+		if(used > max_mem)
+			cerr << "Warning: chromosome " << chromosomes.names[first] << " needs"
+				<< " about " << (used >> 10) << "KB, more than --max-mem" << endl;
+
+		vector<slice> runs;
+		for(size_t c = first; c < chr; c++) {
+			cache_runs(db_runs[c], c, option, query_slots(threads));
+			for(size_t i = 0; i < db_runs[c].runs.size(); i++) {
+				db_file.drop_pages(db_runs[c].runs[i].p,
+					db_runs[c].runs[i].p + db_runs[c].runs[i].len);
+			}
+			db_runs[c] = line_runs();
+			if(c < query_runs.size()) {
+				runs.insert(runs.end(), query_runs[c].runs.begin(),
+					query_runs[c].runs.end());
+				query_runs[c] = line_runs();
+			}
+		}
+
+		//the group's runs in file order
+		sort(runs.begin(), runs.end(), slice_before);
+		for(size_t i = 0; i < runs.size(); i++) {
+			query_block b;
+			b.begin = runs[i].p;
+			for(int f = 0; f < 2; f++) {
+				outputs[f]->flush();
+				b.pos[f] = detail[f].pos;
+			}
+			line_stream run;
+			run.open(runs[i].p, runs[i].p + runs[i].len,
+				runs[i].p - query_file.data);
+			run_queries(smp, run, option, threads);
+			query_file.drop_pages(runs[i].p, runs[i].p + runs[i].len);
+			for(int f = 0; f < 2; f++) {
+				outputs[f]->flush();
+				b.len[f] = detail[f].pos - b.pos[f];
+			}
+			blocks.push_back(b);
+		}
+
+		for(size_t c = first; c < chr; c++) {
+			finish_chr(c, option, smp, spills);
+		}
+	}
+
+	//the spilled detail lines in query order
+	sort(blocks.begin(), blocks.end());
+	for(int f = 0; f < 2; f++) {
+		if(targets[f] == NULL)
+			continue;
+		outputs[f]->flush();
+		outputs[f]->rdbuf(targets[f]);
+		for(size_t i = 0; i < blocks.size(); i++) {
+			if(blocks[i].len[f] && !detail[f].copy(blocks[i].pos[f],
+				blocks[i].len[f], *outputs[f])
+			) {
+				cerr << "Error: Could not read back a temporary file" << endl;
+				return(1);
+			}
+		}
+		detail[f].close();
+	}
+
+	//one zero spill, each strand's lines after the other
+	if(!spills.empty()) {
+		zero_spill = spills[0];
+		char buf[65536];
+		for(size_t i = 1; i < spills.size(); i++) {
+			size_t n;
+			rewind(spills[i]);
+			while((n = fread(buf, 1, sizeof(buf), spills[i])) > 0) {
+				fwrite(buf, 1, n, zero_spill);
+			}
+			fclose(spills[i]);
+		}
+	}
+	db_file.close();
+	return(0);
+}
+
+//--dedup writes the best lines kept from a file next to it, named as
+//tools/deduplicate.pl names them, _deduplicated before the extension
+int write_dedup(sample_ctx &smp, const string &name, const char *header,
+	dedup_table &table, const sort_spec &order
+) {
+	string file_name = name;
+	size_t dot = name.rfind('.');
+	size_t slash = name.rfind('/');
+	if(dot == string::npos || (slash != string::npos && dot < slash))
+		dot = name.size();
+	file_name.insert(dot, "_deduplicated");
+	file_name += smp.suffix;
+
+	output_file out;
+	out.open(file_name.c_str(), smp.compress, order);
+	if(out.fail()) {
+		cout << "Error: Could not create output file \"" << file_name << "\"\n";
+		return(1);
+	}
+	out << header;
+	table.write(out);
+	out.close();
+	table.clear();
+	return(0);
+}
+
+//write the totals files of a sample and the zero lines for the DB entries
+//it did not match, then close its files
+int write_results(sample_ctx &smp, int option, int no_zeros, int sorted) {
+	collect_totals(smp);
+
+	string base_file_name = smp.output_name;
+	if(option == SENSE_SPLIT)
+		base_file_name += "_sense";
+	base_file_name += "_total" + smp.suffix;
+	smp.totalfile.open(base_file_name.c_str(), smp.compress,
+		smp.total_order);
+	if(smp.totalfile.fail()) {
+		cout << "Error: Could not create output file \"" << base_file_name <<
+			"\"\n";
+
+		return(1);
+	}
+
+	smp.totalfile << "db_file.desc1\tdb_file.desc2\thits\n";
+	for(map<string, long>::iterator table_iter = smp.table.begin();
+	  	table_iter != smp.table.end();
+		table_iter++
+	) {
+		write_total(smp, 0, table_iter->first, table_iter->second);
+	}
+
+
+
+	if(option == SENSE_SPLIT) {
+		base_file_name = smp.antisense_total_name + smp.suffix;
+		smp.totalfile2.open(base_file_name.c_str(), smp.compress,
+			smp.total_order);
+		if(smp.totalfile2.fail()) {
+			cout << "Error: Could not create output file \"" << base_file_name <<
+				"\"\n";
+
+			return(1);
+		}
+		smp.totalfile2 << "db_file.desc1\tdb_file.desc2\thits";
+		for(map<string, long>::iterator table_iter = smp.table2.begin();
+			table_iter != smp.table2.end();
+			table_iter++
+		) {
+			write_total(smp, 1, table_iter->first, table_iter->second);
+		}
+	}
+
+	if(no_zeros == 0 && sorted) {
+		add_zeros_sorted(smp, option);
+	}else if(no_zeros == 0){
+		switch(option) {
+			case IGNORE_STRAND:
+				add_zeros_ignore_strand(smp);
+				break;
+			case SAME_STRAND:
+			case OPPOSITE_STRAND:
+			case SENSE:
+				add_zeros_strand(smp);
+				break;
+			case SENSE_SPLIT:
+				add_zeros_sense(smp);
+				break;
 		}
 	}
-	return;
-}
-
-void *add_zeros_ignore_strand(){
-
-	//iterater over the chromasomes
-	for(unordered_map<string, chr_entry>::iterator db_it = db.begin();
-		db_it != db.end();
-		db_it++
-	){
-		//get the size of a entry
-		size_t max = db_it->second.dbwhole.size();
-		ptr_entry arrays;
-		string chr = db_it->first;	
-		//point to the first entry	of each vector
-		arrays.desc1 = &db_it->second.dbdesc1[0];
-		arrays.desc2 = &db_it->second.dbdesc2[0];
-		arrays.physical_start = &db_it->second.dbphysical_start[0];
-		arrays.physical_end = &db_it->second.dbphysical_end[0];
-		arrays.whole = &db_it->second.dbwhole[0];
-		arrays.found = &db_it->second.dbfound[0];
 
-		//iterate over our pointers
-		for(size_t i = 0; i < max; i++) {
-			if(!arrays.found[i]){
-				totalfile << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t'
-					<< "0" << endl;
+	if(option == SENSE_SPLIT) {
+		smp.totalfile2.close();
+		smp.outfile2.close();
+	}
+	smp.totalfile.close();
+	smp.outfile.close();
+	smp.table.clear();
+	smp.table2.clear();
 
-				outfile << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t' <<
-					chr << '\t' << arrays.physical_start[i] << '\t' <<
-					arrays.physical_end[i] << "\t\t\t\t\t\t" << endl;
-			}
-		}
+	if(smp.dedup) {
+		const char *total_header = "db_file.desc1\tdb_file.desc2\thits\n";
+		string name = smp.output_name;
+		if(option == SENSE_SPLIT)
+			name += "_sense";
+		if(write_dedup(smp, name + "_total", total_header, smp.dedup_total[0],
+				smp.total_order)
+			|| (!smp.totals_only && write_dedup(smp, name, detail_header(option),
+				smp.dedup_detail[0], smp.detail_order))
+		)
+			return(1);
+		if(option == SENSE_SPLIT && (
+			write_dedup(smp, smp.antisense_total_name, total_header,
+				smp.dedup_total[1], smp.total_order)
+			|| (!smp.totals_only && write_dedup(smp,
+				smp.output_name + "_antisense", detail_header(option),
+				smp.dedup_detail[1], smp.detail_order))
+		))
+			return(1);
 	}
+	return(0);
 }
 
-void *add_zeros_strand(){
+//batch mode, each query file becomes a sample named by the prefix and its
+//base name without directory and extension, unless a manifest names it
+string sample_name(const string &query_file_name) {
+	string name = query_file_name.substr(query_file_name.rfind('/') + 1);
+	if(name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0)
+		name.resize(name.size() - 3);
+	size_t dot = name.rfind('.');
+	if(dot != string::npos && dot > 0)
+		name.resize(dot);
+	return(name);
+}
 
-	//iterate over strands
-	for(
-		unordered_map<string, unordered_map<string, chr_entry> >::iterator
-		  	db_strand_it = db_strand.begin();
-		db_strand_it != db_strand.end();
-		db_strand_it++
-	){
-		//might be able to form an iterator on db_strand_it->second
-		//unordered_map<string, chr_entry> db_inner = db_strand[db_strand_it];
-		unordered_map<string, chr_entry> *db_inner = &db_strand_it->second;
-		//iterate over chromasomes
-		string strand = db_strand_it->first;
-		for(unordered_map<string, chr_entry>::iterator
-			  	db_it = (*db_inner).begin();
-			db_it != (*db_inner).end();
-			db_it++
-		){
-			//get the size of a entry
-			size_t max = db_it->second.dbwhole.size();
-			ptr_entry arrays;
-			string chr = db_it->first;	
-	
-			//could probably use second here too	
-			//point to the first entry	
-			arrays.desc1 = &db_it->second.dbdesc1[0];
-			arrays.desc2 = &db_it->second.dbdesc2[0];
-			arrays.physical_start = &db_it->second.dbphysical_start[0];
-			arrays.physical_end = &db_it->second.dbphysical_end[0];
-			arrays.whole = &db_it->second.dbwhole[0];
-			arrays.found = &db_it->second.dbfound[0];
+//read "query file [output name]" lines from a manifest
+int read_manifest(const string &manifest_name,
+	vector<pair<string, string> > &jobs
+) {
+	mapped_file manifest;
+	if(!manifest.open(manifest_name.c_str())) {
+		cout << "Error: Could not open manifest \"" << manifest_name << "\"\n";
+		return(1);
+	}
+	const char *end = manifest.data + manifest.size;
+	for(const char *p = manifest.data, *eol; p < end; p = next_line(eol, end)) {
+		eol = line_end(p, end);
+		slice fields[2];
+		size_t n = split_fields(p, eol, fields, 2);
+		if(n == 0)
+			continue;
+		string query_file_name(fields[0].p, fields[0].len);
+		jobs.push_back(pair<string, string>(query_file_name,
+			n == 2 ? string(fields[1].p, fields[1].len)
+				: sample_name(query_file_name)));
+	}
+	return(0);
+}
 
-			//iterate over the vectors of the chr entries by pointer
-			//note that's 6 or seven vectors at once, pointer math saves us from
-			//declaring 6 or 7 iterators.
-			for(size_t i = 0; i < max; i++) {
-				if(!arrays.found[i]){
-					totalfile << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t'
-						<< "0" << endl;
+//split the --sort-mem budget between the samples running at once and the
+//files each of them sorts, the sort threads are those of the sample
+void share_sort_mem(sample_ctx &smp, int option, size_t samples,
+	int threads
+) {
+	size_t files = samples * (option == SENSE_SPLIT ? 4 : 2);
+	smp.detail_order.mem /= files;
+	smp.detail_order.threads = threads;
+	smp.total_order.mem /= files;
+	smp.total_order.threads = threads;
+	return;
+}
 
-					outfile << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t' <<
-						chr << '\t' << arrays.physical_start[i] << '\t' <<
-						arrays.physical_end[i] << '\t' << strand <<
-						"\t\t\t\t\t\t\t" << endl;
-				}
-			}
+//run one query file of a batch using the counters of the given slot, which
+//are cleared again for the next sample, settings holds the output options
+//every sample shares
+int run_sample(const pair<string, string> &job, const string &prefix,
+	size_t slot, int option, int threads, int no_zeros,
+	const sample_ctx &settings
+) {
+	sample_ctx smp;
+	smp.totals_only = settings.totals_only;
+	smp.dedup = settings.dedup;
+	smp.detail_order = settings.detail_order;
+	smp.total_order = settings.total_order;
+	line_stream query_in;
+	int ret = 0;
+	smp.query_file_name = job.first;
+	//a prefix ending in .gz compresses every sample
+	if(prefix.size() > 3 && prefix.compare(prefix.size() - 3, 3, ".gz") == 0)
+		set_output_name(smp, prefix.substr(0, prefix.size() - 3) + job.second
+			+ ".gz");
+	else
+		set_output_name(smp, prefix + job.second);
+	smp.antisense_total_name = smp.output_name + "_antisense_total";
+	smp.slot = slot;
+	if(!query_in.open(smp.query_file_name.c_str(), threads)) {
+		cout << "Error: Could not open query file \"" << smp.query_file_name
+			<< "\"\n";
+		return(1);
+	}
+	if(open_outputs(smp, option) == 0) {
+		run_queries(smp, query_in, option, threads);
+		if(query_in.bad()) {
+			cout << "Error: Could not read query file \"" << smp.query_file_name
+				<< "\"\n";
+			ret = 1;
+		}else {
+			ret = write_results(smp, option, no_zeros, 0);
 		}
+	}else {
+		ret = 1;
 	}
-}
 
+	vector<chr_entry*> entries;
+	all_entries(entries);
+	for(size_t i = 0; i < entries.size(); i++) {
+		entries[i]->clear(slot);
+	}
+	return(ret);
+}
 
-void *add_zeros_sense(){
+#ifndef SINGLE
+//samples are taken in order by the batch threads, each thread owns the
+//counter slots of itself and the threads left over for its queries
+struct batch_pool {
+	vector<pair<string, string> > *jobs;
+	string prefix;
+	size_t next;
+	int option;
+	int threads;
+	int no_zeros;
+	const sample_ctx *settings;
+	int failed;
+};
 
-	//iterater over the chromasomes
-	for(unordered_map<string, chr_entry_s>::iterator db_it = db_sense.begin();
-		db_it != db_sense.end();
-		db_it++
-	){
-		//get the size of a entry
-		size_t max = db_it->second.dbwhole.size();
-		ptr_entry arrays;
-		string chr = db_it->first;	
-	
-		//point to the first entry	
-		arrays.desc1 = &db_it->second.dbdesc1[0];
-		arrays.desc2 = &db_it->second.dbdesc2[0];
-		arrays.physical_start = &db_it->second.dbphysical_start[0];
-		arrays.physical_end = &db_it->second.dbphysical_end[0];
-		arrays.strand = &db_it->second.dbstrand[0];
-		arrays.whole = &db_it->second.dbwhole[0];
-		arrays.found = &db_it->second.dbfound[0];
+struct batch_worker {
+	batch_pool *pool;
+	size_t slot;
+};
 
-		//iterate over our pointers
-		for(size_t i = 0; i < max; i++) {
-			if(!arrays.found[i]){
-				totalfile  << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t'
-					<< "0" << endl;
+void *t_batch(void *arg) {
+	batch_worker *w = reinterpret_cast<batch_worker*>(arg);
+	batch_pool *pool = w->pool;
+	size_t i;
+	while((i = __sync_fetch_and_add(&pool->next, 1)) < pool->jobs->size()) {
+		if(run_sample((*pool->jobs)[i], pool->prefix, w->slot, pool->option,
+			pool->threads, pool->no_zeros, *pool->settings)
+		)
+			pool->failed = 1;
+	}
+	pthread_exit(NULL);
+}
+#endif
 
-				totalfile2 << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t'
-					<< "0" << endl;
+//run every query file against the cached DB, as many samples at once as
+//there are threads
+int run_batch(vector<pair<string, string> > &jobs, const string &prefix,
+	int option, int threads, int no_zeros, sample_ctx &settings
+) {
+	set<string> names;
+	for(size_t i = 0; i < jobs.size(); i++) {
+		if(!names.insert(jobs[i].second).second) {
+			cout << "Error: more than one query file would write output \"" <<
+				prefix << jobs[i].second << "\"\n";
+			return(1);
+		}
+	}
 
-				outfile << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t' <<
-					chr << '\t' << arrays.physical_start[i] << '\t' <<
-					arrays.physical_end[i] << '\t' << arrays.strand[i] <<
-					"\t\t\t\t\t\t\t" << endl;
+	size_t slots = min((size_t)threads, jobs.size());
+	share_sort_mem(settings, option, slots, max(threads / (int)slots, 1));
+	//each sample slot is followed by the slots of its query threads
+	size_t per = query_slots(max(threads / (int)slots, 1));
+	counter_slots(slots * per);
 
-				outfile2 << arrays.desc1[i] << '\t' << arrays.desc2[i] << '\t' <<
-					chr << '\t' << arrays.physical_start[i] << '\t' <<
-					arrays.physical_end[i] << '\t' << arrays.strand[i] <<
-					"\t\t\t\t\t\t\t" << endl;
-			}
+	int failed = 0;
+#ifndef SINGLE
+	if(slots > 1) {
+		batch_pool pool;
+		vector<batch_worker> workers(slots);
+		pthread_t tid[slots];
+		pool.jobs = &jobs;
+		pool.prefix = prefix;
+		pool.next = 0;
+		pool.option = option;
+		pool.threads = threads / slots;
+		pool.no_zeros = no_zeros;
+		pool.settings = &settings;
+		pool.failed = 0;
+		for(size_t ti = 0; ti < slots; ti++) {
+			workers[ti].pool = &pool;
+			workers[ti].slot = ti * per;
+			pthread_create(&tid[ti], NULL, t_batch,
+				reinterpret_cast<void*>(&workers[ti]));
+		}
+		for(size_t ti = 0; ti < slots; ti++) {
+			pthread_join(tid[ti], NULL);
 		}
+		return(pool.failed);
 	}
+#endif
+	for(size_t i = 0; i < jobs.size(); i++) {
+		if(run_sample(jobs[i], prefix, 0, option, threads, no_zeros, settings))
+			failed = 1;
+	}
+	return(failed);
 }
 
 int main(int argc, char** args) {
 
-	ifstream db_file, query_file;
-	string line;
-	string db_file_name, query_file_name, data_output_file_name;
-	string total_output_file_name;
-	string antisense_file_name;
-	string nonsense_file_name;
+	mapped_file db_file, query_file;
+	line_stream db_in, query_in;
+	string db_file_name;
 	int opt;
 	int temp_index;
 	int option = 0;
 	int no_zeros = 0;
+	int sorted = 0;
+	int threads = 1;
+	string build_index_name, index_name;
+	string batch_prefix, manifest_name;
+	bool batch = false;
+	long sort_mem = 1024;
+	long max_mem = 0;
+	istringstream temp;
+	match_ctx ctx;
+	sample_ctx smp;
 
 	while(
-		(opt = getopt_long(argc, args, "s:h", long_options, &temp_index)) != -1
+		(opt = getopt_long(argc, args, "s:hzt:", long_options, &temp_index)) != -1
 	) {
 		switch(opt) {
 			case 'h':
@@ -706,208 +4768,311 @@ int main(int argc, char** args) {
 				break;
 			case 'z':
 				no_zeros = 1;
+				break;
+			case 'S':
+				sorted = 1;
+				break;
+			case 'B':
+				build_index_name = optarg;
+				break;
+			case 'I':
+				index_name = optarg;
+				break;
+			case 'P':
+				batch_prefix = optarg;
+				batch = true;
+				break;
+			case 'M':
+				manifest_name = optarg;
+				break;
+			case 'T':
+				smp.totals_only = true;
+				break;
+			case 'D':
+				smp.dedup = true;
+				break;
+			case 'X':
+				if(optarg != NULL && strcmp(optarg, "json")) {
+					cout << "Error: \"" << optarg << "\" is not a supported argument for"
+						<< " the \"--stats\" option\n";
+					usage();
+					return(1);
+				}
+				stats.enabled = true;
+				stats.json = (optarg != NULL);
+				break;
+			case 'O':
+				//the keys of tools/sort_cpp_result.sh and sort_cpp_result_total.sh
+				if(!parse_sort_keys(optarg == NULL ? "7n,9n" : optarg,
+					smp.detail_order)
+				) {
+					cout << "Error: \"" << optarg << "\" is not a valid sort key list\n";
+					usage();
+					return(1);
+				}
+				if(smp.total_order.keys.empty())
+					parse_sort_keys("3n,2d", smp.total_order);
+				break;
+			case 'K':
+				if(!parse_sort_keys(optarg, smp.total_order)) {
+					cout << "Error: \"" << optarg << "\" is not a valid sort key list\n";
+					usage();
+					return(1);
+				}
+				break;
+			case 'W':
+				{
+					char comma = 0;
+					temp.clear();
+					temp.str(optarg);
+					temp >> flank.up >> comma >> flank.down;
+					if(temp.fail() || comma != ',' || !temp.eof()
+						|| flank.up + flank.down < 0
+					) {
+						cout << "Error: --window argument must be two integers up,down"
+							<< " whose sum is not negative\n";
+						usage();
+						return(1);
+					}
+					flank.on = true;
+				}
+				break;
+			case 'm':
+				temp.clear();
+				temp.str(optarg);
+				temp >> sort_mem;
+				if(temp.fail() || sort_mem < 1) {
+					cout << "Error: --sort-mem argument must be an integer value greater than 0\n";
+					usage();
+					return(1);
+				}
+				break;
+			case 'L':
+				{
+					//megabytes unless followed by K, M or G
+					char unit = 'M';
+					temp.clear();
+					temp.str(optarg);
+					temp >> max_mem;
+					if(!temp.fail() && !temp.eof() && temp.peek() != EOF)
+						temp >> unit;
+					if(!temp.fail() && !temp.eof())
+						temp.peek();
+					const char *units = "KMG";
+					const char *u = strchr(units, toupper(unit));
+					if(temp.fail() || !temp.eof() || unit == 0 || u == NULL
+						|| max_mem < 1 || max_mem > (LONG_MAX >> (10 * (u - units + 1)))
+					) {
+						cout << "Error: --max-mem argument must be an integer value greater"
+							<< " than 0, optionally followed by K, M or G\n";
+						usage();
+						return(1);
+					}
+					max_mem <<= 10 * (u - units + 1);
+				}
+				break;
+			case 't':
+				temp.clear();
+				temp.str(optarg);
+				temp >> threads;
+				if(temp.fail() || threads < 1) {
+					cout << "Error: -t argument must be an integer value greater than 0\n";
+					usage();
+					return(1);
+				}
+				break;
 			default:
 				usage();
 				return(1);
 		}
 	}
 
-	int arg_count = argc-optind;
-	if(arg_count == 0) {
-		cout << "Error: DB file name must be specified\n";
-		usage();
-		return(1);
-	}else if(arg_count == 1) {
-		cout << "Error: query file name must be specified\n";
-		usage();
-		return(1);
-	}else if(arg_count == 2) {
-		cout << "Error: output file name must be specified\n";
+	if(sorted && threads > 1) {
+		cout << "Error: --sorted streams the DB and cannot be combined with -t\n";
 		usage();
 		return(1);
 	}
 
-	db_file_name = args[optind];
-	query_file_name = args[optind + 1];
-	data_output_file_name = args[optind + 2];
-	db_file.open(db_file_name.c_str());
-	if(db_file.fail()) {
-		cout << "Error: Could not open DB file \"" << db_file_name << "\"\n";
+	if(sorted && (!index_name.empty() || !build_index_name.empty())) {
+		cout << "Error: --sorted streams the DB and cannot use an index\n";
+		usage();
 		return(1);
 	}
 
-	query_file.open(query_file_name.c_str());
-	if(query_file.fail()) {
-		cout << "Error: Could not open query file \"" << query_file_name << "\"\n";
+	if(flank.on && !build_index_name.empty()) {
+		cout << "Error: --build-index stores the DB as it is, give --window when"
+			<< " the index is used\n";
+		usage();
 		return(1);
 	}
 
-	switch(option) {
-		case IGNORE_STRAND:
-			cache_ignore_strand(db_file);
-			break;
-		case SAME_STRAND:
-		case OPPOSITE_STRAND:
-			cache_strand(db_file);
-			break;
-		default:
-			cache_sense(db_file);
-			break;
+	if(!manifest_name.empty() && !batch) {
+		cout << "Error: --manifest is only used with --batch\n";
+		usage();
+		return(1);
 	}
 
-	if(option != IGNORE_STRAND) {
-		//if we care about strandedness, verify we have two strand identifiers
-		//exiting on finding bad strand data is probably a better approach
-		switch(strand_list.size()) {
-			case IGNORE_STRAND:
-				cerr << "Error: DB File does not contain a strand identifier column"
-					<< endl;
-				return(1);
-			case SAME_STRAND:
-				strand_list.insert("dummy");
-				break;
-			case OPPOSITE_STRAND:
-				break;
-			default:
-				cerr << "Error: DB File contains more than two strand identifiers"
-					<< endl;
-				return(1);
-		}
-
-		switch(option) {
-			case SAME_STRAND:
-				strand_map[*strand_list.begin()] = *strand_list.begin();
-				strand_map[*strand_list.rbegin()] = *strand_list.rbegin();
-				break;
-			case OPPOSITE_STRAND:
-				strand_map[*strand_list.begin()] = *strand_list.rbegin();
-				strand_map[*strand_list.rbegin()] = *strand_list.begin();
-				break;
-			case SENSE_SPLIT:
-				antisense_file_name = data_output_file_name + "_antisense";
-				nonsense_file_name = data_output_file_name + "_antisense";
-				outfile2.open(antisense_file_name.c_str());
-				if(outfile2.fail()) {
-					cout << "Error: Could not create output file \"" <<
-					  	antisense_file_name << "\"\n";
-
-					return(1);
-				}
-
-				data_output_file_name += "_sense";
-				break;
-		}
+	if(sorted && batch) {
+		cout << "Error: --sorted streams the DB once and cannot be combined with"
+			<< " --batch\n";
+		usage();
+		return(1);
 	}
 
-	outfile.open(data_output_file_name.c_str());
-	if(outfile.fail()) {
-		cout << "Error: Could not create output file \"" << data_output_file_name
-		  	<< "\"\n";
-
+	if(max_mem && (sorted || batch || !index_name.empty()
+		|| !build_index_name.empty())
+	) {
+		cout << "Error: --max-mem caches the DB a chromosome group at a time and"
+			<< " cannot be combined with --sorted, --batch or an index\n";
+		usage();
 		return(1);
 	}
 
-	//write out a header
-	switch(option) {
-		case IGNORE_STRAND:
-			outfile << "db.desc1\tdb.desc2\tdb.chr\tdb.start\tdb.end"
-				<< "\tq.desc1\tq.hits\tq.chr\tq.start\tq.end\tmatch\n";
+	smp.detail_order.mem = smp.total_order.mem = (size_t)sort_mem << 20;
 
-			break;
-		case SAME_STRAND:
-		case OPPOSITE_STRAND:
-		case SENSE:
-			outfile << "db.desc1\tdb.desc2\tdb.chr\tdb.start\tdb.end\tdb.strand"
-				<< "\tq.desc1\tq.hits\tq.chr\tq.start\tq.end\tq.strand\tmatch\n";
-			break;
-		case SENSE_SPLIT:
-			outfile << "db.desc1\tdb.desc2\tdb.chr\tdb.start\tdb.end\tdb.strand"
-				<< "\tq.desc1\tq.hits\tq.chr\tq.start\tq.end\tq.strand\tmatch\n";
-			outfile2 << "db.desc1\tdb.desc2\tdb.chr\tdb.start\tdb.end\tdb.strand"
-				<< "\tq.desc1\tq.hits\tq.chr\tq.start\tq.end\tq.strand\tmatch\n";
-			break;
-	}
+	int arg_count = argc-optind;
+	if(arg_count == 0) {
+		cout << "Error: DB file name must be specified\n";
+		usage();
+		return(1);
+	}else if(!build_index_name.empty()) {
+		//only the DB is needed to build an index
+		db_file_name = args[optind];
+		if(!db_in.open(db_file_name.c_str(), threads)) {
+			cout << "Error: Could not open DB file \"" << db_file_name << "\"\n";
+			return(1);
+		}
+		cache_db(db_in, option);
+		if(db_in.bad()) {
+			cout << "Error: Could not read DB file \"" << db_file_name << "\"\n";
+			return(1);
+		}
+		stats.phase("db_load");
+		int ret = write_index(build_index_name, db_file_name, cache_type(option));
+		stats.phase("index_write");
+		stats.write(cerr);
+		return(ret);
+	}else if(batch) {
+		//the DB is followed by the query files, the manifest adds more
+		vector<pair<string, string> > jobs;
+		db_file_name = args[optind];
+		for(int i = optind + 1; i < argc; i++) {
+			jobs.push_back(pair<string, string>(args[i], sample_name(args[i])));
+		}
+		if(!manifest_name.empty() && read_manifest(manifest_name, jobs))
+			return(1);
+		if(jobs.empty()) {
+			cout << "Error: query file names must be specified\n";
+			usage();
+			return(1);
+		}
 
-	getline(query_file, line);
-	while(!query_file.eof()) {
-		switch(option) {
-			case IGNORE_STRAND:
-				query_ignore_strand(reinterpret_cast<void*>(&line));
-				break;
-			case SAME_STRAND:
-			case OPPOSITE_STRAND:
-				query_split(reinterpret_cast<void*>(&line));
-				break;
-			case SENSE:
-				query_sf(reinterpret_cast<void*>(&line));
-				break;
-			case SENSE_SPLIT:
-				query_ss(reinterpret_cast<void*>(&line));
-				break;
+		bool indexed = !index_name.empty() &&
+			read_index(index_name, db_file_name, cache_type(option));
+		if(!indexed) {
+			if(!db_in.open(db_file_name.c_str(), threads)) {
+				cout << "Error: Could not open DB file \"" << db_file_name << "\"\n";
+				return(1);
+			}
+			cache_db(db_in, option);
+			if(db_in.bad()) {
+				cout << "Error: Could not read DB file \"" << db_file_name << "\"\n";
+				return(1);
+			}
 		}
-		getline(query_file, line);
+		if(check_strands(option))
+			return(1);
+		stats.phase("db_load");
+		//the samples run at once, so matching and output are one phase
+		int ret = run_batch(jobs, batch_prefix, option, threads, no_zeros, smp);
+		stats.phase("batch");
+		stats.write(cerr);
+		return(ret);
+	}else if(arg_count == 1) {
+		cout << "Error: query file name must be specified\n";
+		usage();
+		return(1);
+	}else if(arg_count == 2) {
+		cout << "Error: output file name must be specified\n";
+		usage();
+		return(1);
 	}
 
-	string base_file_name;
-	base_file_name = data_output_file_name + "_total";
-	totalfile.open(base_file_name.c_str());
-	if(totalfile.fail()) {
-		cout << "Error: Could not create output file \"" << base_file_name <<
-			"\"\n";
+	db_file_name = args[optind];
+	smp.query_file_name = args[optind + 1];
+	set_output_name(smp, args[optind + 2]);
+	//a single -s bs run has always written its antisense totals to "_total"
+	smp.antisense_total_name = "_total";
+	share_sort_mem(smp, option, 1, threads);
 
+	//--sorted and --max-mem go back over parts of the files, the other modes
+	//read them front to back
+	bool indexed = !index_name.empty() &&
+		read_index(index_name, db_file_name, cache_type(option));
+	if(!indexed && !(sorted || max_mem
+		? db_file.open(db_file_name.c_str(), threads)
+		: db_in.open(db_file_name.c_str(), threads))
+	) {
+		cout << "Error: Could not open DB file \"" << db_file_name << "\"\n";
 		return(1);
 	}
 
-	totalfile << "db_file.desc1\tdb_file.desc2\thits\n";
-	for(map<string, long>::iterator table_iter = table.begin();
-	  	table_iter != table.end();
-		table_iter++
+	if(!(max_mem ? query_file.open(smp.query_file_name.c_str(), threads)
+		: query_in.open(smp.query_file_name.c_str(), threads))
 	) {
-		totalfile << table_iter->first << '\t' << table_iter->second << endl;
+		cout << "Error: Could not open query file \"" << smp.query_file_name
+			<< "\"\n";
+		return(1);
 	}
 
-
-
-	if(option == SENSE_SPLIT) {
-		base_file_name = total_output_file_name + "_total";
-		totalfile2.open(base_file_name.c_str());
-		if(totalfile2.fail()) {
-			cout << "Error: Could not create output file \"" << base_file_name <<
-				"\"\n";
-
+	vector<line_runs> db_runs;
+	if(sorted) {
+		if(index_sorted_db(db_file, option))
+			return(1);
+		if(!no_zeros)
+			zero_spill = temp_file();
+	}else if(max_mem) {
+		index_db_runs(db_file, option, db_runs);
+	}else if(!indexed) {
+		cache_db(db_in, option);
+		if(db_in.bad()) {
+			cout << "Error: Could not read DB file \"" << db_file_name << "\"\n";
 			return(1);
-		}
-		totalfile2 << "db_file.desc1\tdb_file.desc2\thits";
-		for(map<string, long>::iterator table_iter = table2.begin();
-			table_iter != table2.end();
-			table_iter++
-		) {
-			totalfile2 << table_iter->first << '\t' << table_iter->second << endl;
 		}
 	}
+	//sorted mode only finds the blocks here, the DB is read while matching,
+	//--max-mem caches it while matching
+	stats.phase(sorted || max_mem ? "db_index" : "db_load");
+	if(!sorted && !max_mem && query_slots(threads) > 1)
+		counter_slots(query_slots(threads));
 
-	if(no_zeros == 0){
-		switch(option) {
-			case IGNORE_STRAND:
-				add_zeros_ignore_strand();
-				break;
-			case SAME_STRAND:
-			case OPPOSITE_STRAND:
-			case SENSE:
-				add_zeros_strand();
-				break;
-			case SENSE_SPLIT:
-				add_zeros_sense();
-				break;
-		}
-	}
+	if(check_strands(option) || open_outputs(smp, option))
+		return(1);
 
-	if(option == SENSE_SPLIT) {
-		totalfile2.close();
-		outfile2.close();
+	if(sorted) {
+		ctx.smp = &smp;
+		ctx.match = select_kernel(smp, option);
+		if(query_sorted(query_in, option, ctx))
+			return(1);
+	}else if(max_mem) {
+		if(query_by_chr(db_file, query_file, db_runs, option, threads, no_zeros,
+			(size_t)max_mem, smp)
+		)
+			return(1);
+	}else {
+		run_queries(smp, query_in, option, threads);
+	}
+	if(query_in.bad()) {
+		cout << "Error: Could not read query file \"" << smp.query_file_name
+			<< "\"\n";
+		return(1);
 	}
-	totalfile.close();
 	query_file.close();
-	outfile.close();
-	return(0);
+	query_in.close();
+	stats.phase("match");
+
+	int ret = write_results(smp, option, no_zeros, sorted || max_mem);
+	stats.phase("output");
+	stats.write(cerr);
+	return(ret);
 }
@@ -8,6 +8,7 @@ use File::Basename;
 my $usage = join("\n",
 	"perl deduplicate.pl args <cpp_result_total_file> <output directory>",
 	"choose the highest value of duplicate gene symbols",
+	"(cppmatch --dedup writes the same files while it matches)",
 	"ARGS:",
 	"    -b process both cpp_result and cpp_result_total",
 	"    -l <num> limit the output to num genes"
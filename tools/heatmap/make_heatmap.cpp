@@ -13,6 +13,14 @@
 #include <cstring>
 #include <cstdlib>
 #include <cmath>
+#include <cstdio>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #ifndef SINGLE
 #include <pthread.h>
@@ -26,6 +34,110 @@ struct chr_entry {								//stores features in gene list file, bin start and end
 	vector<long> bins_start;
 	vector<long> bins_end;
 	vector<vector<pair<long,long> > > bins;
+	vector<size_t> slot;						//row of each feature in the bin matrices
+	vector<size_t> idxrow;						//implicit interval tree over the overall bin ranges, positions are sorted by bin start and idxrow maps one back to its feature
+	vector<long> idxstart,idxend,idxmax;		//overall bin start and end at each position, largest end in the subtree rooted at it
+	int idxroot;
+	chr_entry() : idxroot(-1) { }
+	void swap(chr_entry &other) {				//exchange features without copying them
+		id.swap(other.id);
+		bins_start.swap(other.bins_start);
+		bins_end.swap(other.bins_end);
+		bins.swap(other.bins);
+		slot.swap(other.slot);
+		idxrow.swap(other.idxrow);
+		idxstart.swap(other.idxstart);
+		idxend.swap(other.idxend);
+		idxmax.swap(other.idxmax);
+		int root=idxroot;
+		idxroot=other.idxroot;
+		other.idxroot=root;
+	}
+	void build_index(void) {					//build the tree once all features of the chromosome are read, as cppmatch does for DB entries
+		size_t n=bins_start.size();
+		vector<pair<long,size_t> > order(n);
+		for(size_t i=0;i<n;i++) {
+			order[i]=pair<long,size_t>(bins_start[i],i);
+		}
+		sort(order.begin(),order.end());
+		idxrow.resize(n);
+		idxstart.resize(n);
+		idxend.resize(n);
+		idxmax.resize(n);
+		for(size_t i=0;i<n;i++) {
+			idxrow[i]=order[i].second;
+			idxstart[i]=order[i].first;
+			idxend[i]=bins_end[order[i].second];
+		}
+		idxroot=-1;
+		if(n==0) return;
+		size_t last_i=0;						//leaves sit at even positions, a node at level k has k trailing ones, last tracks the max end of the rightmost, possibly incomplete, subtree
+		long last=0;
+		for(size_t i=0;i<n;i+=2) {
+			last_i=i;
+			last=idxmax[i]=idxend[i];
+		}
+		int k;
+		for(k=1;((size_t)1<<k)<=n;k++) {
+			size_t x=(size_t)1<<(k-1);
+			for(size_t i=(x<<1)-1;i<n;i+=x<<2) {
+				long e=idxend[i];
+				long el=idxmax[i-x];
+				long er=(i+x<n) ? idxmax[i+x] : last;
+				if(el>e) e=el;
+				if(er>e) e=er;
+				idxmax[i]=e;
+			}
+			last_i=((last_i>>k)&1) ? last_i-x : last_i+x;
+			if(last_i<n && idxmax[last_i]>last) last=idxmax[last_i];
+		}
+		idxroot=k-1;
+	}
+	size_t stab(long loc,vector<size_t> &rows) {		//features whose overall bin range holds loc, in no particular order, returns the number of ranges tested
+		struct node {
+			int k;
+			size_t x;
+			int w;
+		} stack[64];
+		size_t n=idxstart.size(),tested=0;
+		int t=0;
+		rows.clear();
+		if(idxroot<0) return(0);
+		stack[t].k=idxroot;
+		stack[t].x=((size_t)1<<idxroot)-1;
+		stack[t++].w=0;
+		while(t) {
+			node z=stack[--t];
+			if(z.k<=3) {																		//small subtree, scan it in start order
+				size_t i0=z.x>>z.k<<z.k;
+				size_t i1=i0+((size_t)1<<(z.k+1))-1;
+				if(i1>n) i1=n;
+				for(size_t i=i0;i<i1 && idxstart[i]<=loc;i++) {
+					tested++;
+					if(idxend[i]>=loc) rows.push_back(idxrow[i]);
+				}
+			}
+			else if(z.w==0) {																	//revisit the node once its left subtree is done, which is only entered if a range there can reach loc
+				size_t y=z.x-((size_t)1<<(z.k-1));
+				stack[t].k=z.k;
+				stack[t].x=z.x;
+				stack[t++].w=1;
+				if(y>=n || idxmax[y]>=loc) {
+					stack[t].k=z.k-1;
+					stack[t].x=y;
+					stack[t++].w=0;
+				}
+			}
+			else if(z.x<n && idxstart[z.x]<=loc) {
+				tested++;
+				if(idxend[z.x]>=loc) rows.push_back(idxrow[z.x]);
+				stack[t].k=z.k-1;
+				stack[t].x=z.x+((size_t)1<<(z.k-1));
+				stack[t++].w=0;
+			}
+		}
+		return(tested);
+	}
 };
 
 struct ptr_entry {								//stores pointers to single feature in gene list file
@@ -33,23 +145,126 @@ struct ptr_entry {								//stores pointers to single feature in gene list file
 	long *bins_start;
 	long *bins_end;
 	vector<pair<long,long> > *bins;
+	size_t *slot;
 };
 
-struct totals_info {							//stores counts intersecting each bin for a given feature from the gene list file
+struct gene_info {								//stores the output columns of a feature from the gene list file, its bins are the row of the bin matrices given by its slot
 	string desc;
 	string chr;
 	long start;
 	long end;
 	string strand;
+};
+
+struct thread_stats {							//--stats counters of one query thread
+	long lines,bad,candidates,matches;			//hit lines read and skipped, features whose bin range was tested and bin intersections
+	double chunk_wait;							//seconds blocked waiting for a chunk of a compressed hit file
+	thread_stats() : lines(0),bad(0),candidates(0),matches(0),chunk_wait(0) { }
+	void add(const thread_stats &o) {
+		lines+=o.lines;
+		bad+=o.bad;
+		candidates+=o.candidates;
+		matches+=o.matches;
+		chunk_wait+=o.chunk_wait;
+	}
+};
+
+struct bin_sums {								//bin totals and intersection counts of every feature added up by one query thread, merged into the bin matrices once all threads are done
 	vector<double> total;
 	vector<long> count;
-	vector<long> length;
+};
+
+struct hit_chunk {								//whole lines of a hit file a thread is working through, kept per thread so reading takes no lock
+	const char *p,*end;
+	size_t source;								//hit file the lines come from
+	size_t turn,stride,taken;					//the thread takes chunks turn, turn+stride, ... of each hit file, so which lines each thread adds up is the same every run
+	vector<char> buf;							//inflated lines of a compressed file
+	hit_chunk(size_t t,size_t n) : p(NULL),end(NULL),source(0),turn(t),stride(n),taken(0) { }
 };
 
 struct hit_entry {								//stores information about single lines in hit file
 	string chr,strand;
 	long location;
 	double value;
+	thread_stats *stats;						//counters of the thread reading the line
+	hit_chunk *chunk;							//lines of the hit file the thread has taken
+};
+
+inline double wall_time(void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return(tv.tv_sec+tv.tv_usec/1e6);
+}
+
+#ifndef SINGLE
+inline void timed_lock(pthread_mutex_t *lock,double &wait) {			//lock, adding any time spent blocked behind another thread to wait
+	if(pthread_mutex_trylock(lock)==0) return;
+	double start=wall_time();
+	pthread_mutex_lock(lock);
+	wait+=wall_time()-start;
+}
+#endif
+
+class run_stats {								//--stats, wall and cpu seconds per phase, cpu is that of the whole process so it covers every thread
+	vector<string> names;
+	vector<double> wall,cpu;
+	double last_wall,last_cpu;
+	static double cpu_time(void) {
+		struct rusage ru;
+		getrusage(RUSAGE_SELF,&ru);
+		return(ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6);
+	}
+public:
+	run_stats() {
+		last_wall=wall_time();
+		last_cpu=cpu_time();
+	}
+	void phase(const char *name) {				//end the phase running since the last one ended
+		double w=wall_time(),c=cpu_time();
+		names.push_back(name);
+		wall.push_back(w-last_wall);
+		cpu.push_back(c-last_cpu);
+		last_wall=w;
+		last_cpu=c;
+	}
+	void write(ostream &out,bool json,vector<thread_stats> &ts) {		//one "name\tvalue" line per figure or a single JSON object, thread figures are summed and also given per thread
+		struct rusage ru;
+		getrusage(RUSAGE_SELF,&ru);
+#ifdef __APPLE__
+		long rss_kb=ru.ru_maxrss/1024;
+#else
+		long rss_kb=ru.ru_maxrss;
+#endif
+		thread_stats sum;
+		for(size_t i=0;i<ts.size();i++) sum.add(ts[i]);
+		char buf[128];
+		if(json) {
+			out << "{\"program\":\"make_heatmap\",\"phases\":[";
+			for(size_t i=0;i<names.size();i++) {
+				snprintf(buf,sizeof(buf),"\"wall\":%.6f,\"cpu\":%.6f",wall[i],cpu[i]);
+				out << (i ? "," : "") << "{\"name\":\"" << names[i] << "\"," << buf << "}";
+			}
+			out << "],\"counters\":{\"hit_lines\":" << sum.lines << ",\"hit_bad_lines\":" << sum.bad << ",\"candidates\":" << sum.candidates << ",\"matches\":" << sum.matches << "},\"threads\":[";
+			for(size_t i=0;i<ts.size();i++) {
+				snprintf(buf,sizeof(buf),"{\"lines\":%ld,\"chunk_wait\":%.6f}",ts[i].lines,ts[i].chunk_wait);
+				out << (i ? "," : "") << buf;
+			}
+			out << "],\"peak_rss_kb\":" << rss_kb << "}\n";
+		}
+		else {
+			for(size_t i=0;i<names.size();i++) {
+				snprintf(buf,sizeof(buf),"\t%.6f\t%.6f",wall[i],cpu[i]);
+				out << "phase\t" << names[i] << buf << "\n";
+			}
+			out << "hit_lines\t" << sum.lines << "\nhit_bad_lines\t" << sum.bad << "\ncandidates\t" << sum.candidates << "\nmatches\t" << sum.matches << "\n";
+			for(size_t i=0;i<ts.size();i++) {
+				snprintf(buf,sizeof(buf),"thread\t%lu\t%ld\t%.6f\n",(unsigned long)i,ts[i].lines,ts[i].chunk_wait);
+				out << buf;
+			}
+			out << "peak_rss_kb\t" << rss_kb << "\n";
+		}
+		out.flush();
+	}
 };
 
 class opt_parser {
@@ -108,10 +323,25 @@ public:
 				"                                  with data that lacks strand information\n"
 				"  --nostrand                  indicates no strand specific methods are to be\n"
 				"                              used, applies -s b, -l p, -a p, and -d p\n"
-				"  --nohead                    suppresses printing of header to output file\n";
+				"  --nohead                    suppresses printing of header to output file\n"
+				"  --prefix-sums               hold the hit locations and values in memory, about\n"
+				"                              16 bytes per hit, and sum each bin from cumulative\n"
+				"                              sums over them once all are read, faster for dense\n"
+				"                              hit files against large gene lists, sums of\n"
+				"                              fractional values may differ in the last printed\n"
+				"                              digit\n"
+				"  --stats[=json]              write the wall and cpu seconds of each phase, hit\n"
+				"                              line, candidate and match counts, each thread's\n"
+				"                              lines and seconds blocked on the compressed hit\n"
+				"                              file, and peak memory to stderr, one name and\n"
+				"                              values per line or as JSON\n"
+				"Hit files may be gzip or BGZF compressed, BGZF files are inflated using the\n"
+				"threads given with -t\n";
 		return;
 	}
 	int s,t,b,h,l,a,v,d,o;
+	int stats;																//--stats, 0 off, 1 text, 2 JSON
+	int prefix;																//--prefix-sums
 	char *plushits,*minushits,*hits,*genelist,*output,*binfile;
 	long start,size,count;
 	opt_parser(int argc,char **args) {
@@ -129,7 +359,10 @@ public:
 				{"minus",1,NULL,'m'},
 				{"binloc",1,NULL,'d'},
 				{"nostrand",0,NULL,'n'},
-				{"nohead",0,NULL,'o'}
+				{"nohead",0,NULL,'o'},
+				{"stats",2,NULL,'x'},
+				{"prefix-sums",0,NULL,'r'},
+				{NULL,0,NULL,0}
 		};
 		s=1;
 		t=1;
@@ -140,6 +373,8 @@ public:
 		v=0;
 		d=0;
 		o=0;
+		stats=0;
+		prefix=0;
 		plushits=NULL;
 		minushits=NULL;
 		hits=NULL;
@@ -303,6 +538,17 @@ public:
 			case 'o':
 				o=1;
 				break;
+			case 'x':
+				if(optarg!=NULL && strcmp(optarg,"json")!=0) {
+					cout << "Error: \"" << optarg << "\" is not a supported argument for the \"--stats\" option\n";
+					usage();
+					exit(1);
+				}
+				stats=(optarg==NULL) ? 1 : 2;
+				break;
+			case 'r':
+				prefix=1;
+				break;
 			case '?':
 				usage();
 				exit(1);
@@ -574,14 +820,78 @@ class data {																							//inherited by genelist_parser and hit_parser
 protected:
 	static unordered_map<string,chr_entry> db;
 	static unordered_map<string,unordered_map<string,chr_entry> > db_split;
-	static map<string,totals_info> table;
-	static unordered_map<string,string> strand_map;
+	static map<string,size_t> table;																//feature id to slot, orders the output
+	static vector<gene_info> genes;																	//features by slot
+	static size_t bin_count;																		//bins per feature, the width of the bin matrices
+	static vector<double> totals;																	//genes x bins matrices, row slot holds a feature's bin totals, intersection counts and bin lengths
+	static vector<long> counts;
+	static vector<long> lengths;
+	static size_t add_gene(const string &id,const string &desc,const string &chr,long start,long end,const string &strand,const vector<pair<long,long> > &bins) {		//give a feature the next slot and its row of the bin matrices
+		size_t slot=genes.size();
+		gene_info g={desc,chr,start,end,strand};
+		genes.push_back(g);
+		table[id]=slot;
+		for(size_t i=0;i<bin_count;i++) {
+			lengths.push_back(bins[i].second-bins[i].first+1);										//determine all bin lengths for density calculations
+		}
+		return(slot);
+	}
+	static unordered_map<string,int> chr_ids;														//chromosome name to index into the flat tables below
+	static vector<chr_entry> chr_db;																//features per chromosome index, strand-independent matching
+	static vector<chr_entry> chr_db_split[2];														//features per chromosome index of plus (0) and minus (1) strand features
+	static void index_chromosomes(void) {															//once the gene list is read, move features into the flat tables so hits are matched without hashing
+		const char *strands[2]={"plus","minus"};
+		for(unordered_map<string,chr_entry>::iterator i=db.begin();i!=db.end();i++) {
+			chr_db[add_chr(i->first)].swap(i->second);
+		}
+		for(int str=0;str<2;str++) {
+			if(db_split.find(strands[str])==db_split.end()) continue;
+			unordered_map<string,chr_entry> &split=db_split[strands[str]];
+			for(unordered_map<string,chr_entry>::iterator i=split.begin();i!=split.end();i++) {
+				chr_db_split[str][add_chr(i->first)].swap(i->second);
+			}
+		}
+		db.clear();
+		db_split.clear();
+		for(size_t c=0;c<chr_db.size();c++) {
+			chr_db[c].build_index();
+			chr_db_split[0][c].build_index();
+			chr_db_split[1][c].build_index();
+		}
+		totals.assign(genes.size()*bin_count,0);													//initialize total and count of intersections to 0
+		counts.assign(genes.size()*bin_count,0);
+	}
+	static int add_chr(const string &chr) {
+		unordered_map<string,int>::iterator c=chr_ids.find(chr);
+		if(c!=chr_ids.end()) return(c->second);
+		int id=chr_ids.size();
+		chr_ids[chr]=id;
+		chr_db.push_back(chr_entry());
+		chr_db_split[0].push_back(chr_entry());
+		chr_db_split[1].push_back(chr_entry());
+		return(id);
+	}
+	static int chr_index(const string &chr,string &last_chr,int &last_id) {							//index of a hit's chromosome, -1 if no feature is on it, a run of hits on one chromosome is resolved without hashing
+		if(chr!=last_chr) {
+			unordered_map<string,int>::const_iterator c=chr_ids.find(chr);
+			last_id=(c==chr_ids.end()) ? -1 : c->second;
+			last_chr=chr;
+		}
+		return(last_id);
+	}
 };
 
 unordered_map<string,chr_entry> data::db;
 unordered_map<string,unordered_map<string,chr_entry> > data::db_split;
-map<string,totals_info> data::table;
-unordered_map<string,string> data::strand_map;
+map<string,size_t> data::table;
+vector<gene_info> data::genes;
+size_t data::bin_count;
+vector<double> data::totals;
+vector<long> data::counts;
+vector<long> data::lengths;
+unordered_map<string,int> data::chr_ids;
+vector<chr_entry> data::chr_db;
+vector<chr_entry> data::chr_db_split[2];
 
 class genelist_parser : public data {																//reads all lines from gene list file, generates specific bin start/end locations per feature
 	ofstream outfile;
@@ -606,6 +916,7 @@ public:
 			cout << "Error: could not create output file \"" << op.output << "\"\n";
 			exit(1);
 		}
+		bin_count=bp.bins.size();
 		if(op.s==0) {																												//for strand-independent matching
 			if(op.d==0 || op.a<2) {																									//if bin distance or anchor utilize strand information
 				getline(genelist,line);
@@ -615,7 +926,7 @@ public:
 					if(temp1.fail()) {																								//skip lines with bad formatting or duplicate id's
 						cout << "Gene list file contains bad line, skipping: " << line << endl;
 					}
-					else if(db.find(id)!=db.end()) {
+					else if(table.find(id)!=table.end()) {
 						cout << "Gene list file contains duplicate unique identifier, skipping: " << line << endl;
 					}
 					else {
@@ -773,16 +1084,7 @@ public:
 						}
 						db[chr].bins_start.push_back(db[chr].bins.back().front().first);									//store overall bin start and end locations for easy access
 						db[chr].bins_end.push_back(db[chr].bins.back().back().second);
-						table[id].chr=chr;																					//create entry for feature in output table
-						table[id].desc=desc;
-						table[id].start=physical_start;
-						table[id].end=physical_end;
-						table[id].strand=strand;
-						for(size_t i=0;i<bp.bins.size();i++) {																//initialize total and count of intersections to 0
-							table[id].total.push_back(0);
-							table[id].count.push_back(0);
-							table[id].length.push_back(db[chr].bins.back()[i].second-db[chr].bins.back()[i].first+1);		//determine all bin lengths for density calculations
-						}
+						db[chr].slot.push_back(add_gene(id,desc,chr,physical_start,physical_end,strand,db[chr].bins.back()));	//create entry for feature in output table
 					}
 					getline(genelist,line);
 				}
@@ -795,7 +1097,7 @@ public:
 					if(temp1.fail()) {
 						cout << "Gene list file contains bad line, skipping: " << line << endl;
 					}
-					else if(db.find(id)!=db.end()) {
+					else if(table.find(id)!=table.end()) {
 						cout << "Gene list file contains duplicate unique identifier, skipping: " << line << endl;
 					}
 					else {
@@ -853,19 +1155,12 @@ public:
 						}
 						db[chr].bins_start.push_back(db[chr].bins.back().front().first);
 						db[chr].bins_end.push_back(db[chr].bins.back().back().second);
-						table[id].chr=chr;
-						table[id].desc=desc;
-						table[id].start=physical_start;
-						table[id].end=physical_end;
-						temp1 >> table[id].strand;
-						if(table[id].strand.empty()) {
-							table[id].strand="NA";
-						}
-						for(size_t i=0;i<bp.bins.size();i++) {
-							table[id].total.push_back(0);
-							table[id].count.push_back(0);
-							table[id].length.push_back(db[chr].bins.back()[i].second-db[chr].bins.back()[i].first+1);
+						strand.clear();
+						temp1 >> strand;
+						if(strand.empty()) {
+							strand="NA";
 						}
+						db[chr].slot.push_back(add_gene(id,desc,chr,physical_start,physical_end,strand,db[chr].bins.back()));
 					}
 					getline(genelist,line);
 				}
@@ -879,7 +1174,7 @@ public:
 				if(temp1.fail()) {
 					cout << "Gene list file contains bad line, skipping: " << line << endl;
 				}
-				else if(db_split.find(id)!=db_split.end()) {
+				else if(table.find(id)!=table.end()) {
 					cout << "Gene list file contains duplicate unique identifier, skipping: " << line << endl;
 				}
 				else {
@@ -1037,29 +1332,13 @@ public:
 					}
 					db_split[strand][chr].bins_start.push_back(db_split[strand][chr].bins.back().front().first);
 					db_split[strand][chr].bins_end.push_back(db_split[strand][chr].bins.back().back().second);
-					table[id].chr=chr;
-					table[id].desc=desc;
-					table[id].start=physical_start;
-					table[id].end=physical_end;
-					table[id].strand=strand;
-					for(size_t i=0;i<bp.bins.size();i++) {
-						table[id].total.push_back(0);
-						table[id].count.push_back(0);
-						table[id].length.push_back(db_split[strand][chr].bins.back()[i].second-db_split[strand][chr].bins.back()[i].first+1);
-					}
+					db_split[strand][chr].slot.push_back(add_gene(id,desc,chr,physical_start,physical_end,strand,db_split[strand][chr].bins.back()));
 				}
 				getline(genelist,line);
 			}
-			if(op.s==1) {											//lookup table to determine strand of features to check for intersections, given strand of hit file entry
-				strand_map["plus"]="plus";							//for same strand matching
-				strand_map["minus"]="minus";
-			}
-			else {													//for opposite strand
-				strand_map["plus"]="minus";
-				strand_map["minus"]="plus";
-			}
 		}
 		genelist.close();
+		index_chromosomes();
 	}
 	void print_header(opt_parser &op,bin_parser &bp) {				//write options specified to output file
 		if(op.o==0) {
@@ -1173,209 +1452,404 @@ public:
 		outfile << "\n";
 		return;
 	}
-	void print_results(opt_parser &op) {																																	//write per-bin counts to output file
-		if(op.v==0) {
-			for(map<string,totals_info>::iterator i=table.begin();i!=table.end();i++) {
-				outfile << i->first << '\t' << i->second.desc << '\t' << i->second.chr << '\t' << i->second.start << '\t' << i->second.end << '\t' << i->second.strand;
-				if(op.d==0 && i->second.strand=="minus") {																													//for genetic bin distance, print bins of minus strand features in reverse order
-					for(vector<double>::reverse_iterator j=i->second.total.rbegin();j<i->second.total.rend();j++) {
-						outfile << '\t' << *j;
-					}
-				}
-				else {
-					for(vector<double>::iterator j=i->second.total.begin();j!=i->second.total.end();j++) {
-						outfile << '\t' << *j;
-					}
-				}
-				outfile << '\n';
-			}
-		}
-		else if(op.v==1) {																																					//if bin average is requested, divide total by number of hit file entries intersecting bin
-			double average;
-			for(map<string,totals_info>::iterator i=table.begin();i!=table.end();i++) {
-				if(op.d==0 && i->second.strand=="minus") {
-					vector<double>::reverse_iterator j=i->second.total.rbegin();
-					vector<long>::reverse_iterator k=i->second.count.rbegin();
-					outfile << i->first << '\t' << i->second.desc << '\t' << i->second.chr << '\t' << i->second.start << '\t' << i->second.end << '\t' << i->second.strand;
-					for(;j<i->second.total.rend();j++) {
-						if(*k!=0) {
-							average=(*j)/(*k);
-						}
-						else {
-							average=0;
-						}
-						outfile << '\t' << average;
-						k++;
-					}
-				}
-				else {
-					vector<double>::iterator j=i->second.total.begin();
-					vector<long>::iterator k=i->second.count.begin();
-					outfile << i->first << '\t' << i->second.desc << '\t' << i->second.chr << '\t' << i->second.start << '\t' << i->second.end << '\t' << i->second.strand;
-					for(;j!=i->second.total.end();j++) {
-						if(*k!=0) {
-							average=(*j)/(*k);
-						}
-						else {
-							average=0;
-						}
-						outfile << '\t' << average;
-						k++;
-					}
+	void print_results(opt_parser &op) {																																	//write per-bin counts to output file in feature id order
+		for(map<string,size_t>::iterator i=table.begin();i!=table.end();i++) {
+			gene_info &g=genes[i->second];
+			size_t row=i->second*bin_count;
+			bool reverse=(op.d==0 && g.strand=="minus");																													//for genetic bin distance, print bins of minus strand features in reverse order
+			outfile << i->first << '\t' << g.desc << '\t' << g.chr << '\t' << g.start << '\t' << g.end << '\t' << g.strand;
+			for(size_t b=0;b<bin_count;b++) {
+				size_t k=row+(reverse ? bin_count-1-b : b);
+				double value=totals[k];
+				if(op.v==1) {																																				//if bin average is requested, divide total by number of hit file entries intersecting bin
+					value=(counts[k]!=0) ? totals[k]/counts[k] : 0;
 				}
-				outfile << '\n';
-			}
-		}
-		else {																																								//if bin density is requested, divide total by bin size
-			double density;
-			for(map<string,totals_info>::iterator i=table.begin();i!=table.end();i++) {
-				if(op.d==0 && i->second.strand=="minus") {
-					vector<double>::reverse_iterator j=i->second.total.rbegin();
-					vector<long>::reverse_iterator k=i->second.length.rbegin();
-					outfile << i->first << '\t' << i->second.desc << '\t' << i->second.chr << '\t' << i->second.start << '\t' << i->second.end << '\t' << i->second.strand;
-					for(;j<i->second.total.rend();j++) {
-						if(*k!=0) {
-							density=(*j)/(*k);
-						}
-						else {
-							density=0;
-						}
-						outfile << '\t' << density;
-						k++;
-					}
-				}
-				else {
-					vector<double>::iterator j=i->second.total.begin();
-					vector<long>::iterator k=i->second.length.begin();
-					outfile << i->first << '\t' << i->second.desc << '\t' << i->second.chr << '\t' << i->second.start << '\t' << i->second.end << '\t' << i->second.strand;
-					for(;j!=i->second.total.end();j++) {
-						if(*k!=0) {
-							density=(*j)/(*k);
-						}
-						else {
-							density=0;
-						}
-						outfile << '\t' << density;
-						k++;
-					}
+				else if(op.v==2) {																																			//if bin density is requested, divide total by bin size
+					value=(lengths[k]!=0) ? totals[k]/lengths[k] : 0;
 				}
-				outfile << '\n';
+				outfile << '\t' << value;
 			}
+			outfile << '\n';
 		}
 		outfile.close();
 		return;
 	}
 };
 
-class file_reader {																			//opens hit file for reading
-protected:
-	ifstream one;
-	string strand;
+const size_t BGZF_MAX_BLOCK=65536;
+
+inline size_t read_le16(const unsigned char *p) {
+	return(p[0] | (p[1]<<8));
+}
+
+inline size_t read_le32(const unsigned char *p) {
+	return(p[0] | (p[1]<<8) | (p[2]<<16) | ((size_t)p[3]<<24));
+}
+
+size_t bgzf_block_size(const unsigned char *p,size_t avail) {					//size of the BGZF block starting at p, 0 if there is not a whole one
+	if(avail<18 || p[0]!=31 || p[1]!=139 || p[2]!=8 || !(p[3]&4)) return(0);
+	size_t xend=12+read_le16(p+10);
+	if(xend>avail) return(0);
+	for(size_t x=12;x+4<=xend;x+=4+read_le16(p+x+2)) {
+		if(p[x]=='B' && p[x+1]=='C' && read_le16(p+x+2)==2 && x+6<=xend) {
+			size_t size=read_le16(p+x+4)+1;
+			return(size>=xend+8 && size<=avail ? size : 0);
+		}
+	}
+	return(0);
+}
+
+struct bgzf_block {								//one block of a BGZF file and the slot its inflated data goes to
+	const unsigned char *in;
+	size_t in_len;
+	char *out;
+	size_t out_len;
+};
+
+bool bgzf_inflate(const bgzf_block &b) {
+	size_t xend=12+read_le16(b.in+10);
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	if(inflateInit2(&zs,-15)!=Z_OK) return(false);
+	zs.next_in=const_cast<Bytef*>(b.in+xend);
+	zs.avail_in=b.in_len-xend-8;
+	zs.next_out=reinterpret_cast<Bytef*>(b.out);
+	zs.avail_out=b.out_len;
+	int r=inflate(&zs,Z_FINISH);
+	inflateEnd(&zs);
+	if(r!=Z_STREAM_END || zs.avail_out!=0) return(false);
+	return(crc32(crc32(0,NULL,0),reinterpret_cast<Bytef*>(b.out),b.out_len)==read_le32(b.in+b.in_len-8));
+}
+
 #ifndef SINGLE
-	pthread_mutex_t linelock;
+struct inflate_pool {
+	vector<bgzf_block> *blocks;
+	size_t next;
+	int bad;
+};
+
+void *t_inflate(void *arg) {													//inflates blocks until none are left
+	inflate_pool *pool=reinterpret_cast<inflate_pool*>(arg);
+	size_t i;
+	while((i=__sync_fetch_and_add(&pool->next,1))<pool->blocks->size()) {
+		if(!bgzf_inflate((*pool->blocks)[i])) pool->bad=1;
+	}
+	pthread_exit(NULL);
+}
 #endif
-public:
-	file_reader(opt_parser &op) {
+
+class input_buf : public streambuf {											//streambuf for a hit file, plain text is passed through, BGZF blocks are inflated a batch at a time across threads, other gzip files as one stream
+	enum modes {PLAIN,BGZF,STREAM};
+	FILE *file;
+	int threads,mode,eof_in,member_done,zs_open;
+	vector<unsigned char> in;														//data read from the file but not yet used
+	size_t in_pos,in_end;
+	vector<char> out;
+	z_stream zs;
+	void fill() {
+		if(in_pos>0) {
+			memmove(&in[0],&in[in_pos],in_end-in_pos);
+			in_end-=in_pos;
+			in_pos=0;
+		}
+		size_t want=in.size()-in_end;
+		size_t n=fread(&in[in_end],1,want,file);
+		in_end+=n;
+		if(n<want) eof_in=1;
+		return;
+	}
+	void corrupt() {
+		cout << "Error: hit file is not a valid gzip file\n";
+		exit(1);
+	}
+	size_t read_plain() {
+		if(in_pos==in_end) fill();
+		size_t n=in_end-in_pos;
+		out.assign(in.begin()+in_pos,in.begin()+in_end);
+		in_pos=in_end;
+		return(n);
+	}
+	size_t read_blocks() {
+		while(true) {
+			vector<bgzf_block> blocks;
+			size_t total=0,pos=in_pos,len;
+			while(blocks.size()<(size_t)threads*16 && (len=bgzf_block_size(&in[0]+pos,in_end-pos))!=0) {
+				bgzf_block b={&in[0]+pos,len,NULL,read_le32(&in[0]+pos+len-4)};
+				blocks.push_back(b);
+				total+=b.out_len;
+				pos+=len;
+			}
+			if(blocks.empty()) {
+				if(!eof_in && in_end-in_pos<BGZF_MAX_BLOCK) {								//the next block may just be cut off at the end of the buffer
+					fill();
+					continue;
+				}
+				if(in_pos==in_end) return(0);
+				mode=STREAM;															//not BGZF from here on
+				return(read_stream());
+			}
+			out.resize(total+1);
+			for(size_t i=0,at=0;i<blocks.size();at+=blocks[i].out_len,i++) {
+				blocks[i].out=&out[0]+at;
+			}
+			int bad=0;
 #ifndef SINGLE
-		pthread_mutex_init(&linelock,NULL);
+			if(threads>1 && blocks.size()>1) {
+				inflate_pool pool={&blocks,0,0};
+				pthread_t tid[threads];
+				for(int ti=0;ti<threads;ti++) {
+					pthread_create(&tid[ti],NULL,t_inflate,reinterpret_cast<void*>(&pool));
+				}
+				for(int ti=0;ti<threads;ti++) {
+					pthread_join(tid[ti],NULL);
+				}
+				bad=pool.bad;
+			}
+			else
 #endif
-		if(op.hits!=NULL) {
-			one.open(op.hits);
-			if(one.fail()) {
-				cout << "Error: could not open hit file \"" << op.hits << "\"\n";
-				exit(1);
+			for(size_t i=0;i<blocks.size() && !bad;i++) {
+				bad=!bgzf_inflate(blocks[i]);
 			}
+			if(bad) corrupt();
+			in_pos=pos;
+			if(total>0) return(total);												//an empty block marks the end of the file, keep going in case more follow
 		}
-		else if(op.plushits!=NULL) {
-			one.open(op.plushits);
-			if(one.fail()) {
-				cout << "Error: could not open hit file \"" << op.plushits << "\"\n";
-				exit(1);
-			}
-			strand="plus";
+	}
+	size_t read_stream() {
+		if(!zs_open) {
+			memset(&zs,0,sizeof(zs));
+			if(inflateInit2(&zs,15+16)!=Z_OK) corrupt();
+			zs_open=1;
 		}
-		else {
-			one.open(op.minushits);
-			if(one.fail()) {
-				cout << "Error: could not open hit file \"" << op.minushits << "\"\n";
-				exit(1);
+		out.resize(262144);
+		zs.next_out=reinterpret_cast<Bytef*>(&out[0]);
+		zs.avail_out=out.size();
+		while(zs.avail_out==out.size()) {
+			if(in_pos==in_end) {
+				if(eof_in) {
+					if(!member_done) corrupt();
+					return(0);
+				}
+				fill();
+				continue;
+			}
+			zs.next_in=&in[0]+in_pos;
+			zs.avail_in=in_end-in_pos;
+			int r=inflate(&zs,Z_NO_FLUSH);
+			in_pos=in_end-zs.avail_in;
+			if(r==Z_STREAM_END) {														//several gzip members may follow one another
+				inflateReset(&zs);
+				member_done=1;
 			}
-			strand="minus";
+			else if(r==Z_OK) member_done=0;
+			else if(r!=Z_BUF_ERROR) corrupt();
 		}
+		return(out.size()-zs.avail_out);
 	}
-	virtual void read(string &line,string &str,int &ret) {								//for single hit file passed without -p or -m
-#ifndef SINGLE
-		pthread_mutex_lock(&linelock);
-#endif
-		do {
-			getline(one,line);
-		} while(line=="" && one.good());
-		ret=one.good();
-#ifndef SINGLE
-		pthread_mutex_unlock(&linelock);
-#endif
+protected:
+	int underflow() {
+		if(gptr()<egptr()) return(traits_type::to_int_type(*gptr()));
+		if(file==NULL) return(traits_type::eof());
+		size_t n;
+		switch(mode) {
+		case BGZF:
+			n=read_blocks();
+			break;
+		case STREAM:
+			n=read_stream();
+			break;
+		default:
+			n=read_plain();
+			break;
+		}
+		if(n==0) return(traits_type::eof());
+		setg(&out[0],&out[0],&out[0]+n);
+		return(traits_type::to_int_type(*gptr()));
+	}
+public:
+	input_buf() : file(NULL),zs_open(0),in(4194304) { }
+	bool open(const char *name,int t) {
+		close();
+		file=fopen(name,"rb");
+		if(file==NULL) return(false);
+		threads=t;
+		eof_in=0;
+		member_done=1;
+		in_pos=in_end=0;
+		fill();
+		mode=(in_end>=2 && in[0]==31 && in[1]==139) ? BGZF : PLAIN;				//gzip magic bytes, read_blocks falls back to STREAM if this is not BGZF
+		setg(NULL,NULL,NULL);
+		return(true);
+	}
+	void close() {
+		if(file!=NULL) fclose(file);
+		file=NULL;
+		if(zs_open) inflateEnd(&zs);
+		zs_open=0;
 		return;
 	}
-	virtual ~file_reader() {
-		one.close();
+	~input_buf() {
+		close();
 	}
 };
 
-class file_reader_one : public file_reader {											//for single hit file passed with -p or -m
+class input_file : public istream {												//hit file that may be plain text, gzip or BGZF, threads inflate BGZF blocks in parallel
+	input_buf buf;
 public:
-	file_reader_one(opt_parser &op) : file_reader(op) { }
-	void read(string &line,string &str,int &ret) {
-#ifndef SINGLE
-		pthread_mutex_lock(&linelock);
-#endif
-		do {
-			getline(one,line);
-		} while(line=="" && one.good());
-		str=strand;																		//supply strand and return value to calling function
-		ret=one.good();
-#ifndef SINGLE
-		pthread_mutex_unlock(&linelock);
-#endif
+	input_file() : istream(NULL) { }
+	void open(const char *name,int threads=1) {
+		if(buf.open(name,threads)) rdbuf(&buf);
+		else setstate(ios::failbit);
+		return;
+	}
+	void close() {
+		buf.close();
 		return;
 	}
 };
 
-class file_reader_two : public file_reader {											//for two hit files, passed with -p and -m
-	ifstream two;
-	ifstream *current;
+const size_t CHUNK_BYTES=1<<20;													//hit file bytes a thread takes at a time
+
+class hit_source {																	//one hit file, a plain file is mapped and each thread finds its ranges without a lock, a compressed one is inflated a chunk at a time under chunklock, the threads taking turns
+	input_file in;
+	const char *map;
+	size_t size,turns;																//chunks of a compressed file handed out so far
+	int done;
+#ifndef SINGLE
+	pthread_mutex_t chunklock;
+	pthread_cond_t turn_done;
+#endif
+	size_t line_start(size_t at) {													//start of the first line beginning at or after at
+		if(at==0) return(0);
+		if(at>=size) return(size);
+		const char *nl=(const char*)memchr(map+at-1,'\n',size-at+1);
+		return(nl==NULL ? size : nl-map+1);
+	}
 public:
-	file_reader_two(opt_parser &op) : file_reader(op) {
-		two.open(op.minushits);
-		if(two.fail()) {
-			cout << "Error: could not open hit file \"" << op.minushits << "\"\n";
-			exit(1);
+	string strand;
+	hit_source() : map(NULL),size(0),turns(0),done(0) {
+#ifndef SINGLE
+		pthread_mutex_init(&chunklock,NULL);
+		pthread_cond_init(&turn_done,NULL);
+#endif
+	}
+	bool open(const char *name,int threads) {
+		int fd=::open(name,O_RDONLY);
+		if(fd<0) return(false);
+		struct stat st;
+		if(fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+			void *m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+			if(m!=MAP_FAILED) {
+				const unsigned char *u=reinterpret_cast<const unsigned char*>(m);
+				if(st.st_size<2 || u[0]!=31 || u[1]!=139) {								//plain text, gzip files go through input_file
+					madvise(m,st.st_size,MADV_SEQUENTIAL);
+					map=reinterpret_cast<const char*>(m);
+					size=st.st_size;
+					::close(fd);
+					return(true);
+				}
+				munmap(m,st.st_size);
+			}
 		}
-		strand="plus";
-		current=&one;
+		::close(fd);
+		in.open(name,threads);
+		return(!in.fail());
 	}
-	void read(string &line,string &str,int &ret) {
+	bool claim(hit_chunk &c,thread_stats &ts) {										//the thread's next range of whole lines, false once the file is used up, a last line without a newline is left out as reading with getline always did
+		size_t number=c.turn+c.taken*c.stride;
+		if(map!=NULL) {
+			size_t at=number*CHUNK_BYTES;
+			if(at>=size) return(false);
+			c.taken++;
+			c.p=map+line_start(at);
+			c.end=map+line_start(at+CHUNK_BYTES);
+			if(c.end==map+size && map[size-1]!='\n') {
+				while(c.end>c.p && c.end[-1]!='\n') c.end--;
+			}
+			return(true);
+		}
 #ifndef SINGLE
-		pthread_mutex_lock(&linelock);
+		timed_lock(&chunklock,ts.chunk_wait);
+		if(!done && turns!=number) {
+			double start=wall_time();
+			while(!done && turns!=number) pthread_cond_wait(&turn_done,&chunklock);
+			ts.chunk_wait+=wall_time()-start;
+		}
 #endif
-		do {
-			getline(*current,line);														//read a line at a time from the plus strand hit file, then switch to minus
-		} while(line=="" && current->good());
-		if(!current->good()) {
-			current=&two;
-			strand="minus";
-			do {
-				getline(two,line);
-			} while(line=="" && two.good());
-		}
-		str=strand;
-		ret=current->good();
+		if(done) {
 #ifndef SINGLE
-		pthread_mutex_unlock(&linelock);
+			pthread_mutex_unlock(&chunklock);
 #endif
-		return;
+			return(false);
+		}
+		c.buf.resize(CHUNK_BYTES);
+		in.read(&c.buf[0],CHUNK_BYTES);
+		c.buf.resize(in.gcount());
+		string rest;
+		if(in.good() && !c.buf.empty() && c.buf.back()!='\n') {						//finish the line the chunk ends in
+			getline(in,rest);
+			c.buf.insert(c.buf.end(),rest.begin(),rest.end());
+			if(in.good()) c.buf.push_back('\n');
+		}
+		done=!in.good();
+		if(done) {
+			while(!c.buf.empty() && c.buf.back()!='\n') c.buf.pop_back();
+		}
+		turns++;
+		c.taken++;
+#ifndef SINGLE
+		pthread_cond_broadcast(&turn_done);
+		pthread_mutex_unlock(&chunklock);
+#endif
+		c.p=c.buf.empty() ? NULL : &c.buf[0];
+		c.end=c.p+c.buf.size();
+		return(true);
 	}
-	~file_reader_two() {
-		two.close();
+	~hit_source() {
+		if(map!=NULL) munmap(const_cast<char*>(map),size);
+		in.close();
+	}
+};
+
+class file_reader {																	//opens the hit file, or the plus then the minus hit file passed with -p and -m, and hands each thread chunks of it
+	hit_source sources[2];
+	size_t count;
+	void open(size_t i,const char *name,const char *strand,opt_parser &op) {
+		if(!sources[i].open(name,op.t)) {
+			cout << "Error: could not open hit file \"" << name << "\"\n";
+			exit(1);
+		}
+		sources[i].strand=strand;
+	}
+public:
+	file_reader(opt_parser &op) {
+		count=0;
+		if(op.hits!=NULL) open(count++,op.hits,"",op);
+		if(op.plushits!=NULL) open(count++,op.plushits,"plus",op);
+		if(op.minushits!=NULL) open(count++,op.minushits,"minus",op);
+	}
+	void read(string &line,string &str,int &ret,hit_chunk &c,thread_stats &ts) {				//the next non-empty line of the thread's chunk, taking a new chunk when it is used up
+		while(true) {
+			if(c.p==c.end) {
+				while(c.source<count && !sources[c.source].claim(c,ts)) {
+					c.source++;
+					c.taken=0;
+				}
+				if(c.source==count) {
+					ret=0;
+					return;
+				}
+				continue;
+			}
+			const char *eol=(const char*)memchr(c.p,'\n',c.end-c.p);				//chunks only hold whole lines
+			line.assign(c.p,eol);
+			c.p=eol+1;
+			if(!line.empty()) break;
+		}
+		str=sources[c.source].strand;												//supply strand and return value to calling function
+		ret=1;
+		ts.lines++;
+		return;
 	}
 };
 
@@ -1384,26 +1858,52 @@ class hit_parser : public data {
 		return(a<=b.second);
 	}
 protected:
-#ifndef SINGLE
-	pthread_mutex_t tablelock;
-#endif
 	int s,l;
+	int prefix;
 	file_reader *fr;
+	vector<bin_sums> sums;															//one set per query thread
+	vector<vector<vector<pair<long,double> > > > points;							//--prefix-sums, per query thread the location and value of each hit by chromosome index and feature strand, chromosome*2+strand
+	size_t next_bucket;
+	void bin_feature(chr_entry &e,size_t i,vector<long> &loc,vector<long double> &cum,thread_stats &ts) {						//adds to each bin of feature i the hits intersect would give it, the bin upper_bound picks only changes where the location passes a bin end, so each stretch between bin ends is one range sum
+		vector<pair<long,long> > &bins=e.bins[i];
+		long lo=e.bins_start[i],hi=e.bins_end[i];
+		vector<long> cuts(1,lo);
+		for(size_t k=0;k<bins.size();k++) {
+			if(bins[k].second>=lo && bins[k].second<hi) cuts.push_back(bins[k].second+1);
+		}
+		sort(cuts.begin(),cuts.end());
+		cuts.erase(unique(cuts.begin(),cuts.end()),cuts.end());
+		size_t row=e.slot[i]*bin_count;
+		ts.candidates++;
+		for(size_t c=0;c<cuts.size();c++) {
+			long from=cuts[c],to=(c+1<cuts.size()) ? cuts[c+1]-1 : hi;
+			vector<pair<long,long> >::iterator j=upper_bound(bins.begin(),bins.end(),from,comp_func_ub);
+			if(j==bins.end()) continue;
+			if(j->first>from) from=j->first;																				//hits before the bin start go nowhere
+			if(from>to) continue;
+			size_t a=lower_bound(loc.begin(),loc.end(),from)-loc.begin();
+			size_t z=upper_bound(loc.begin(),loc.end(),to)-loc.begin();
+			if(a==z) continue;
+			totals[row+(j-bins.begin())]+=(double)(cum[z]-cum[a]);
+			counts[row+(j-bins.begin())]+=z-a;
+			ts.matches+=z-a;
+		}
+	}
 public:
 	hit_parser(opt_parser &op) {
-#ifndef SINGLE
-		pthread_mutex_init(&tablelock,NULL);
-#endif
 		s=op.s;
 		l=op.l;
-		if(op.plushits==NULL && op.minushits==NULL) {
-			fr=new file_reader(op);
-		}
-		else if(op.plushits==NULL || op.minushits==NULL) {
-			fr=new file_reader_one(op);
+		prefix=op.prefix;
+		fr=new file_reader(op);
+		sums.resize(op.t);
+		if(prefix) {																	//hits are binned by sum_buckets once all are read, so no per-thread sums are needed
+			points.assign(op.t,vector<vector<pair<long,double> > >(chr_db.size()*2));
+			next_bucket=0;
+			return;
 		}
-		else {
-			fr=new file_reader_two(op);
+		for(size_t t=0;t<sums.size();t++) {
+			sums[t].total.assign(totals.size(),0);
+			sums[t].count.assign(counts.size(),0);
 		}
 	}
 	virtual ~hit_parser() {
@@ -1442,65 +1942,97 @@ public:
 			}
 		}
 	}
-	void query(void) {																																//performs intersection of hit location and bins of all features
+	void intersect(chr_entry &e,hit_entry &he,thread_stats &ts,bin_sums &sum,vector<size_t> &rows) {																	//adds the hit to the bin it falls in of every feature whose overall bin range holds it
 		ptr_entry arrays;
+		ts.candidates+=e.stab(he.location,rows);																								//find the features whose overall bin start and end hold the hit location
+		if(rows.empty()) return;
+		arrays.bins=&e.bins[0];																													//store pointers to bin information to reduce lookups
+		arrays.slot=&e.slot[0];
+		for(size_t r=0;r<rows.size();r++) {
+			size_t i=rows[r];
+			vector<pair<long,long> >::iterator j=upper_bound(arrays.bins[i].begin(),arrays.bins[i].end(),he.location,comp_func_ub);		//find first bin with end coordinate greater than or equal to hit location
+			if(he.location>=j->first) {																									//ensure hit location is also greater than or equal to bin start
+				ts.matches++;
+				size_t bin=arrays.slot[i]*bin_count+(j-arrays.bins[i].begin());
+				sum.total[bin]+=he.value;																								//add value to bin total, increment intersection count
+				sum.count[bin]++;
+			}
+		}
+	}
+	void query(thread_stats &done,size_t thread,size_t threads) {																						//performs intersection of hit location and bins of all features
+		thread_stats ts;																																			//counted on this thread's stack and stored once at the end, the threads' entries of the vector share cache lines
 		hit_entry he;
+		hit_chunk chunk(thread,threads);
+		bin_sums &sum=sums[thread];
+		vector<size_t> rows;																																		//features a hit falls within, reused for every hit
+		he.stats=&ts;
+		he.chunk=&chunk;
+		string last_chr;																															//chromosome of the previous hit, kept per thread
+		int last_id=-1;
 		if(s==0) {																																	//strand-independent matching
 			while(update(&he)) {
-				if(db.find(he.chr)!=db.end()) {
-					size_t max=db[he.chr].id.size();
-					arrays.id=&db[he.chr].id[0];																									//store pointers to bin information to reduce lookups
-					arrays.bins_start=&db[he.chr].bins_start[0];
-					arrays.bins_end=&db[he.chr].bins_end[0];
-					arrays.bins=&db[he.chr].bins[0];
-					for(size_t i=0;i<max;i++) {
-						if(he.location<arrays.bins_start[i] || he.location>arrays.bins_end[i]) continue;											//move to next gene list feature if hit locations falls outside of overall bin start and end
-						vector<pair<long,long> >::iterator j=upper_bound(arrays.bins[i].begin(),arrays.bins[i].end(),he.location,comp_func_ub);		//find first bin with end coordinate greater than or equal to hit location
-						if(he.location>=j->first) {																									//ensure hit location is also greater than or equal to bin start
-#ifndef SINGLE
-							pthread_mutex_lock(&tablelock);
-							table[arrays.id[i]].total[j-arrays.bins[i].begin()]+=he.value;															//add value to bin total, increment intersection count
-							table[arrays.id[i]].count[j-arrays.bins[i].begin()]++;
-							pthread_mutex_unlock(&tablelock);
-#else
-							table[arrays.id[i]].total[j-arrays.bins[i].begin()]+=he.value;															//add value to bin total, increment intersection count
-							table[arrays.id[i]].count[j-arrays.bins[i].begin()]++;
-#endif
-						}
-					}
-				}
+				int c=chr_index(he.chr,last_chr,last_id);
+				if(c<0 || chr_db[c].id.empty()) continue;
+				if(prefix) points[thread][c*2].push_back(pair<long,double>(he.location,he.value));
+				else intersect(chr_db[c],he,ts,sum,rows);
 			}
 		}
 		else {
 			while(update(&he)) {																													//for strand specific matching check same or opposite strand features only
-				string str=strand_map[he.strand];
-				if(db_split.find(str)!=db_split.end()) {
-					if(db_split[str].find(he.chr)!=db_split[str].end()) {
-						size_t max=db_split[str][he.chr].id.size();
-						arrays.id=&db_split[str][he.chr].id[0];
-						arrays.bins_start=&db_split[str][he.chr].bins_start[0];
-						arrays.bins_end=&db_split[str][he.chr].bins_end[0];
-						arrays.bins=&db_split[str][he.chr].bins[0];
-						for(size_t i=0;i<max;i++) {
-							if(he.location<arrays.bins_start[i] || he.location>arrays.bins_end[i]) continue;
-							vector<pair<long,long> >::iterator j=upper_bound(arrays.bins[i].begin(),arrays.bins[i].end(),he.location,comp_func_ub);
-							if(he.location>=j->first) {
+				int str=(he.strand=="plus") ? 0 : (he.strand=="minus") ? 1 : -1;
+				if(str>=0) {
+					if(s!=1) str=1-str;																												//opposite strand matching
+					int c=chr_index(he.chr,last_chr,last_id);
+					if(c<0 || chr_db_split[str][c].id.empty()) continue;
+					if(prefix) points[thread][c*2+str].push_back(pair<long,double>(he.location,he.value));
+					else intersect(chr_db_split[str][c],he,ts,sum,rows);
+				}
+			}
+		}
+		done.add(ts);
+		return;
+	}
+	void merge(void) {																																	//add each thread's sums to the bin matrices in thread order, so totals come out the same every run with a given thread count
+		for(size_t t=0;t<sums.size();t++) {
+			for(size_t k=0;k<totals.size();k++) {
+				totals[k]+=sums[t].total[k];
+				counts[k]+=sums[t].count[k];
+			}
+			vector<double>().swap(sums[t].total);
+			vector<long>().swap(sums[t].count);
+		}
+	}
+	void sum_buckets(thread_stats &done) {																											//--prefix-sums, takes one chromosome and strand at a time, sorts its hits and bins every feature there from cumulative sums
+		thread_stats ts;																																			//counted locally as in query
+		vector<long> loc;
+		vector<long double> cum;																													//long double so range sums of many hits lose little to rounding
+		while(true) {
 #ifndef SINGLE
-								pthread_mutex_lock(&tablelock);
-								table[arrays.id[i]].total[j-arrays.bins[i].begin()]+=he.value;
-								table[arrays.id[i]].count[j-arrays.bins[i].begin()]++;
-								pthread_mutex_unlock(&tablelock);
+			size_t b=__sync_fetch_and_add(&next_bucket,1);
 #else
-								table[arrays.id[i]].total[j-arrays.bins[i].begin()]+=he.value;
-								table[arrays.id[i]].count[j-arrays.bins[i].begin()]++;
+			size_t b=next_bucket++;
 #endif
-							}
-						}
-					}
-				}
+			if(b>=chr_db.size()*2) break;
+			if(s==0 && b%2==1) continue;
+			chr_entry &e=(s==0) ? chr_db[b/2] : chr_db_split[b%2][b/2];
+			vector<pair<long,double> > hits;
+			for(size_t t=0;t<points.size();t++) {
+				hits.insert(hits.end(),points[t][b].begin(),points[t][b].end());
+				vector<pair<long,double> >().swap(points[t][b]);
+			}
+			if(hits.empty()) continue;
+			sort(hits.begin(),hits.end());																											//by location then value, so the sums do not depend on which thread read which hit
+			loc.resize(hits.size());
+			cum.resize(hits.size()+1);
+			cum[0]=0;
+			for(size_t k=0;k<hits.size();k++) {
+				loc[k]=hits[k].first;
+				cum[k+1]=cum[k]+hits[k].second;
 			}
+			vector<pair<long,double> >().swap(hits);
+			for(size_t i=0;i<e.bins.size();i++) bin_feature(e,i,loc,cum,ts);
 		}
-		return;
+		done.add(ts);
 	}
 };
 
@@ -1511,12 +2043,13 @@ public:
 		int ret;
 		string line,str;
 		long start,end;
-		fr->read(line,str,ret);
+		fr->read(line,str,ret,*he->chunk,*he->stats);
 		istringstream linestream(line);
 		linestream >> he->chr >> start >> end >> he->value;
 		if(linestream.fail() && ret==1) {
 			if(he->chr!="track") {
 				cout << "Hit file contains bad line, skipping: " << line << "\n";
+				he->stats->bad++;
 			}
 			return(update(he));															//loop recursively until a "good" line is discovered
 		}
@@ -1533,12 +2066,13 @@ public:
 		int ret;
 		string line,str;
 		long start,end;
-		fr->read(line,str,ret);
+		fr->read(line,str,ret,*he->chunk,*he->stats);
 		istringstream linestream(line);
 		linestream >> he->chr >> start >> end;
 		if(linestream.fail() && ret==1) {
 			if(he->chr!="track") {
 				cout << "Hit file contains bad line, skipping: " << line << "\n";
+				he->stats->bad++;
 			}
 			return(update(he));
 		}
@@ -1557,11 +2091,12 @@ public:
 		int ret;
 		string line,str,temp;
 		long start,end;
-		fr->read(line,str,ret);
+		fr->read(line,str,ret,*he->chunk,*he->stats);
 		istringstream linestream(line);
 		linestream >> temp >> he->value >> he->chr >> start >> end;
 		if(linestream.fail() && ret==1) {
 			cout << "Hit file contains bad line, skipping: " << line << "\n";
+			he->stats->bad++;
 			return(update(he));
 		}
 		set_location(he,str,start,end);
@@ -1576,7 +2111,7 @@ public:
 		int ret;
 		string line,str,temp;
 		long start,end;
-		fr->read(line,str,ret);
+		fr->read(line,str,ret,*he->chunk,*he->stats);
 		istringstream linestream(line);
 		linestream >> temp >> he->value >> he->chr >> start >> end >> str;
 		if(str!="plus" && str!="minus") {
@@ -1584,6 +2119,7 @@ public:
 		}
 		if(linestream.fail() && ret==1) {
 			cout << "Hit file contains bad line, skipping: " << line << "\n";
+			he->stats->bad++;
 			return(update(he));
 		}
 		he->strand=str;
@@ -1599,13 +2135,14 @@ public:
 		int ret;
 		string line,str,temp,temp2;
 		long start,end;
-		fr->read(line,str,ret);
+		fr->read(line,str,ret,*he->chunk,*he->stats);
 		he->strand=str;
 		istringstream linestream(line);
 		linestream >> he->chr >> start >> end >> temp >> temp2;
 		if(linestream.fail() && ret==1) {
 			if(he->chr!="track") {
 				cout << "Hit file contains bad line, skipping: " << line << "\n";
+				he->stats->bad++;
 			}
 			return(update(he));
 		}
@@ -1624,7 +2161,7 @@ public:
 		string line,str,temp,temp2;
 		char prestr;
 		long start,end;
-		fr->read(line,str,ret);
+		fr->read(line,str,ret,*he->chunk,*he->stats);
 		istringstream linestream(line);
 		linestream >> he->chr >> start >> end >> temp >> temp2 >> prestr;
 		switch(prestr) {
@@ -1641,6 +2178,7 @@ public:
 		if(linestream.fail() && ret==1) {
 			if(he->chr!="track") {
 				cout << "Hit file contains bad line, skipping: " << line << "\n";
+				he->stats->bad++;
 			}
 			return(update(he));
 		}
@@ -1652,18 +2190,34 @@ public:
 };
 
 #ifndef SINGLE
-void *t_query(void *hit) {															//reads lines from the hit file(s) and performs intersections, exits when no more lines are available
-	hit_parser *hp=reinterpret_cast<hit_parser*>(hit);
-	hp->query();
+struct query_arg {																	//hit parser shared by the query threads, the counters of one of them and its place among them
+	hit_parser *hp;
+	thread_stats *ts;
+	int thread,threads;
+};
+
+void *t_query(void *arg) {															//reads lines from the hit file(s) and performs intersections, exits when no more lines are available
+	query_arg *qa=reinterpret_cast<query_arg*>(arg);
+	qa->hp->query(*qa->ts,qa->thread,qa->threads);
+	pthread_exit(NULL);
+}
+
+void *t_sums(void *arg) {															//--prefix-sums, bins the kept hits one chromosome and strand at a time, exits when none are left
+	query_arg *qa=reinterpret_cast<query_arg*>(arg);
+	qa->hp->sum_buckets(*qa->ts);
 	pthread_exit(NULL);
 }
 #endif
 
 int main(int argc,char** args) {
+	run_stats stats;
 	opt_parser op(argc,args);
 	bin_parser bp(op);
+	stats.phase("bins");
 	hit_parser *hp;
 	genelist_parser glp(op,bp);
+	stats.phase("gene_list");
+	vector<thread_stats> ts(op.t);
 	switch(op.h) {																	//create appropriate object given input file type
 	case 0:
 		hp=new hit_parser_g(op);
@@ -1695,22 +2249,57 @@ int main(int argc,char** args) {
 #ifndef SINGLE
 	if(op.t>1) {																	//create specified number of threads to read hit file(s) and perform intersections
 		pthread_t tid[op.t];
+		vector<query_arg> qa(op.t);
 		int ti;
 		for(ti=0;ti<op.t;ti++) {
-			pthread_create(&tid[ti],NULL,t_query,reinterpret_cast<void*>(hp));
+			qa[ti].hp=hp;
+			qa[ti].ts=&ts[ti];
+			qa[ti].thread=ti;
+			qa[ti].threads=op.t;
+			pthread_create(&tid[ti],NULL,t_query,reinterpret_cast<void*>(&qa[ti]));
 		}
 		for(ti=0;ti<op.t;ti++) {													//wait until all threads exit
 			pthread_join(tid[ti],NULL);
 		}
 	}
 	else {																			//for single thread, just perform intersections
-		hp->query();
+		hp->query(ts[0],0,1);
 	}
 #else
-	hp->query();
+	hp->query(ts[0],0,1);
+#endif
+	stats.phase("hits");															//hit lines are parsed and matched as they are read, so both are one phase
+	if(op.prefix) {
+#ifndef SINGLE
+		if(op.t>1) {
+			pthread_t tid[op.t];
+			vector<query_arg> qa(op.t);
+			int ti;
+			for(ti=0;ti<op.t;ti++) {
+				qa[ti].hp=hp;
+				qa[ti].ts=&ts[ti];
+				pthread_create(&tid[ti],NULL,t_sums,reinterpret_cast<void*>(&qa[ti]));
+			}
+			for(ti=0;ti<op.t;ti++) {
+				pthread_join(tid[ti],NULL);
+			}
+		}
+		else {
+			hp->sum_buckets(ts[0]);
+		}
+#else
+		hp->sum_buckets(ts[0]);
 #endif
+		stats.phase("sums");
+	}
+	else {
+		hp->merge();
+		stats.phase("merge");
+	}
 	glp.print_header(op,bp);														//print results
 	glp.print_results(op);
 	delete hp;
+	stats.phase("output");
+	if(op.stats) stats.write(cerr,op.stats==2,ts);
 	return(0);
 }
@@ -16,9 +16,10 @@ use File::Basename;
 #
 #The script also provides methods for limiting output based on a list of genes or cpp results
 #The script also provides an option to generate gene_list files for use in draw_heatmap
+#and an option to write every transcript's annotation, no duplicates removed, for cppmatch --window
 #gene list files can also be used by match_genes to generate a fasta file
 my %option;
-getopts('i:o:f:r:s:c', \%option) || print_usage();
+getopts('i:o:f:r:s:ca', \%option) || print_usage();
 
 $Data::Dumper::Indent = 1;
 $Data::Dumper::Terse = 1;
@@ -39,6 +40,7 @@ my $forward_interval = $option{f};
 my $reverse_interval = $option{r};
 my $out_dir = $option{o};
 my $sub_name = $option{s};
+my $annotation = $option{a};
 
 my $subset = {};
 my $use_subset = 0;
@@ -81,8 +83,9 @@ sub read_cpp_result_total_line{
 }
 
 my $usage = join("\n",
-	"USAGE: perl tss2db_file.pl -c -i tss_file_name -f interval_forward -r interval_reverse -s [subset_file_name] -o output_dir",
+	"USAGE: perl tss2db_file.pl -c -a -i tss_file_name -f interval_forward -r interval_reverse -s [subset_file_name] -o output_dir",
 	"    -c using subset file and file is of form cpp_result_total",
+	"    -a write the annotation of every transcript for cppmatch --window, nearby duplicates are kept",
 	"    -i the tss input file",
 	"    -f interval forward",
 	"    -r interval reverse",
@@ -98,6 +101,8 @@ my $use_intervals = 1;
 unless(defined $forward_interval and defined $reverse_interval){
 	$use_intervals = 0;
 }
+#the annotation is flanked by cppmatch --window, so it takes no intervals
+die $usage if $annotation and (defined $forward_interval or defined $reverse_interval);
 
 my ($short_name, $path, $suffix) = fileparse($file_name, qr/\.[^.]*/);
 
@@ -111,6 +116,8 @@ if($sub_name){
 }
 if($use_intervals){
 	$out_name .= ".db_file";
+}elsif($annotation){
+	$out_name .= ".annotation";
 }else{
 	$out_name .= ".gene_list";
 }
@@ -142,9 +149,10 @@ while(my $line = readline($in_fh)){
 		next;
 	}
 
-	#don't record nearby duplicates
+	#don't record nearby duplicates, the annotation keeps them all since which
+	#are duplicates depends on the window cppmatch --window places
 	my $found = 0;
-	if($seen->{$values->[$enum->{gene_symbol}]}){
+	if(!$annotation and $seen->{$values->[$enum->{gene_symbol}]}){
 
 		#don't remember values we've seen already if they overlap the start site of known values 
 		foreach my $set (@{$seen->{$values->[$enum->{gene_symbol}]}}){
@@ -184,7 +192,8 @@ my $strand_map = {"+" => "plus", "-" => "minus"};
 
 open(my $out_fh, ">", $out_name) or die "can't open $out_name";
 foreach my $values (@$ordered_results){
-	unless($use_intervals){
+	#the gene_list spells out the strand, cppmatch DB files keep + and -
+	unless($use_intervals or $annotation){
 		$values->[$enum->{strand}] = $strand_map->{$values->[$enum->{strand}]};
 	}
 	#reorders to name, genSymbol, crhom, txstart, txend, strand for the cppmatch utility